@@ -35,7 +35,18 @@
 //  rdcost: RD-cost (Rate-Distortion Cost)
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+#include "HEVCe.h"                    // only for the declarations of the top functions and HEVCeConfig. This encoder includes no library header except the compiler's SIMD intrinsics, which are omitted with HEVCE_NO_SIMD.
 
+#if !defined(HEVCE_NO_SIMD) && ( defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86) ) && ( defined(__GNUC__) || defined(_MSC_VER) )
+#define HEVCE_SIMD                    // use the SIMD kernels (SSE4.1, AVX2) when the CPU supports them. Define HEVCE_NO_SIMD to use the C kernels only, then no header is included at all
+#if defined(__GNUC__) || _MSC_VER >= 1800
+#define HEVCE_AVX2                    // the compiler supports AVX2 intrinsics
+#endif
+#include <immintrin.h>                // SIMD intrinsics, provided by the compiler (not a library)
+#ifdef _MSC_VER
+#include <intrin.h>                   // __cpuid
+#endif
+#endif
 
 
 
@@ -45,7 +56,11 @@
 
 typedef  unsigned char  BOOL;          // unsigned integer, 8-bit, used as boolean: 0=false 1=true
 typedef  unsigned char  UI8;           // unsigned integer, 8-bit
+typedef    signed char  I8;            // signed integer, 8-bit, for the QP offsets of the CTUs (adaptive quantization)
+typedef          short  I16;           // signed integer, 16-bit, for the residuals and the coefficients , which are always in the HEVC coefficient range (see COEF_CLIP)
 typedef            int  I32;           // signed integer, must be at least 32 bits 
+typedef      long long  I64;           // signed integer, 64-bit, for the pixel offsets and buffer sizes of large images
+typedef     HEVCePixel  PIX;           // pixel, UI8 when HEVCE_BIT_DEPTH=8, or 16-bit for the high bit depths (see HEVCe.h)
 
 
 
@@ -59,16 +74,12 @@ typedef            int  I32;           // signed integer, must be at least 32 bi
 #define    NULL                 0
 #endif
 
-#define    MAX_YSZ              8192                               // max image height
-#define    MAX_XSZ              8192                               // max image width
-
 #define    CTU_SZ               32                                 // CTU        : 32x32
 #define    MIN_CU_SZ            8                                  // minimal CU : 8x8
 #define    MIN_TU_SZ            4                                  // minimal TU : 4x4
 
 #define    GETnTU(i)            ((i) / MIN_TU_SZ)
 #define    nTUinCTU             GETnTU(CTU_SZ)                     // number of rows/colums of minimal TU in a CTU , =8
-#define    nTUinROW             GETnTU(MAX_XSZ)                    // number of columns of minimal TU in image row
 
 #define    CG_SZ                4                                  // coefficient group (CG) size
 #define    CG_SZxSZ             (CG_SZ*CG_SZ)
@@ -90,6 +101,12 @@ typedef enum {
     CH_V = 2                                                       // V : chroma-red  channel (Cr)
 } ChannelType ;
 
+typedef enum {
+    PART_2Nx2N         = 0,                                        // part2Nx2N , no splitting to 4 TUs
+    PART_2Nx2N_TUsplit = 1,                                        // part2Nx2N , splitting to 4 TUs
+    PART_NxN           = 2                                         // partNxN (splitting to 4 PUs, each PU is a TU) , only for the 8x8 CU
+} PartType ;
+
 #define    PMODE_PLANAR         0                                  // planar prediction mode
 #define    PMODE_DC             1                                  // DC prediction mode
 #define    PMODE_DEG45          2                                  // angular prediction mode : up right   ( 45 degree)
@@ -101,9 +118,11 @@ typedef enum {
 
 #define    I32_MAX_VALUE        ((I32)(0x7fffffff))
 
-#define    PIX_MIN_VALUE        ((UI8)(  0))
-#define    PIX_MAX_VALUE        ((UI8)(255))
-#define    PIX_MIDDLE_VALUE     ((UI8)(128))
+#define    PIX_MIN_VALUE        ((PIX)(  0))
+#define    PIX_MAX_VALUE        ((PIX)((1<<HEVCE_BIT_DEPTH)-1))                                              // 255 for 8-bit, 1023 for 10-bit, 4095 for 12-bit
+#define    PIX_MIDDLE_VALUE     ((PIX)( 1<<(HEVCE_BIT_DEPTH-1)))                                             // 128 for 8-bit
+
+#define    BD_SHIFT             (HEVCE_BIT_DEPTH-8)                                                          // the extra bits of the high bit depths. The distortions are scaled down by it, so that the RD-cost weights (tuned for 8-bit) are kept
 
 #define    COEF_MIN_VALUE       ((I32)(-32768))
 #define    COEF_MAX_VALUE       ((I32)( 32767))
@@ -112,79 +131,173 @@ typedef enum {
 #define    MAX(x, y)            ( ((x)<(y)) ? (y) : (x) )                                                    // get the minimum value of x, y
 #define    MIN(x, y)            ( ((x)<(y)) ? (x) : (y) )                                                    // get the maximum value of x, y
 #define    CLIP(x, min, max)    ( MIN(MAX((x), (min)), (max)) )                                              // clip x between min~max
-#define    PIX_CLIP(x)          ( (UI8)CLIP((x),  PIX_MIN_VALUE,  PIX_MAX_VALUE) )                           // clip x between 0~255 , and convert it to UI8 type (pixel type)
+#define    PIX_CLIP(x)          ( (PIX)CLIP((x),  PIX_MIN_VALUE,  PIX_MAX_VALUE) )                           // clip x between 0~PIX_MAX_VALUE , and convert it to PIX type
 #define    COEF_CLIP(x)         ( (I32)CLIP((x), COEF_MIN_VALUE, COEF_MAX_VALUE) )                           // clip x between -32768~32767 (HEVC-specified coefficient range)
 
 
-#define GET2D(ptr, ysz, xsz, y, x) ( *( (ptr) + (xsz)*CLIP((y),0,(ysz)-1) + CLIP((x),0,(xsz)-1) ) )          // regard a 1-D array (ptr) as a 2-D array, and get value from position (y,x)
+#if   defined(_MSC_VER)
+#define    SIZED_INLINE         static __forceinline                                                         // for the templates on the block size, which are always inlined into their size-specialized instances (see DEFINE_SIZED_KERNELS)
+#elif defined(__GNUC__)
+#define    SIZED_INLINE         static inline __attribute__((always_inline))
+#else
+#define    SIZED_INLINE         static inline
+#endif
 
 
-#define BLK_SET(sz, value, dst) {                                               \
-    I32 i, j;                                                                   \
-    for (i=0; i<(sz); i++)                                                      \
-        for (j=0; j<(sz); j++)                                                  \
-            (dst)[i][j] = (value);                                              \
+I32 getHighestBit (I32 x) {                             // return the index of the highest 1 bit of x (x > 0) , with a bit scan instruction if the compiler provides it
+#if   defined(__GNUC__)
+    return 31 - __builtin_clz((unsigned)x);
+#elif defined(_MSC_VER) && defined(HEVCE_SIMD)
+    unsigned long i;
+    _BitScanReverse(&i, (unsigned long)x);
+    return (I32)i;
+#else
+    I32 i = 0;
+    for (; x>1; x>>=1)
+        i++;
+    return i;
+#endif
 }
 
 
-#define BLK_COPY(sz, src, dst) {                                                \
+#define GET2D(ptr, stride, ysz, xsz, y, x) ( *( (ptr) + (I64)(stride)*CLIP((y),0,(ysz)-1) + CLIP((x),0,(xsz)-1) ) )  // regard a 1-D array (ptr) as a 2-D array (row stride = stride), and get value from position (y,x)
+
+
+#define RCON_STRIDE          (1+CTU_SZ*2)                                                                 // the row stride of the reconstructed pixels of a CTU (see encodeCTU) : the left column, and the CTU with the above-right CTU in the above line. Pixel (y,x) of the CTU is at [(y+1)*RCON_STRIDE + (x+1)]
+#define MAP_STRIDE           (1+nTUinCTU)                                                                 // the row stride of the contexts of a CTU (map_cu_sz and map_pmode) : the left column and the CTU. Minimal TU (ty,tx) of the CTU is at [(ty+1)*MAP_STRIDE + (tx+1)]
+
+
+#define BLK_SET(sz, value, dst, dst_stride) {                                   \
     I32 i, j;                                                                   \
     for (i=0; i<(sz); i++)                                                      \
         for (j=0; j<(sz); j++)                                                  \
-            (dst)[i][j] = (src)[i][j];                                          \
+            (dst)[i*(dst_stride)+j] = (value);                                  \
 }
 
 
-#define BLK_SUB(sz, src1, src2, dst) {                                          \
+#define BLK_COPY(sz, src, src_stride, dst, dst_stride) {                        \
     I32 i, j;                                                                   \
     for (i=0; i<(sz); i++)                                                      \
         for (j=0; j<(sz); j++)                                                  \
-            (dst)[i][j] = ((I32)(src1)[i][j]) - (src2)[i][j];                   \
+            (dst)[i*(dst_stride)+j] = (src)[i*(src_stride)+j];                  \
 }
 
 
-#define BLK_ADD_CLIP_TO_PIX(sz, src1, src2, dst) {                              \
-    I32 i, j;                                                                   \
-    for (i=0; i<(sz); i++)                                                      \
-        for (j=0; j<(sz); j++)                                                  \
-            (dst)[i][j] = PIX_CLIP( (src1)[i][j] + (src2)[i][j] );              \
+#define VEC_COPY(n, src, dst) {                                                 \
+    I32 i;                                                                      \
+    for (i=0; i<(n); i++)                                                       \
+        (dst)[i] = (src)[i];                                                    \
+}
+
+
+// the pixel block kernels below get each pixel block by a pointer and a row stride, so that the block can be in a buffer of any width.
+// They are templates on the block size, instantiated for each size (see DEFINE_SIZED_PIXEL_KERNELS). BLK_SUB, BLK_ADD_CLIP_TO_PIX and CALC_BLK_SSE call the instance of sz through KERNELS (see initKernels).
+// A residual or coefficient block is always a contiguous I16 block whose row stride is its size, so that a 4x4 block takes 32 bytes instead of a 32-row array
+
+#define BLK_SUB(sz, src1, stride1, src2, stride2, dst)                  KERNELS.blkSub[(sz)/8]         ( (src1), (stride1), (src2), (stride2), (dst) )                                  // dst = src1 - src2
+
+#define BLK_ADD_CLIP_TO_PIX(sz, src1, src2, stride2, dst, dst_stride)   KERNELS.blkAddClipToPix[(sz)/8]( (src1), (src2), (stride2), (dst), (dst_stride) )                               // dst = clip(src1 + src2)
+
+#define CALC_BLK_SSE(sz, src1, stride1, src2, stride2, result)          ( (result) = KERNELS.calcBlkSSE[(sz)/8]( (src1), (stride1), (src2), (stride2) ) )                               // SSE (sum of squared error) as distortion
+
+
+// calculate residual : dst = src1 - src2
+SIZED_INLINE void blkSub (const I32 sz, const PIX *src1, const I32 stride1, const PIX *src2, const I32 stride2, I16 *dst) {
+    I32 i, j;
+    for (i=0; i<sz; i++, dst+=sz)
+        for (j=0; j<sz; j++)
+            dst[j] = (I16)( (I32)src1[i*stride1+j] - src2[i*stride2+j] );
 }
 
 
-BOOL blkNotAllZero (const I32 sz, const I32 src [][CTU_SZ]) {
+// reconstruction : dst = clip(src1 + src2) . src2 and dst can be the same block
+SIZED_INLINE void blkAddClipToPix (const I32 sz, const I16 *src1, const PIX *src2, const I32 stride2, PIX *dst, const I32 dst_stride) {
     I32 i, j;
-    for (i=0; i<sz; i++)
+    for (i=0; i<sz; i++, src1+=sz)
         for (j=0; j<sz; j++)
-            if (src[i][j] != 0)
-                return 1;
+            dst[i*dst_stride+j] = PIX_CLIP( src1[j] + src2[i*stride2+j] );
+}
+
+
+SIZED_INLINE BOOL blkNotAllZero (const I32 sz, const I16 *src) {
+    I32 i;
+    for (i=0; i<sz*sz; i++)
+        if (src[i] != 0)
+            return 1;
     return 0;
 }
 
 
-// calculate SSE (sum of squared error) as distortion, the result will be save on result
-#define CALC_BLK_SSE(sz, src1, src2, result) {                                  \
-    I32 i, j, diff;                                                             \
-    (result) = 0;                                                               \
-    for (i=0; i<(sz); i++) {                                                    \
-        for (j=0; j<(sz); j++) {                                                \
-            diff = ABS( (I32)(src1)[i][j] - (src2)[i][j] ) ;                    \
-            (result) += diff * diff;                                            \
-        }                                                                       \
-    }                                                                           \
+// calculate SSE (sum of squared error) as distortion, in the scale of 8-bit pixels
+SIZED_INLINE I32 calcBlkSSE (const I32 sz, const PIX *src1, const I32 stride1, const PIX *src2, const I32 stride2) {
+    I32 i, j, diff;
+    I64 result = 0;                                                                              // a 32x32 block of 12-bit pixels overflows 32-bit
+    for (i=0; i<sz; i++) {
+        for (j=0; j<sz; j++) {
+            diff = ABS( (I32)src1[i*stride1+j] - src2[i*stride2+j] ) ;
+            result += diff * diff;
+        }
+    }
+    return (I32)(result >> (2*BD_SHIFT));
+}
+
+
+#define    QP_COUNT             52                                 // QP = 0 ~ 51
+
+// the lambda of RD-cost is RDCOST_WEIGHT_BITS / RDCOST_WEIGHT_DIST , which approximates 0.57 * 2^((QP-12)/3) for each QP
+const I32 RDCOST_WEIGHT_DIST [QP_COUNT] = {  28,  22,  18,  14,  11,   9,   7,  11,   9,   7,  11,   9,   7,   7,   9,   7,  11,   5,   4,   6,   3,   2,   5,   3,   1,   2,
+                                              2,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1};
+const I32 RDCOST_WEIGHT_BITS [QP_COUNT] = {   1,   1,   1,   1,   1,   1,   1,   2,   2,   2,   4,   4,   4,   5,   8,   8,  16,   9,   9,  17,  11,   9,  29,  22,   9,  23,
+                                             29,  18,  23,  29,  36,  46,  58,  73,  92, 116, 146, 184, 232, 292, 368, 463, 584, 735, 927,1167,1471,1853,2335,2942,3706,4669};
+
+
+// the constants of a QP which are used in every RDO trial. They are prepared for all the QPs only once, when the encoder context is created (see initQPCache),
+// and shared by all the images encoded with the context, so the trials only read them instead of looking up and re-calculating them from the QP
+typedef struct {
+    I32  weight_dist;                 // RDCOST_WEIGHT_DIST[qp]
+    I32  weight_bits;                 // RDCOST_WEIGHT_BITS[qp]
+    I32  sqrt_lambda_x16;             // SQRT_LAMBDA_X16[qp] , for the rough cost of prediction modes (see calcSATDcost)
+    I32  qstep_sq_x16;                // QSTEP_SQ_X16[qp]
+    I32  qscale;                      // QUANT_SCALE[qp%6]
+    I32  lscale;                      // LEVEL_SCALE[qp%6]
+    I32  dqscale;                     // LEVEL_SCALE[qp%6] << (qp/6) , the scale of de-quantize
+    I32  qp_per;                      // qp/6
+} QPConsts;
+
+
+I32 calcRDcost (const QPConsts *qc, I32 dist, I32 bits) {                                        // calculate RD-cost, avoid overflow from 32-bit integer
+    const I64  cost = (I64)qc->weight_dist * dist + (I64)qc->weight_bits * bits;
+    return (I32)MIN(cost, I32_MAX_VALUE);
 }
 
 
-I32 calcRDcost (I32 qpd6, I32 dist, I32 bits) {                                                  // calculate RD-cost, avoid overflow from 32-bit integer
-    static const I32 RDCOST_WEIGHT_DIST [] = {11, 11, 11,  5,  1};
-    static const I32 RDCOST_WEIGHT_BITS [] = { 1,  4, 16, 29, 23};
-    const I32  weight1 = RDCOST_WEIGHT_DIST[qpd6];
-    const I32  weight2 = RDCOST_WEIGHT_BITS[qpd6];
-    const I32  cost1 = (I32_MAX_VALUE / weight1 <= dist) ? I32_MAX_VALUE : weight1 * dist;       // avoiding multiply overflow
-    const I32  cost2 = (I32_MAX_VALUE / weight2 <= bits) ? I32_MAX_VALUE : weight2 * bits;       // avoiding multiply overflow
-    return             (I32_MAX_VALUE - cost1 <= cost2)  ? I32_MAX_VALUE : cost1 + cost2;        // avoiding add overflow
+#define    EST_BITS_SHIFT       8                                  // the bits estimated by the CABAC estimator are in units of 1/256 bit
+
+I32 calcRDcostEst (const QPConsts *qc, I32 dist, I32 est_bits) {                                // calculate RD-cost from the estimated bits (in units of 1/256 bit), in the same scale as calcRDcost
+    const I64  cost = (I64)qc->weight_dist * dist + (((I64)qc->weight_bits * est_bits) >> EST_BITS_SHIFT);
+    return (I32)MIN(cost, I32_MAX_VALUE);
 }
 
 
+// the hot block kernels are called through this table, so that the SIMD versions can be selected at runtime according to the CPU. See initKernels()
+// Each kernel has an instance for each block size, indexed by sz/8 like the other size tables (see SIZED_ENTRIES) , so the block size is a compile-time constant in every kernel
+typedef struct {
+    void (*blkSub              [5]) (const PIX *src1, const I32 stride1, const PIX *src2, const I32 stride2, I16 *dst);
+    void (*blkAddClipToPix     [5]) (const I16 *src1, const PIX *src2, const I32 stride2, PIX *dst, const I32 dst_stride);
+    I32  (*calcBlkSSE          [5]) (const PIX *src1, const I32 stride1, const PIX *src2, const I32 stride2);
+    I32  (*calcBlkSATD         [5]) (const PIX *src1, const I32 stride1, const PIX *src2, const I32 stride2);
+    void (*interpAngular       [5]) (const PIX *ref, const I32 frac, PIX *dst);
+    void (*partialButterfly    [5]) (const I32 sft, const I32 *src, I32 *dst);                                  // 8, 16 and 32 points only. The 4x4 DST has its own fast transform (see transformColumns)
+    void (*partialButterflyInv [5]) (const I32 sft, const I32 *src, I32 *dst);
+} KernelTable;
+
+extern const KernelTable KERNELS_C;                 // the C kernels, used until initKernels selects the SIMD ones
+
+const KernelTable *KERNELS_SELECTED = &KERNELS_C;   // only initKernels changes it, at most once, and the tables are never modified
+
+#define    KERNELS              ( *KERNELS_SELECTED )
+
+
 
 
 
@@ -199,46 +312,51 @@ void getBorder (
     const BOOL blb_exist,
     const BOOL baa_exist,
     const BOOL bar_exist,
-    const UI8  blk_rcon [][1+CTU_SZ*2],
-          UI8  ubla  [1],
-          UI8  ublb  [CTU_SZ*2],
-          UI8  ubar  [CTU_SZ*2],
-          UI8  fbla  [1],
-          UI8  fblb  [CTU_SZ*2],
-          UI8  fbar  [CTU_SZ*2]
+    const BOOL bla_exist,
+    const PIX *ctu_rcon,                                      // the reconstructed pixels of the CTU, with the above line and the left column (see RCON_STRIDE)
+    const I32  y,                                             // vertical   position of the block in the CTU
+    const I32  x,                                             // horizontal position of the block in the CTU
+          PIX  ubla  [1],
+          PIX  ublb  [CTU_SZ*2],
+          PIX  ubar  [CTU_SZ*2],
+          PIX  fbla  [1],
+          PIX  fblb  [CTU_SZ*2],
+          PIX  fbar  [CTU_SZ*2]
 ) {
     I32 i;
     
-    if      (bll_exist && baa_exist)                         // 1st, construct border on left-above pixel
-        ubla[0] = blk_rcon[-1][-1];
+    if      (bla_exist)                                      // 1st, construct border on left-above pixel
+        ubla[0] = ctu_rcon[ y   *RCON_STRIDE + x     ];          // pixel (y-1, x-1)
     else if (bll_exist)
-        ubla[0] = blk_rcon[ 0][-1];
+        ubla[0] = ctu_rcon[(y+1)*RCON_STRIDE + x     ];          // pixel (y  , x-1)
     else if (baa_exist)
-        ubla[0] = blk_rcon[-1][ 0];
+        ubla[0] = ctu_rcon[ y   *RCON_STRIDE + x+1   ];          // pixel (y-1, x  )
+    else if (bar_exist)                                      // only the above-right pixels exist (the above CTU is in the previous slice, but the above-right CTU is not). All the other border pixels are substituted by the first one of them
+        ubla[0] = ctu_rcon[ y   *RCON_STRIDE + x+1+sz];          // pixel (y-1, x+sz)
     else
         ubla[0] = PIX_MIDDLE_VALUE;
     
     for (i=0; i<sz; i++)                                     // 2nd, construct border on left pixels
         if (bll_exist)
-            ublb[i] = blk_rcon[i][-1];
+            ublb[i] = ctu_rcon[(y+1+i)*RCON_STRIDE + x];         // pixel (y+i, x-1)
         else
             ublb[i] = ubla[0];
     
     for (i=sz; i<sz*2; i++)                                  // 3rd, construct border on left-below pixels
         if (blb_exist)
-            ublb[i] = blk_rcon[i][-1];
+            ublb[i] = ctu_rcon[(y+1+i)*RCON_STRIDE + x];
         else
             ublb[i] = ublb[sz-1];
     
     for (i=0; i<sz; i++)                                     // 4th, construct border on above pixels
         if (baa_exist)
-            ubar[i] = blk_rcon[-1][i];
+            ubar[i] = ctu_rcon[y*RCON_STRIDE + x+1+i];           // pixel (y-1, x+i)
         else
             ubar[i] = ubla[0];
     
     for (i=sz; i<sz*2; i++)                                  // 5th, construct border on above-right pixels
         if (bar_exist)
-            ubar[i] = blk_rcon[-1][i];
+            ubar[i] = ctu_rcon[y*RCON_STRIDE + x+1+i];
         else
             ubar[i] = ubar[sz-1];
     
@@ -258,18 +376,27 @@ void getBorder (
 
 
 
+// description : angular interpolation of a row of predicted pixels, from the reference pixels ref[0] ~ ref[sz]
+SIZED_INLINE void interpAngular (const I32 sz, const PIX *ref, const I32 frac, PIX *dst) {
+    I32 j;
+    for (j=0; j<sz; j++)
+        dst[j] = (PIX)( ( (32-frac)*ref[j] + frac*ref[j+1] + 16 ) >> 5 );
+}
+
+
+
 // description : do prediction, getting the predicted block
-void predict (
+SIZED_INLINE void predict (
     const I32  sz,
     const ChannelType  ch,
     const I32  pmode,
-    const UI8  ubla,
-    const UI8  ublb  [CTU_SZ*2],
-    const UI8  ubar  [CTU_SZ*2],
-    const UI8  fbla,
-    const UI8  fblb  [CTU_SZ*2],
-    const UI8  fbar  [CTU_SZ*2],
-          UI8  dst   [CTU_SZ][CTU_SZ]                                                 // the predict result block will be put here
+    const PIX  ubla,
+    const PIX  ublb  [CTU_SZ*2],
+    const PIX  ubar  [CTU_SZ*2],
+    const PIX  fbla,
+    const PIX  fblb  [CTU_SZ*2],
+    const PIX  fbar  [CTU_SZ*2],
+          PIX *dst                                                                     // the predict result block will be put here (row stride = sz)
 ) {
     static const BOOL WHETHER_FILTER_BORDER_FOR_Y_TABLE [][35] = {
       { 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0 },      // sz = 4x4   , pmode = 0~34
@@ -284,9 +411,9 @@ void predict (
     
     const BOOL whether_filter_edge   = (ch==CH_Y) && (sz <= 16);
     const BOOL whether_filter_border = (ch==CH_Y) && WHETHER_FILTER_BORDER_FOR_Y_TABLE[sz/8][pmode];
-    const UI8  bla = whether_filter_border ? fbla : ubla;
-    const UI8 *blb = whether_filter_border ? fblb : ublb;
-    const UI8 *bar = whether_filter_border ? fbar : ubar;
+    const PIX  bla = whether_filter_border ? fbla : ubla;
+    const PIX *blb = whether_filter_border ? fblb : ublb;
+    const PIX *bar = whether_filter_border ? fbar : ubar;
     
     I32 i, j;
     
@@ -295,7 +422,7 @@ void predict (
             for (j=0; j<sz; j++) {
                 const I32 hor_pred = (sz-j-1) * blb[i] + (j+1) * bar[sz];
                 const I32 ver_pred = (sz-i-1) * bar[j] + (i+1) * blb[sz];
-                dst[i][j] = (UI8)( (sz + hor_pred + ver_pred) / (sz*2) );
+                dst[i*sz+j] = (PIX)( (sz + hor_pred + ver_pred) / (sz*2) );
             }
         }
         
@@ -307,36 +434,36 @@ void predict (
         
         for (i=0; i<sz; i++)
             for (j=0; j<sz; j++)
-                dst[i][j] = (UI8)dc_pix;                                         // fill all predict pixels with dc_pix
+                dst[i*sz+j] = (PIX)dc_pix;                                      // fill all predict pixels with dc_pix
         
         if (whether_filter_edge) {                                               // apply the edge filter for DC mode
-            dst[0][0] = (UI8)( (2 + 2*dc_pix + blb[0] + bar[0]) >> 2 );          // filter the top-left pixel        of the predicted CU
+            dst[0]    = (PIX)( (2 + 2*dc_pix + blb[0] + bar[0]) >> 2 );          // filter the top-left pixel        of the predicted CU
             for (i=1; i<sz; i++) {
-                dst[0][i] = (UI8)( (2 + 3*dc_pix + bar[i] ) >> 2 );              // filter the pixels in top row     of the predicted CU (except the top-left pixel)
-                dst[i][0] = (UI8)( (2 + 3*dc_pix + blb[i] ) >> 2 );              // filter the pixels in left column of the predicted CU (except the top-left pixel)
+                dst[i]    = (PIX)( (2 + 3*dc_pix + bar[i] ) >> 2 );              // filter the pixels in top row     of the predicted CU (except the top-left pixel)
+                dst[i*sz] = (PIX)( (2 + 3*dc_pix + blb[i] ) >> 2 );              // filter the pixels in left column of the predicted CU (except the top-left pixel)
             }
         }
         
     } else if ( pmode == PMODE_HOR    ) {                                        // angular mode : pure horizontal
         for (i=0; i<sz; i++)
             for (j=0; j<sz; j++)
-                dst[i][j] = blb[i];
+                dst[i*sz+j] = blb[i];
         
         if (whether_filter_edge)
             for (j=0; j<sz; j++) {
                 const I32 bias = (bar[j] - bla) >> 1;
-                dst[0][j] = PIX_CLIP( bias + dst[0][j] );
+                dst[j] = PIX_CLIP( bias + dst[j] );
             }
         
     } else if ( pmode == PMODE_VER    ) {                                        // angular mode : pure vertical
         for (i=0; i<sz; i++)
             for (j=0; j<sz; j++)
-                dst[i][j] = bar[j];
+                dst[i*sz+j] = bar[j];
         
         if (whether_filter_edge)
             for (i=0; i<sz; i++) {
                 const I32 bias = (blb[i] - bla) >> 1;
-                dst[i][0] = PIX_CLIP( bias + dst[i][0] );
+                dst[i*sz] = PIX_CLIP( bias + dst[i*sz] );
             }
         
     } else {                                                                     // pmode = 2~9, 11~25, 27~34  (angular mode without pure horizontal and pure vertical)
@@ -344,11 +471,11 @@ void predict (
         const I32  angle         = ANGLE_TABLE        [pmode];
         const I32  abs_inv_angle = ABS_INV_ANGLE_TABLE[pmode];
         
-        const UI8 *bmain = is_horizontal ? blb : bar;
-        const UI8 *bside = is_horizontal ? bar : blb;
+        const PIX *bmain = is_horizontal ? blb : bar;
+        const PIX *bside = is_horizontal ? bar : blb;
         
-        UI8  ref_buff0 [CTU_SZ*4+1] ;
-        UI8 *ref_buff = ref_buff0 + CTU_SZ*2;
+        PIX  ref_buff0 [CTU_SZ*4+2] ;
+        PIX *ref_buff = ref_buff0 + CTU_SZ*2;
         
         ref_buff[0] = bla;
         
@@ -365,17 +492,16 @@ void predict (
         
         for (i=0; i<sz; i++) {
             const I32 offset   = angle * (i+1);
-            const I32 offset_i = offset >> 5;
-            const I32 offset_f = offset & 0x1f;
-            for (j=0; j<sz; j++) {
-                const UI8 pix1 = ref_buff[offset_i+j+1];
-                const UI8 pix2 = ref_buff[offset_i+j+2];
-                const UI8 pix  = (UI8)( ( (32-offset_f)*pix1 + offset_f*pix2 + 16 ) >> 5 );
-                if (is_horizontal)
-                    dst[j][i] = pix;
-                else
-                    dst[i][j] = pix;
-            }
+            KERNELS.interpAngular[sz/8](&ref_buff[(offset>>5)+1], (offset&0x1f), &dst[i*sz]);          // for horizontal mode, this is a column of the predicted block, which is transposed later
+        }
+        
+        if (is_horizontal) {
+            for (i=1; i<sz; i++)
+                for (j=0; j<i; j++) {
+                    const PIX pix = dst[i*sz+j];
+                    dst[i*sz+j] = dst[j*sz+i];
+                    dst[j*sz+i] = pix;
+                }
         }
     }
 }
@@ -493,8 +619,8 @@ void matMul (
 
 
 
-// description : do transform (DCT or 4x4 DST) , or inverse transform  (inv-DCT or 4x4 inv-DST)
-void transform (
+// description : do transform (DCT or 4x4 DST) , or inverse transform  (inv-DCT or 4x4 inv-DST) , using matrix multiply. This is the reference of transform()
+void transformRef (
     const I32  sz,                                        // block size
     const BOOL inverse,                                   // 0:transform    1:inverse transform
     const I32  src   [][CTU_SZ],
@@ -508,8 +634,8 @@ void transform (
 
     const I32 (*mat) [CTU_SZ] = TABLE_TRANSFORM_MAT[sz/8];
 
-    const I32 a = inverse ?  7 : TABLE_A_FOR_TRANSFORM[sz/8];
-    const I32 b = inverse ? 12 : a + 7;
+    const I32 a = inverse ?  7            : TABLE_A_FOR_TRANSFORM[sz/8] + BD_SHIFT;          // the coefficients of the high bit depths are in the same range as 8-bit
+    const I32 b = inverse ? 12 - BD_SHIFT : TABLE_A_FOR_TRANSFORM[sz/8] + 7;                   // the inverse transform outputs the residual of HEVCE_BIT_DEPTH
 
     matMul(sz, inverse,  0, a, inverse, mat, src, tmp);                // (W = C * X) for transform , (W = CT * X) for inverse-transform
     matMul(sz, 0, !inverse, b, inverse, tmp, mat, dst);
@@ -517,16 +643,236 @@ void transform (
 
 
 
+// description : transpose a block
+SIZED_INLINE void transposeBlk (
+    const I32  sz,
+    const I32 *src,                                       // contiguous block (row stride = sz)
+          I32 *dst                                        // contiguous block (row stride = sz)
+) {
+    I32 i, j;
+    for (i=0; i<sz; i++)
+        for (j=0; j<sz; j++)
+            dst[j*sz+i] = src[i*sz+j];
+}
+
+
+
+// description : 4-point DST on each column of a 4x4 block : dst = (DST4_MAT * src) >> sft , with 11 multiplies instead of 16 for each column
+SIZED_INLINE void fastDST4 (
+    const I32  sft,
+    const I32 *src,                                       // contiguous 4x4 block (row stride = 4)
+          I32 *dst                                        // contiguous 4x4 block (row stride = 4)
+) {
+    const I32 add = 1 << sft >> 1;
+    I32 j, c0, c1, c2, c3;
+    for (j=0; j<4; j++) {
+        c0 = src[0*4+j] + src[3*4+j];
+        c1 = src[1*4+j] + src[3*4+j];
+        c2 = src[0*4+j] - src[1*4+j];
+        c3 = 74 * src[2*4+j];
+        dst[0*4+j] = ( add + 29*c0 + 55*c1 + c3                        ) >> sft;
+        dst[1*4+j] = ( add + 74*(src[0*4+j] + src[1*4+j] - src[3*4+j]) ) >> sft;
+        dst[2*4+j] = ( add + 29*c2 + 55*c0 - c3                        ) >> sft;
+        dst[3*4+j] = ( add + 55*c2 - 29*c1 + c3                        ) >> sft;
+    }
+}
+
+
+
+// description : 4-point inverse DST on each column of a 4x4 block : dst = clip( (DST4_MAT^T * src) >> sft ) , with 11 multiplies instead of 16 for each column
+SIZED_INLINE void fastInvDST4 (
+    const I32  sft,
+    const I32 *src,                                       // contiguous 4x4 block (row stride = 4)
+          I32 *dst                                        // contiguous 4x4 block (row stride = 4)
+) {
+    const I32 add = 1 << sft >> 1;
+    I32 j, c0, c1, c2, c3;
+    for (j=0; j<4; j++) {
+        c0 = src[0*4+j] + src[2*4+j];
+        c1 = src[2*4+j] + src[3*4+j];
+        c2 = src[0*4+j] - src[3*4+j];
+        c3 = 74 * src[1*4+j];
+        dst[0*4+j] = COEF_CLIP( ( add + 29*c0 + 55*c1 + c3                        ) >> sft );
+        dst[1*4+j] = COEF_CLIP( ( add + 55*c2 - 29*c1 + c3                        ) >> sft );
+        dst[2*4+j] = COEF_CLIP( ( add + 74*(src[0*4+j] - src[2*4+j] + src[3*4+j]) ) >> sft );
+        dst[3*4+j] = COEF_CLIP( ( add + 55*c0 + 29*c2 - c3                        ) >> sft );
+    }
+}
+
+
+
+// description : DCT (8, 16 or 32 points) on each column of a block by partial butterfly : dst = (mat * src) >> sft
+//               The even rows of a DCT matrix are symmetric and the odd rows are anti-symmetric. So each column is folded to the sum half (E) and the difference half (O),
+//               the odd rows only need to multiply O, and the even rows are the DCT of half size on E, which is folded again, until 2 points are left.
+//               For 32 points, it needs 344 multiplies instead of 1024, and the result is exactly the same as the matrix multiply.
+//               All the columns are processed together, so that the inner loops run along a row and can be vectorized by the compiler.
+//               It is a template on sz, instantiated for 8, 16 and 32 points with their own matrix and scratch buffers (see DEFINE_SIZED_BUTTERFLIES)
+SIZED_INLINE void partialButterfly (
+    const I32  sz,
+    const I32  mat   [][CTU_SZ],
+    const I32  sft,
+    const I32 *src,                                       // contiguous block (row stride = sz)
+          I32 *dst,                                       // contiguous block (row stride = sz)
+          I32 *e,                                         // scratch : sz*sz   items , the sum        halves (E)
+          I32 *o                                          // scratch : sz*sz/2 items , the difference halves (O)
+) {
+    const I32 add = 1 << sft >> 1;
+    I32 n, step, i, j, k;
+    
+    for (k=0; k<sz; k++)
+        for (j=0; j<sz; j++)
+            e[k*sz+j] = src[k*sz+j];
+    
+    for (n=sz, step=1; n>2; n/=2, step*=2) {              // n: current length of E .  step: the rows of mat used in this level are multiples of step
+        for (k=0; k<n/2; k++) {
+            for (j=0; j<sz; j++) {
+                o[k*sz+j] = e[k*sz+j] - e[(n-1-k)*sz+j];  // difference half
+                e[k*sz+j] = e[k*sz+j] + e[(n-1-k)*sz+j];  // sum half
+            }
+        }
+        for (i=step; i<sz; i+=2*step) {                   // odd rows of this level
+            for (j=0; j<sz; j++)
+                dst[i*sz+j] = add;
+            for (k=0; k<n/2; k++)
+                for (j=0; j<sz; j++)
+                    dst[i*sz+j] += mat[i][k] * o[k*sz+j];
+            for (j=0; j<sz; j++)
+                dst[i*sz+j] >>= sft;
+        }
+    }
+    
+    for (j=0; j<sz; j++) {
+        dst[0*sz   +j] = ( add + mat[0]   [0] * e[0*sz+j] + mat[0]   [1] * e[1*sz+j] ) >> sft;
+        dst[step*sz+j] = ( add + mat[step][0] * e[0*sz+j] + mat[step][1] * e[1*sz+j] ) >> sft;
+    }
+}
+
+
+
+// description : inverse DCT (8, 16 or 32 points) on each column of a block by partial butterfly : dst = clip( (mat^T * src) >> sft ) , the reverse process of partialButterfly()
+SIZED_INLINE void partialButterflyInv (
+    const I32  sz,
+    const I32  mat   [][CTU_SZ],
+    const I32  sft,
+    const I32 *src,                                       // contiguous block (row stride = sz)
+          I32 *dst,                                       // contiguous block (row stride = sz)
+          I32 *e,                                         // scratch : sz*sz items , the even parts (E)
+          I32 *o                                          // scratch : sz*sz items , o[n/2] ~ o[n-1] (rows) saves the odd part of the level whose length is n
+) {
+    const I32 add = 1 << sft >> 1;
+    I32 n, step, i, j, k;
+    
+    for (n=sz, step=1; n>2; n/=2, step*=2) {
+        for (k=0; k<n/2; k++) {                           // odd rows of this level
+            for (j=0; j<sz; j++)
+                o[(n/2+k)*sz+j] = 0;
+            for (i=step; i<sz; i+=2*step)
+                for (j=0; j<sz; j++)
+                    o[(n/2+k)*sz+j] += mat[i][k] * src[i*sz+j];
+        }
+    }
+    
+    for (j=0; j<sz; j++) {
+        e[0*sz+j] = mat[0][0] * src[0*sz+j] + mat[step][0] * src[step*sz+j];
+        e[1*sz+j] = mat[0][1] * src[0*sz+j] + mat[step][1] * src[step*sz+j];
+    }
+    
+    for (n=4; n<=sz; n*=2) {                              // unfold E and O to the columns of length n
+        for (k=0; k<n/2; k++) {
+            for (j=0; j<sz; j++) {
+                e[(n-1-k)*sz+j] = e[k*sz+j] - o[(n/2+k)*sz+j];
+                e[k*sz+j]       = e[k*sz+j] + o[(n/2+k)*sz+j];
+            }
+        }
+    }
+    
+    for (k=0; k<sz; k++)
+        for (j=0; j<sz; j++)
+            dst[k*sz+j] = COEF_CLIP( (e[k*sz+j] + add) >> sft );
+}
+
+
+
+// instantiate the partial butterflies for a DCT size, with its matrix and with the scratch buffers of its size
+#define DEFINE_SIZED_BUTTERFLIES(SZ)                                                            \
+void partialButterfly##SZ (const I32 sft, const I32 *src, I32 *dst) {                           \
+    I32 e [SZ*SZ], o [SZ*SZ/2];                                                                 \
+    partialButterfly(SZ, DCT##SZ##_MAT, sft, src, dst, e, o);                                   \
+}                                                                                               \
+void partialButterflyInv##SZ (const I32 sft, const I32 *src, I32 *dst) {                        \
+    I32 e [SZ*SZ], o [SZ*SZ];                                                                   \
+    partialButterflyInv(SZ, DCT##SZ##_MAT, sft, src, dst, e, o);                                \
+}
+
+DEFINE_SIZED_BUTTERFLIES(8)
+DEFINE_SIZED_BUTTERFLIES(16)
+DEFINE_SIZED_BUTTERFLIES(32)
+
+
+
+// description : 1-D transform (DCT or 4x4 DST) , or inverse transform , on each column of a block.
+//               The 4x4 DST is specialized, and the partial butterflies of sz are called through KERNELS (selected per CPU)
+SIZED_INLINE void transformColumns (
+    const I32  sz,
+    const BOOL inverse,
+    const I32  sft,
+    const I32 *src,                                       // contiguous block (row stride = sz)
+          I32 *dst                                        // contiguous block (row stride = sz)
+) {
+    if      (sz == 4 && !inverse)  fastDST4                           (sft, src, dst);
+    else if (sz == 4)              fastInvDST4                        (sft, src, dst);
+    else if (!inverse)             KERNELS.partialButterfly   [sz/8]  (sft, src, dst);
+    else                           KERNELS.partialButterflyInv[sz/8]  (sft, src, dst);
+}
+
+
+
+// description : do transform (DCT or 4x4 DST) , or inverse transform  (inv-DCT or 4x4 inv-DST) , using fast 1-D transforms on columns. Bit-exact to transformRef()
+//               the 1-D transforms work on 32-bit blocks. The shifts of the forward transform keep its outputs in the 16-bit coefficient range, and the inverse transform clips them
+SIZED_INLINE void transform (
+    const I32  sz,                                        // block size
+    const BOOL inverse,                                   // 0:transform    1:inverse transform
+    const I16 *src,                                       // contiguous block (row stride = sz)
+          I16 *dst,                                       // contiguous block (row stride = sz) , can be the same as src
+          I32 *tmp1,                                      // scratch : sz*sz items (see DEFINE_SIZED_KERNELS)
+          I32 *tmp2                                       // scratch : sz*sz items
+) {
+    //                                                TU size     4x4       8x8      16x16            32x32
+    static const I32    TABLE_A_FOR_TRANSFORM  []         = {       1 ,       2,         3,   -1,         4};
+
+    const I32 a = inverse ?  7            : TABLE_A_FOR_TRANSFORM[sz/8] + BD_SHIFT;          // the coefficients of the high bit depths are in the same range as 8-bit
+    const I32 b = inverse ? 12 - BD_SHIFT : TABLE_A_FOR_TRANSFORM[sz/8] + 7;                   // the inverse transform outputs the residual of HEVCE_BIT_DEPTH
+
+    I32  i, j;
+
+    for (i=0; i<sz*sz; i++)
+        tmp2[i] = src[i];                                              // widen to 32-bit
+
+    transformColumns(sz, inverse, a, tmp2, tmp1);                      // (W = C * X) for transform , (W = CT * X) for inverse-transform
+    transposeBlk(sz, tmp1, tmp2);
+    transformColumns(sz, inverse, b, tmp2, tmp1);                      // (YT = C * WT) for transform , (YT = CT * WT) for inverse-transform
+
+    for (i=0; i<sz; i++)
+        for (j=0; j<sz; j++)
+            dst[i*sz+j] = (I16)tmp1[j*sz+i];                           // transpose back, and narrow to 16-bit
+}
+
 
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // quantize and de-quantize
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-I32 estimateCoeffRate (I32 level) {
-    static const I32 LEVEL_RATE_TABLE [] = {0, 70000, 90000, 92000, 157536, 190304};
+#define    LEVEL_RATE_TABLE_LEN 64
+
+I32 estimateCoeffRate (I32 level) {                                                                 // the levels smaller than LEVEL_RATE_TABLE_LEN (almost all of them) are looked up in a flat table, the larger ones are calculated
+    static const I32 LEVEL_RATE_TABLE [LEVEL_RATE_TABLE_LEN] = {
+          0,  70000,  90000,  92000, 157536, 190304, 223072, 288608, 288608, 354144, 354144, 354144, 354144, 419680, 419680, 419680,
+     419680, 419680, 419680, 419680, 419680, 485216, 485216, 485216, 485216, 485216, 485216, 485216, 485216, 485216, 485216, 485216,
+     485216, 485216, 485216, 485216, 485216, 550752, 550752, 550752, 550752, 550752, 550752, 550752, 550752, 550752, 550752, 550752,
+     550752, 550752, 550752, 550752, 550752, 550752, 550752, 550752, 550752, 550752, 550752, 550752, 550752, 550752, 550752, 550752 };
     I32 i;
-    if ( level < 6 )
+    if ( level < LEVEL_RATE_TABLE_LEN )
         return LEVEL_RATE_TABLE[level];
     level -= 6;
     for (i=0; (1<<i)<=level; i++)
@@ -536,20 +882,27 @@ I32 estimateCoeffRate (I32 level) {
 
 
 
+// the quantize step is doubled every 6 QPs. QUANT_SCALE and LEVEL_SCALE are the HEVC-specified scales of QP%6 (QUANT_SCALE * LEVEL_SCALE ~= 2^20)
+const I32 QUANT_SCALE [6] = {26214, 23302, 20560, 18396, 16384, 14564};
+const I32 LEVEL_SCALE [6] = {   40,    45,    51,    57,    64,    72};
+
+
 // description : simplified rate-distortion optimized quantize (RDOQ) for a TU
-void quantize (
-    const I32  qpd6,
+SIZED_INLINE void quantize (
+    const QPConsts *qc,
     const I32  sz,
     const I32  pmode,
-    const I32  src [][CTU_SZ],
-          I32  dst [][CTU_SZ]
+    const I16 *src,                                       // contiguous block (row stride = sz)
+          I16 *dst                                        // contiguous block (row stride = sz)
 ) {
     //                            TU size     4x4   8x8   16x16      32x32
     static const I32 DIST_SHIFT_TABLE  [] = {   8 ,   7,      6, -1,     5};
     static const I32 LEVEL_SHIFT_TABLE [] = {  19 ,  18,     17, -1,    16};
 
+    const I32  qscale   = qc->qscale;
+    const I32  lscale   = qc->lscale;                                                               // scale the distortion back to the coefficient domain, which is the same for all QPs
     const I32  dist_sft =  DIST_SHIFT_TABLE[sz/8];
-    const I32  sft      = LEVEL_SHIFT_TABLE[sz/8] + qpd6;
+    const I32  sft      = LEVEL_SHIFT_TABLE[sz/8] + qc->qp_per;
     const I32  add      = (1<<sft>>1);
     const I32  max_dlevel = I32_MAX_VALUE - add;
     const I32  cg_dlevel_threshold = 9 << sft >> 2;
@@ -562,25 +915,27 @@ void quantize (
 
             for (y=yc; y<yc+CG_SZ; y++) {                                                           // for all coefficients in this CG
                 for (x=xc; x<xc+CG_SZ; x++) {
-                    I32  absval    = ABS(src[y][x]);
-                    I32  dlevel    = (absval>0x1ffff) ? max_dlevel : MIN( (absval & 0x1ffff)<<14 , max_dlevel );
+                    I32  absval    = ABS(src[y*sz+x]);
+                    I32  dlevel    = (absval > max_dlevel/qscale) ? max_dlevel : absval*qscale;
                     I32  level     = COEF_CLIP( (dlevel+add) >> sft );
                     I32  min_level = MAX(0, level-2);
                     I32  best_cost = I32_MAX_VALUE;
 
+                    dst[y*sz+x] = (I16)level;                                                              // in case all the costs are saturated
+                    
                     for (; level>=min_level; level--) {
-                        I32 dist1 = ABS( dlevel-(level<<sft) ) >> dist_sft;
-                        I32 dist  = ( (dist1<46340) ? (dist1*dist1) : I32_MAX_VALUE ) >> 7;         // 46340^2 ~= I32_MAX_VALUE
-                        I32 cost  = calcRDcost(qpd6, dist, estimateCoeffRate(level));
+                        const I64 dist1 = ( ABS( dlevel-((I64)level<<sft) ) >> dist_sft ) * lscale >> 6;     // 64-bit, since the error grows as 2^(qp/6) , and would saturate at the high QPs
+                        const I32 dist  = (I32)MIN( (dist1*dist1) >> 7 , I32_MAX_VALUE );                    // only the final distortion is clamped
+                        const I32 cost  = calcRDcost(qc, dist, estimateCoeffRate(level));
 
                         if (cost < best_cost) {                                                     // if current cost is smaller than previous cost
                             best_cost = cost;
-                            dst[y][x] = level;
+                            dst[y*sz+x] = (I16)level;
                         }
                     }
 
-                    if (src[y][x] < 0)
-                        dst[y][x] *= -1;                                                            // recover the sign
+                    if (src[y*sz+x] < 0)
+                        dst[y*sz+x] = (I16)(-dst[y*sz+x]);                                                            // recover the sign
                     
                     cg_sum_dlevel += MIN( dlevel , cg_dlevel_threshold );
                 }
@@ -589,29 +944,30 @@ void quantize (
             if ( cg_sum_dlevel < cg_dlevel_threshold )                                              // if this CG is too weak
                 for (y=yc; y<yc+CG_SZ; y++)
                     for (x=xc; x<xc+CG_SZ; x++)
-                        dst[y][x] = 0;                                                              // clear all items in CG
+                        dst[y*sz+x] = 0;                                                              // clear all items in CG
         }
     }
 }
 
 
 
-// description : de-quantize
-void deQuantize (
-    const I32  qpd6,
+// description : de-quantize, in the same way as the decoder : coef = (level * LEVEL_SCALE[qp%6] << (qp/6)) >> (log2(sz)-1) , rounded
+SIZED_INLINE void deQuantize (
+    const QPConsts *qc,
     const I32  sz,
-    const I32  src [][CTU_SZ],
-          I32  dst [][CTU_SZ]
+    const I16 *src,                                       // contiguous block (row stride = sz)
+          I16 *dst                                        // contiguous block (row stride = sz)
 ) {
     //                         TU size    4x4   8x8  16x16     32x32
-    static const I32 Q_SHIFT_TABLE [5] = { 5 ,   4,     3, -1,    2};
+    static const I32 Q_SHIFT_TABLE [5] = { 1 ,   2,     3, -1,    4};
 
-    const I32 q_sft = Q_SHIFT_TABLE[sz/8] + qpd6;
-    I32 i, j;
+    const I32 lscale = qc->dqscale;
+    const I32 q_sft  = Q_SHIFT_TABLE[sz/8];                                                         // the same for all bit depths : the decoder adds QpBdOffset to the qp, which cancels the bit depth in its shift
+    const I32 add    = 1 << q_sft >> 1;
+    I32 i;
 
-    for (i=0; i<sz; i++)
-        for (j=0; j<sz; j++)
-            dst[i][j] = COEF_CLIP( src[i][j] << q_sft );
+    for (i=0; i<sz*sz; i++)
+        dst[i] = (I16)COEF_CLIP( (src[i] * lscale + add) >> q_sft );
 }
 
 
@@ -642,12 +998,17 @@ void putBitsToBuffer (UI8 **ppbuf, I32 *bitpos, I32 bits, I32 len) {
 void putUVLCtoBuffer (UI8 **ppbuf, I32 *bitpos, I32 val) {
     I32 tmp, len = 1;
     val ++;
-    for (tmp=val+1; tmp!=1; tmp>>=1)
+    for (tmp=val; tmp!=1; tmp>>=1)
         len += 2;
     putBitsToBuffer(ppbuf, bitpos, (val & ((1<<((len+1)>>1))-1)) , ((len>>1) + ((len+1)>>1)) );
 }
 
 
+void putSVLCtoBuffer (UI8 **ppbuf, I32 *bitpos, I32 val) {
+    putUVLCtoBuffer(ppbuf, bitpos, (val>0) ? (2*val-1) : (-2*val) );
+}
+
+
 void alignBitsToByte (UI8 **ppbuf, I32 *bitpos) {
     if ( (*bitpos) < 7 )
         *((*ppbuf)++) &= 0xfe << (*bitpos);           // set all tail bits to 0, and move the buffer pointer to next byte
@@ -655,6 +1016,12 @@ void alignBitsToByte (UI8 **ppbuf, I32 *bitpos) {
 }
 
 
+void putTrailingBits (UI8 **ppbuf, I32 *bitpos) {     // rbsp_trailing_bits or byte_alignment : put a 1 and align to byte with 0s
+    putBitsToBuffer(ppbuf, bitpos, 1, 1);
+    alignBitsToByte(ppbuf, bitpos);
+}
+
+
 void putBytesToBuffer (UI8 **ppbuf, const UI8 *bytes, I32 len) {
     I32 i;
     for (i=0; i<len; i++)
@@ -662,35 +1029,161 @@ void putBytesToBuffer (UI8 **ppbuf, const UI8 *bytes, I32 len) {
 }
 
 
-void putHeaderToBuffer (UI8 **ppbuf, const I32 qpd6, const I32 ysz, const I32 xsz) {
-    static const UI8 VPS [] = {0x00, 0x00, 0x01, 0x40, 0x01, 0x0C, 0x01, 0xFF, 0xFF, 0x03, 0x10, 0x00, 0x00, 0x03, 0x00, 0x00, 0x03, 0x00, 0x00, 0x03, 0x00, 0x00, 0x03, 0x00, 0xB4, 0xF0, 0x24};
-    static const UI8 SPS [] = {0x00, 0x00, 0x01, 0x42, 0x01, 0x01, 0x03, 0x10, 0x00, 0x00, 0x03, 0x00, 0x00, 0x03, 0x00, 0x00, 0x03, 0x00, 0x00, 0x03, 0x00, 0xB4};
-    static const UI8 PPS [] = {0x00, 0x00, 0x01, 0x44, 0x01, 0xC0, 0x90, 0x91, 0x81, 0xD9, 0x20};
+void putBytesToBufferEP (UI8 **ppbuf, const UI8 *bytes, I32 len) {      // put the payload of a NAL unit, insert emulation prevention byte (0x03) after every two 0x00 that followed by 0x00~0x03
+    I32 i, count00 = 0;
+    for (i=0; i<len; i++) {
+        if ( count00 >= 2  &&  bytes[i] <= 0x03 ) {
+            *((*ppbuf)++) = 0x03;
+            count00 = 0;
+        }
+        *((*ppbuf)++) = bytes[i];
+        count00 = (bytes[i] == 0x00) ? (count00+1) : 0;
+    }
+}
+
+
+#define LEVEL6_MAX_LUMA_PS     35651584                                         // MaxLumaPs of level 6.x
+#define LEVEL6_MAX_DIM         16888                                            // the max width and height of level 6.x : Sqrt(MaxLumaPs*8)
+
+// put profile_tier_level() (general_profile_space=0 , general_tier_flag=0 , no sub-layers) of the profile that HEVCE_BIT_DEPTH needs.
+// The chroma is coded as 4:2:0 (all zero), so the monochrome image needs the 4:2:0 profiles : Main Still Picture (8-bit), Main 10 (9~10 bit) or Main 12 (11~12 bit)
+void putProfileTierLevel (UI8 **ppbuf, I32 *bitpos, const I32 level_idc) {
+#if   HEVCE_BIT_DEPTH == 8
+    putBitsToBuffer (ppbuf, bitpos, 3, 8);                // general_profile_space=0 , general_tier_flag=0 , general_profile_idc=3 (Main Still Picture)
+    putBitsToBuffer (ppbuf, bitpos, 0x1000, 16);          // general_profile_compatibility_flag[3]=1 , the others are 0
+#elif HEVCE_BIT_DEPTH <= 10
+    putBitsToBuffer (ppbuf, bitpos, 2, 8);                // general_profile_space=0 , general_tier_flag=0 , general_profile_idc=2 (Main 10)
+    putBitsToBuffer (ppbuf, bitpos, 0x2000, 16);          // general_profile_compatibility_flag[2]=1 , the others are 0
+#else
+    putBitsToBuffer (ppbuf, bitpos, 4, 8);                // general_profile_space=0 , general_tier_flag=0 , general_profile_idc=4 (format range extensions)
+    putBitsToBuffer (ppbuf, bitpos, 0x0800, 16);          // general_profile_compatibility_flag[4]=1 , the others are 0
+#endif
+    putBitsToBuffer (ppbuf, bitpos, 0x0000, 16);
+#if HEVCE_BIT_DEPTH <= 10
+    putBitsToBuffer (ppbuf, bitpos, 0x0, 24);             // general_progressive_source_flag=0 , general_interlaced_source_flag=0 , general_non_packed_constraint_flag=0 , general_frame_only_constraint_flag=0 , general_reserved_zero_43bits , ...
+    putBitsToBuffer (ppbuf, bitpos, 0x0, 24);             // ... general_inbld_flag=0
+#else
+    putBitsToBuffer (ppbuf, bitpos, 0x131, 13);           // the 4 source flags above=0 , max_12bit=1 , max_10bit=0 , max_8bit=0 , max_422chroma=1 , max_420chroma=1 , max_monochrome=0 , intra=0 , one_picture_only=0 , lower_bit_rate=1 : the Main 12 profile
+    putBitsToBuffer (ppbuf, bitpos, 0x0, 18);             // general_reserved_zero_34bits , ...
+    putBitsToBuffer (ppbuf, bitpos, 0x0, 17);             // ... general_inbld_flag=0
+#endif
+    putBitsToBuffer (ppbuf, bitpos, level_idc, 8);        // general_level_idc
+}
+
+
+void putHeaderToBuffer (UI8 **ppbuf, const I32 ysz, const I32 xsz, const BOOL wpp, const I32 tile_rows, const I32 tile_cols, const BOOL cu_qp_delta) {       // put VPS, SPS and PPS
+    static const UI8 VPS [] = {0x00, 0x00, 0x01, 0x40, 0x01};
+    static const UI8 SPS [] = {0x00, 0x00, 0x01, 0x42, 0x01};
+    static const UI8 PPS [] = {0x00, 0x00, 0x01, 0x44, 0x01};
     
-    static const UI8 SLICE_HEADERS [][8] = {
-        {0x00, 0x00, 0x01, 0x26, 0x01, 0xAC, 0x16, 0xDE} ,       // qpd6=0
-        {0x00, 0x00, 0x01, 0x26, 0x01, 0xAC, 0x10, 0xDE} ,       // qpd6=1
-        {0x00, 0x00, 0x01, 0x26, 0x01, 0xAC, 0x2B, 0x78} ,       // qpd6=2
-        {0x00, 0x00, 0x01, 0x26, 0x01, 0xAC, 0x4D, 0xE0} ,       // qpd6=3
-        {0x00, 0x00, 0x01, 0x26, 0x01, 0xAC, 0x97, 0x80}         // qpd6=4
-    };
+    const BOOL tiles = tile_rows*tile_cols > 1;
+    const I32  level_idc = ((I64)ysz*xsz <= LEVEL6_MAX_LUMA_PS && ysz <= LEVEL6_MAX_DIM && xsz <= LEVEL6_MAX_DIM) ? 180 : 255;    // level 6 for the sizes it allows, otherwise level 8.5 (no size limit)
     
+    UI8  rbsp [48] = {0};
+    UI8 *prbsp = rbsp;
     I32 bitpos = 7;
     
     putBytesToBuffer(ppbuf, VPS, sizeof(VPS));
+    putBitsToBuffer (&prbsp, &bitpos, 0x0C01, 16);        // vps_video_parameter_set_id=0 , vps_base_layer_internal_flag=1 , vps_base_layer_available_flag=1 , vps_max_layers_minus1=0 , vps_max_sub_layers_minus1=0 , vps_temporal_id_nesting_flag=1
+    putBitsToBuffer (&prbsp, &bitpos, 0xFFFF, 16);        // vps_reserved_0xffff_16bits
+    putProfileTierLevel(&prbsp, &bitpos, level_idc);
+    putBitsToBuffer (&prbsp, &bitpos, 0x1E04, 13);        // vps_sub_layer_ordering_info_present_flag=1 , vps_max_dec_pic_buffering_minus1=0 , vps_max_num_reorder_pics=0 , vps_max_latency_increase_plus1=0 , vps_max_layer_id=0 , vps_num_layer_sets_minus1=0 , vps_timing_info_present_flag=0 , vps_extension_flag=0
+    putTrailingBits (&prbsp, &bitpos);
+    putBytesToBufferEP(ppbuf, rbsp, prbsp-rbsp);
+    
+    prbsp = rbsp;
     putBytesToBuffer(ppbuf, SPS, sizeof(SPS));
-    putBitsToBuffer (ppbuf, &bitpos, 0x0A, 4);
-    putUVLCtoBuffer (ppbuf, &bitpos, xsz);
-    putUVLCtoBuffer (ppbuf, &bitpos, ysz);
-    putBitsToBuffer (ppbuf, &bitpos, 0x197EE4, 22);
-    //putBitsToBuffer (ppbuf, &bitpos, 0x707B44, 24);       // max_transform_hierarchy_depth_intra = 0
-    putBitsToBuffer (ppbuf, &bitpos, 0x681ED1, 24);       // max_transform_hierarchy_depth_intra = 1
-    alignBitsToByte (ppbuf, &bitpos);
+    putBitsToBuffer (&prbsp, &bitpos, 0x01, 8);           // sps_video_parameter_set_id=0 , sps_max_sub_layers_minus1=0 , sps_temporal_id_nesting_flag=1
+    putProfileTierLevel(&prbsp, &bitpos, level_idc);
+    putBitsToBuffer (&prbsp, &bitpos, 0x0A, 4);           // sps_seq_parameter_set_id=0 , chroma_format_idc=1
+    putUVLCtoBuffer (&prbsp, &bitpos, xsz);               // pic_width_in_luma_samples
+    putUVLCtoBuffer (&prbsp, &bitpos, ysz);               // pic_height_in_luma_samples
+    putBitsToBuffer (&prbsp, &bitpos, 0x0, 1);            // conformance_window_flag=0
+    putUVLCtoBuffer (&prbsp, &bitpos, BD_SHIFT);          // bit_depth_luma_minus8
+    putUVLCtoBuffer (&prbsp, &bitpos, BD_SHIFT);          // bit_depth_chroma_minus8
+    putBitsToBuffer (&prbsp, &bitpos, 0x17EE4, 19);
+    //putBitsToBuffer (&prbsp, &bitpos, 0x707B44, 24);    // max_transform_hierarchy_depth_intra = 0
+    putBitsToBuffer (&prbsp, &bitpos, 0x681ED1, 24);      // max_transform_hierarchy_depth_intra = 1
+    alignBitsToByte (&prbsp, &bitpos);
+    putBytesToBufferEP(ppbuf, rbsp, prbsp-rbsp);
+    
+    prbsp = rbsp;
     putBytesToBuffer(ppbuf, PPS, sizeof(PPS));
-    putBytesToBuffer(ppbuf, SLICE_HEADERS[qpd6], sizeof(SLICE_HEADERS[qpd6]));
+    putUVLCtoBuffer (&prbsp, &bitpos, 0);                 // pps_pic_parameter_set_id = 0
+    putUVLCtoBuffer (&prbsp, &bitpos, 0);                 // pps_seq_parameter_set_id = 0
+    putBitsToBuffer (&prbsp, &bitpos, 0x01, 7);           // dependent_slice_segments_enabled_flag=0 , output_flag_present_flag=0 , num_extra_slice_header_bits=0 , sign_data_hiding_enabled_flag=0 , cabac_init_present_flag=1
+    putUVLCtoBuffer (&prbsp, &bitpos, 3);                 // num_ref_idx_l0_default_active_minus1 = 3
+    putUVLCtoBuffer (&prbsp, &bitpos, 3);                 // num_ref_idx_l1_default_active_minus1 = 3
+    putSVLCtoBuffer (&prbsp, &bitpos, 0);                 // init_qp_minus26 = 0
+    putBitsToBuffer (&prbsp, &bitpos, cu_qp_delta, 3);    // constrained_intra_pred_flag=0 , transform_skip_enabled_flag=0 , cu_qp_delta_enabled_flag
+    if (cu_qp_delta)
+        putUVLCtoBuffer (&prbsp, &bitpos, 0);             // diff_cu_qp_delta_depth = 0 : the quantization group is the CTU
+    putSVLCtoBuffer (&prbsp, &bitpos, 0);                 // pps_cb_qp_offset = 0
+    putSVLCtoBuffer (&prbsp, &bitpos, 0);                 // pps_cr_qp_offset = 0
+    putBitsToBuffer (&prbsp, &bitpos, 0x0, 4);            // pps_slice_chroma_qp_offsets_present_flag=0 , weighted_pred_flag=0 , weighted_bipred_flag=0 , transquant_bypass_enabled_flag=0
+    putBitsToBuffer (&prbsp, &bitpos, tiles, 1);          // tiles_enabled_flag
+    putBitsToBuffer (&prbsp, &bitpos, !!wpp, 1);          // entropy_coding_sync_enabled_flag
+    if (tiles) {
+        putUVLCtoBuffer (&prbsp, &bitpos, tile_cols-1);   // num_tile_columns_minus1
+        putUVLCtoBuffer (&prbsp, &bitpos, tile_rows-1);   // num_tile_rows_minus1
+        putBitsToBuffer (&prbsp, &bitpos, 0x3, 2);        // uniform_spacing_flag=1 , loop_filter_across_tiles_enabled_flag=1
+    }
+    putBitsToBuffer (&prbsp, &bitpos, 0xE, 4);            // pps_loop_filter_across_slices_enabled_flag=1 , deblocking_filter_control_present_flag=1 , deblocking_filter_override_enabled_flag=1 , pps_deblocking_filter_disabled_flag=0
+    putSVLCtoBuffer (&prbsp, &bitpos, 0);                 // pps_beta_offset_div2 = 0
+    putSVLCtoBuffer (&prbsp, &bitpos, 0);                 // pps_tc_offset_div2 = 0
+    putBitsToBuffer (&prbsp, &bitpos, 0x0, 2);            // pps_scaling_list_data_present_flag=0 , lists_modification_present_flag=0
+    putUVLCtoBuffer (&prbsp, &bitpos, 0);                 // log2_parallel_merge_level_minus2 = 0
+    putBitsToBuffer (&prbsp, &bitpos, 0x0, 2);            // slice_segment_header_extension_present_flag=0 , pps_extension_present_flag=0
+    putTrailingBits (&prbsp, &bitpos);
+    putBytesToBufferEP(ppbuf, rbsp, prbsp-rbsp);
 }
 
 
+#define MAX_TILE_COLS          20                                               // the max number of tile columns allowed by level 6.x
+#define MAX_TILE_ROWS          22                                               // the max number of tile rows    allowed by level 6.x
+#define SLICE_HEADER_MAX_LEN   32                                               // the max length (in bytes) of the NAL unit header + slice segment header, when there are no entry points
+#define SLICE_HEADER_RBSP_LEN(n_substreams)  (16+4*(n_substreams))              // the max length (in bytes) of the slice segment header RBSP, each entry point takes at most 4 bytes
+
+// put a slice segment header of the slice starting from the CTU at slice_addr (in raster scan order). The lengths of the substreams (in bytes, including emulation prevention bytes) are written as entry points.
+// rbsp is a scratch buffer of SLICE_HEADER_RBSP_LEN(n_substreams) bytes, since the number of entry points (one for each CTU row in WPP) grows with the image height
+void putSliceHeaderToBuffer (UI8 **ppbuf, UI8 *rbsp, const I32 qp, const I32 slice_addr, const I32 n_ctus_in_pic, const BOOL entry_points_present, const I32 n_substreams, const I32 substream_lens []) {
+    static const UI8 SLICE_NAL_HEADER [] = {0x00, 0x00, 0x01, 0x26, 0x01};         // nal_unit_type = IDR_W_RADL
+    
+    UI8 *prbsp = rbsp;
+    I32  bitpos = 7;
+    I32  i, offset_len = 1, addr_len = 0;
+    
+    for (i=0; i<SLICE_HEADER_RBSP_LEN(entry_points_present ? n_substreams : 0); i++)
+        rbsp[i] = 0;
+    
+    putBytesToBuffer(ppbuf, SLICE_NAL_HEADER, sizeof(SLICE_NAL_HEADER));
+    putBitsToBuffer (&prbsp, &bitpos, (slice_addr==0), 1);// first_slice_segment_in_pic_flag
+    putBitsToBuffer (&prbsp, &bitpos, 0x0, 1);            // no_output_of_prior_pics_flag=0
+    putUVLCtoBuffer (&prbsp, &bitpos, 0);                 // slice_pic_parameter_set_id = 0
+    if (slice_addr > 0) {
+        for (; (n_ctus_in_pic-1)>>addr_len; addr_len++);
+        putBitsToBuffer (&prbsp, &bitpos, slice_addr, addr_len);                              // slice_segment_address, Ceil(Log2(PicSizeInCtbsY)) bits
+    }
+    putUVLCtoBuffer (&prbsp, &bitpos, 2);                 // slice_type = 2 (I slice)
+    putSVLCtoBuffer (&prbsp, &bitpos, qp-26);             // slice_qp_delta (init_qp_minus26 = 0)
+    putBitsToBuffer (&prbsp, &bitpos, 0x2, 2);            // deblocking_filter_override_flag=1 , slice_deblocking_filter_disabled_flag=0
+    putSVLCtoBuffer (&prbsp, &bitpos, 0);                 // slice_beta_offset_div2 = 0
+    putSVLCtoBuffer (&prbsp, &bitpos, 0);                 // slice_tc_offset_div2 = 0
+    putBitsToBuffer (&prbsp, &bitpos, 0x1, 1);            // slice_loop_filter_across_slices_enabled_flag = 1
+    if (entry_points_present) {                           // when tiles or WPP is enabled
+        putUVLCtoBuffer (&prbsp, &bitpos, n_substreams-1);                                    // num_entry_point_offsets
+        if (n_substreams > 1) {
+            for (i=0; i<n_substreams-1; i++)
+                for (; (substream_lens[i]-1)>>offset_len; offset_len++);
+            putUVLCtoBuffer (&prbsp, &bitpos, offset_len-1);                                  // offset_len_minus1
+            for (i=0; i<n_substreams-1; i++)
+                putBitsToBuffer (&prbsp, &bitpos, substream_lens[i]-1, offset_len);           // entry_point_offset_minus1[i]
+        }
+    }
+    putTrailingBits (&prbsp, &bitpos);                    // byte_alignment()
+    putBytesToBufferEP(ppbuf, rbsp, prbsp-rbsp);
+}
+
 
 
 
@@ -712,7 +1205,18 @@ const UI8 CABAC_LPS_TABLE [][4] = {
   {  8,   9,  11,  13}, {  7,   9,  11,  12}, {  7,   9,  10,  12}, {  7,   8,  10,  11}, {  6,   8,   9,  11}, {  6,   7,   9,  10}, {  6,   7,   8,   9}, {  2,   2,   2,   2}
 };
 
-const UI8 CABAC_RENORM_TABLE [] = { 6, 5, 4, 4, 3, 3, 3, 3, 2, 2, 2, 2, 2, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1 };
+// the bits (in units of 1/256 bit) to code a bin with a context value , indexed by (ctx_val ^ bin) , i.e. state*2 for MPS and state*2+1 for LPS.
+// derived from CABAC_LPS_TABLE : -log2(p) , where p is the LPS (or MPS) probability of the state averaged over the 4 range quarters
+const I32 CABAC_EST_BITS_TABLE [] = {
+   245,  267,  232,  282,  219,  297,  205,  315,  191,  335,  179,  353,  167,  373,  157,  392,
+   147,  411,  138,  430,  129,  451,  122,  469,  115,  488,  108,  508,  102,  526,   96,  546,
+    90,  566,   85,  585,   80,  604,   75,  624,   72,  641,   67,  662,   64,  680,   60,  700,
+    57,  720,   54,  739,   51,  757,   48,  777,   45,  797,   43,  813,   41,  836,   39,  852,
+    36,  875,   34,  893,   33,  913,   31,  933,   29,  949,   28,  967,   26,  988,   25, 1009,
+    24, 1024,   23, 1044,   21, 1065,   20, 1087,   19, 1106,   18, 1120,   17, 1142,   16, 1164,
+    15, 1180,   15, 1199,   14, 1216,   13, 1238,   13, 1250,   12, 1280,   11, 1294,   11, 1314,
+    10, 1338,    9, 1358,    9, 1367,    9, 1386,    8, 1410,    8, 1431,    7, 1451,    2, 1929
+};
 
 
 // operations for context value (ctx_val), note that ctx_val must be UI8 type
@@ -721,11 +1225,9 @@ const UI8 CABAC_RENORM_TABLE [] = { 6, 5, 4, 4, 3, 3, 3, 3, 2, 2, 2, 2, 2, 2, 2,
 #define   GET_CTX_STATE(ctx_val)    ( (ctx_val)>>1 )
 #define   GET_CTX_MPS(ctx_val)      ( (ctx_val)&1  )
 #define   GET_LPS(ctx_val,range)    ( CABAC_LPS_TABLE[GET_CTX_STATE(ctx_val)][((range)>>6)&3] )
-#define   GET_NBIT(lps)             ( CABAC_RENORM_TABLE[(lps)>>3] )
 
 
-UI8 initContextValue (UI8 init_val, I32 qpd6) {
-    I32 qp = qpd6 * 6 + 4;
+UI8 initContextValue (UI8 init_val, I32 qp) {
     I32 init_state = ((((init_val>>4)*5-45)*qp) >> 4) + ((init_val&15) << 3) - 16;
     init_state = CLIP(init_state, 1, 126);
     if (init_state >= 64)
@@ -756,10 +1258,11 @@ typedef struct {                      // context set for HEVC encoder
     UI8 sig_sc       [44];
     UI8 one_sc       [24];
     UI8 abs_sc        [6];
+    UI8 cu_qp_delta_abs [2];
 } ContextSet;
 
 
-ContextSet newContextSet (I32 qpd6) {
+ContextSet newContextSet (I32 qp) {
     ContextSet tCtxs = {
         {139, 141, 157},
         184,
@@ -773,13 +1276,14 @@ ContextSet newContextSet (I32 qpd6) {
         {91, 171},
         {111, 111, 125, 110, 110,  94, 124, 108, 124, 107, 125, 141, 179, 153, 125, 107, 125, 141, 179, 153, 125, 107, 125, 141, 179, 153, 125, 141, 140, 139, 182, 182, 152, 136, 152, 136, 153, 136, 139, 111, 136, 139, 111, 111},
         {140,  92, 137, 138, 140, 152, 138, 139, 153,  74, 149,  92, 139, 107, 122, 152, 140, 179, 166, 182, 140, 227, 122, 197},
-        {138, 153, 136, 167, 152, 152}
+        {138, 153, 136, 167, 152, 152},
+        {154, 154}
     };
     
     UI8 *ptr    = (UI8*)&tCtxs;
     UI8 *endptr = ptr + sizeof(tCtxs);
     for(; ptr<endptr; ptr++)
-        *ptr = initContextValue(*ptr, qpd6);                // initial all the UI8 items in ctxs using function initContextValue
+        *ptr = initContextValue(*ptr, qp);                // initial all the UI8 items in ctxs using function initContextValue
     
     return tCtxs;
 }
@@ -792,53 +1296,114 @@ ContextSet newContextSet (I32 qpd6) {
 // CABAC coder
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-#define TMPBUF_LEN  (CTU_SZ*CTU_SZ*3+128)
+#define TMPBUF_LEN  (CTU_SZ*CTU_SZ*(3+(BD_SHIFT+1)/2)+128)  // the levels of the high bit depths are larger : about 2 more bits for each extra bit of depth at the lowest qp
 
+// the CABAC coder only holds its state, and saves the output bytes to a buffer provided by its owner (at least TMPBUF_LEN bytes for each CTU between two CABACsubmitToBuffer).
+// when tmpbuf=NULL, the coder is an estimator : it does no arithmetic coding, but only accumulates the bits of each bin from CABAC_EST_BITS_TABLE according to its context. It is used for trying in RDO (see processCURecurs)
+// low is 64-bit, so that the bytes are output only when several of them are pending (see CABACupdate), and a run of bypass bins is put in one step (see CABACputBins).
+// The bytes in tmpbuf are the raw slice data, the emulation prevention bytes are inserted when they are submitted (see CABACsubmitToBuffer)
 typedef struct {
-    UI8 tmpbuf   [TMPBUF_LEN];        // internal temporary buffer of CABAC coder
+    UI8 *tmpbuf              ;        // temporary buffer of CABAC coder, or NULL for an estimator
     I32 tmpcnt               ;        // indicate the byte count in tmpbuf
-    I32 count00              ;        // indicate the number of 0x00 that has been just put to tmpbuf, if the last byte is not 0x00, set count0x00=0
+    I32 count00              ;        // indicate the number of 0x00 that has been just submitted, if the last byte is not 0x00, set count0x00=0
     I32 range                ;
-    I32 low                  ;
-    I32 nbits                ;
+    I64 low                  ;
+    I32 nbits                ;        // the free bits in low before a byte is output , which is negative when some bytes are pending
     I32 nbytes               ;
     I32 bufbyte              ;
+    I32 est_bits             ;        // (estimator only) the estimated bits of all the bins put, in units of 1/256 bit
 } CABACcoder;
 
 
-CABACcoder newCABACcoder (void) {
-    CABACcoder tCABAC = { {0x00}, 0, 0, 510, 0, 23, 0, 0xFF };
+CABACcoder newCABACcoder (UI8 *tmpbuf) {
+    CABACcoder tCABAC = { NULL, 0, 0, 510, 0, 23, 0, 0xFF, 0 };
+    tCABAC.tmpbuf = tmpbuf;
     return tCABAC;
 }
 
 
-void CABACsubmitToBuffer (CABACcoder *p, UI8 **ppbuf) {
-    putBytesToBuffer(ppbuf, p->tmpbuf, p->tmpcnt);                // move all bytes from tmpbuf to ppbuf
-    p->tmpcnt = 0;                                                // now tmpbuf as no bytes, so set tmpcnt=0
+CABACcoder newCABACestimator (void) {
+    return newCABACcoder(NULL);
 }
 
 
-void CABACput (CABACcoder *p, I32 byte) {
-    if ( p->count00 >= 2  &&  (UI8)byte <= 0x03 ) {
-        p->tmpbuf[ p->tmpcnt++ ] = 0x03;
-        p->count00 = 0;
+// copy the state of *src to *dst , together with the bytes in the buffer of *src which have not been submitted. *dst keeps its own buffer
+void CABACcopy (CABACcoder *dst, const CABACcoder *src) {
+    UI8 *tmpbuf = dst->tmpbuf;
+    I32  i;
+    *dst = *src;
+    dst->tmpbuf = tmpbuf;
+    for (i=0; i<src->tmpcnt; i++)
+        tmpbuf[i] = src->tmpbuf[i];
+}
+
+
+// move all bytes from tmpbuf to ppbuf, and insert emulation prevention byte (0x03) after every two 0x00 that followed by 0x00~0x03, in one pass.
+// The bytes larger than 0x03 (almost all of them) only reset count00. count00 is kept in the coder, so the 0x00 at the end of the previous submitted bytes are counted
+// return : the number of bytes put to ppbuf. When ppbuf=NULL, nothing is put and tmpbuf is kept, only the number is returned
+I32 CABACsubmitToBuffer (CABACcoder *p, UI8 **ppbuf) {
+    const UI8 *src    = p->tmpbuf;
+    const UI8 *endsrc = src + p->tmpcnt;
+    I32        count00 = p->count00;
+    I32        len     = p->tmpcnt;
+    
+    for (; src<endsrc; src++) {
+        if (*src > 0x03) {
+            count00 = 0;
+        } else {
+            if (count00 >= 2) {
+                if (ppbuf)
+                    *((*ppbuf)++) = 0x03;
+                len ++;
+                count00 = 0;
+            }
+            count00 = (*src == 0x00) ? (count00+1) : 0;
+        }
+        if (ppbuf)
+            *((*ppbuf)++) = *src;
+    }
+    
+    if (ppbuf) {
+        p->count00 = count00;
+        p->tmpcnt  = 0;                                           // now tmpbuf as no bytes, so set tmpcnt=0
     }
+    return len;
+}
+
+
+void CABACput (CABACcoder *p, I32 byte) {
     p->tmpbuf[ p->tmpcnt++ ] = (UI8)byte;
-    if ( (UI8)byte == 0x00 )
-        p->count00 ++;
-    else
-        p->count00 = 0;
     //if ( p->tmpcnt >= TMPBUF_LEN ) {}              // overflow: should never, since p->tmpbuf (internal buffer of CABAC coder) is large enough
 }
 
 
-I32  CABAClen (const CABACcoder *p) {
-    return  8 * (p->tmpcnt + p->nbytes) + 23 - p->nbits ;
+// output the pending bytes from low, until there are at least 12 free bits in low. Then the state is the same as that of a coder which outputs a byte as soon as it can
+void CABACflush (CABACcoder *p) {
+    while (p->nbits < 12) {
+        I32 lead_byte = (I32)(p->low >> (24-p->nbits));         // the top byte of low , with the carry on bit 8
+        p->nbits += 8;
+        p->low &= ((I64)1 << (32-p->nbits)) - 1;
+        if (lead_byte == 0xFF) {
+            p->nbytes ++;
+        } else if ( p->nbytes > 0 ) {
+            I32 carry = lead_byte >> 8;
+            I32 byte  = carry + p->bufbyte;
+            p->bufbyte = lead_byte & 0xFF;
+            CABACput(p, byte);
+            byte = (0xFF + carry) & 0xFF;
+            for (; p->nbytes>1; p->nbytes--)
+                CABACput(p, byte);
+        } else {
+            p->nbytes = 1;
+            p->bufbyte = lead_byte;
+        }
+    }
 }
 
 
 void CABACfinish (CABACcoder *p) {
     I32 tmp = 0x00;
+    CABACflush(p);
     if ( ( (p->low) >> (32-p->nbits) ) > 0 ) {
         CABACput(p, p->bufbyte+1);
         p->low -= (1<<(32-p->nbits));
@@ -849,38 +1414,30 @@ void CABACfinish (CABACcoder *p) {
     }
     for (; p->nbytes>1; p->nbytes--)
         CABACput(p, tmp);
-    tmp = (p->low >> 8) << p->nbits ;
+    tmp = (I32)((p->low >> 8) << p->nbits) | (1 << (p->nbits-1));   // the remaining (24-nbits) bits, followed by rbsp_stop_one_bit (or alignment_bit_equal_to_one), then zero bits for byte alignment
     CABACput(p, tmp >> 16 );
-    CABACput(p, tmp >> 8  );
-    CABACput(p, tmp       );
+    if (p->nbits < 17)
+        CABACput(p, tmp >> 8  );
+    if (p->nbits < 9)
+        CABACput(p, tmp       );
 }
 
 
+#define CABAC_FLUSH_NBITS   (-12)                               // the bytes are output when the free bits in low are fewer than this, i.e. 3 bytes are pending at least
+#define CABAC_MAX_BYPASS    16                                  // the bypass bins put in one step. Between two updates, low grows by 16 bits at most, so it never exceeds 62 bits (33-nbits)
+
 void CABACupdate (CABACcoder *p) {
-    if (p->nbits < 12) {
-        I32 lead_byte = p->low >> (24-p->nbits);
-        p->nbits += 8;
-        p->low &= (0xFFFFFFFF >> p->nbits);
-        if (lead_byte == 0xFF) {
-            p->nbytes ++;
-        } else if ( p->nbytes > 0 ) {
-            I32 carry = lead_byte >> 8;
-            I32 byte  = carry + p->bufbyte;
-            p->bufbyte = lead_byte & 0xFF;
-            CABACput(p, byte);
-            byte = (0xFF + carry) & 0xFF;
-            for (; p->nbytes>1; p->nbytes--)
-                CABACput(p, byte);
-        } else {
-            p->nbytes = 1;
-            p->bufbyte = lead_byte;
-        }
-    }
+    if (p->nbits < CABAC_FLUSH_NBITS)
+        CABACflush(p);
 }
 
 
 void CABACputTerminate (CABACcoder *p, BOOL bin) {
     bin = !!bin;
+    if (p->tmpbuf == NULL) {                                      // estimator : the terminate bin costs 7 bits when it is 1, and almost nothing when it is 0
+        p->est_bits += bin ? (7<<EST_BITS_SHIFT) : 0;
+        return;
+    }
     p->range -= 2;
     if (bin) {
         p->low += p->range;
@@ -897,14 +1454,17 @@ void CABACputTerminate (CABACcoder *p, BOOL bin) {
 
 
 void CABACputBins (CABACcoder *p, I32 bins, I32 len) {   // put bins without context model
-    bins &= ((1<<len)-1);
-    while (len > 0) {
-        const I32 len_curr = MIN(len, 8);
+    if (p->tmpbuf == NULL) {                                      // estimator : each bypass bin costs 1 bit
+        p->est_bits += len << EST_BITS_SHIFT;
+        return;
+    }
+    while (len > 0) {                                             // at most 2 steps, since len <= 31
+        const I32 len_curr = MIN(len, CABAC_MAX_BYPASS);
         I32 bins_curr;
         len -= len_curr;
         bins_curr = (bins>>len) & ((1<<len_curr)-1);
         p->low <<= len_curr;
-        p->low += p->range * bins_curr;
+        p->low += (I64)p->range * bins_curr;
         p->nbits -= len_curr;
         CABACupdate(p);
     }
@@ -912,9 +1472,19 @@ void CABACputBins (CABACcoder *p, I32 bins, I32 len) {   // put bins without con
 
 
 void CABACputBin (CABACcoder *p, BOOL bin, UI8 *pCtx) {   // put bin with context model
-    I32 lps  = GET_LPS(*pCtx, p->range);
-    I32 nbit = GET_NBIT(lps);
+    I32 lps, nbit;
     bin = !!bin;
+    if (p->tmpbuf == NULL) {                                      // estimator : get the bits from the table, and update the context as the real coder does
+        p->est_bits += CABAC_EST_BITS_TABLE[*pCtx ^ bin];
+        if ( bin != GET_CTX_MPS(*pCtx) ) {
+            UPDATE_LPS(*pCtx);
+        } else {
+            UPDATE_MPS(*pCtx);
+        }
+        return;
+    }
+    lps  = GET_LPS(*pCtx, p->range);
+    nbit = 8 - getHighestBit(lps);                                // renormalize the LPS range to 256~510 , with a bit scan
     p->range -= lps;
     if ( bin != GET_CTX_MPS(*pCtx) ) {
         UPDATE_LPS(*pCtx);
@@ -1043,9 +1613,11 @@ void putQtCbf (CABACcoder *pCABAC, ContextSet *pCtxs, const I32 tu_depth_in_cu,
 }
 
 
-void putLastSignificantXY (CABACcoder *pCABAC, ContextSet *pCtxs, const I32 sz, const ChannelType ch, const ScanType scan_type, const I32 y, const I32 x) {
+SIZED_INLINE void putLastSignificantXY (CABACcoder *pCABAC, ContextSet *pCtxs, const I32 sz, const ChannelType ch, const ScanType scan_type, const I32 y, const I32 x) {
+    // the binarization of a last position (0~31) : the prefix is its group index , which is put in context bins, and the suffix is its offset in the group , which is put in bypass bins
     static const UI8 GROUP_INDEX_TABLE [] = {0, 1, 2, 3, 4, 4, 5, 5, 6, 6, 6, 6, 7, 7, 7, 7, 8, 8, 8, 8, 8, 8, 8, 8, 9, 9, 9, 9, 9, 9, 9, 9};
-    static const UI8 MIN_IN_GROUP_TABLE[] = {0, 1, 2, 3, 4, 6, 8, 12, 16, 24};
+    static const UI8 SUFFIX_TABLE      [] = {0, 0, 0, 0, 0, 1, 0, 1, 0, 1, 2, 3, 0, 1, 2, 3, 0, 1, 2, 3, 4, 5, 6, 7, 0, 1, 2, 3, 4, 5, 6, 7};
+    static const UI8 SUFFIX_LEN_TABLE  [] = {0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3};
 
     //                                   Y 4x4 8x8 16x16    32x32    U/V 4x4 8x8 16x16    32x32
     static const UI8 ADDR_TABLE [][5] = { {  0,  1,    2, 0,    3} ,    {  4,  4,    4, 0,    4} };
@@ -1054,10 +1626,10 @@ void putLastSignificantXY (CABACcoder *pCABAC, ContextSet *pCtxs, const I32 sz,
     const I32 addr = ADDR_TABLE[ch!=CH_Y][sz/8];
     const I32 sft  =  SFT_TABLE[ch!=CH_Y][sz/8];
 
-    I32 ty = (scan_type==SCAN_TYPE_VER) ? x : y;
-    I32 tx = (scan_type==SCAN_TYPE_VER) ? y : x;
-    I32 gy = GROUP_INDEX_TABLE[ty];
-    I32 gx = GROUP_INDEX_TABLE[tx];
+    const I32 ty = (scan_type==SCAN_TYPE_VER) ? x : y;
+    const I32 tx = (scan_type==SCAN_TYPE_VER) ? y : x;
+    const I32 gy = GROUP_INDEX_TABLE[ty];
+    const I32 gx = GROUP_INDEX_TABLE[tx];
     
     I32 i;
     
@@ -1073,73 +1645,29 @@ void putLastSignificantXY (CABACcoder *pCABAC, ContextSet *pCtxs, const I32 sz,
     if (gy < GROUP_INDEX_TABLE[sz-1])
         CABACputBin(pCABAC, 0, &pCtxs->last_y[addr][gy>>sft] );
     
-    if (gx > 3) {
-        tx -= MIN_IN_GROUP_TABLE[gx];
-        for (i=(((gx-2)>>1)-1); i>=0; i--)
-            CABACputBins(pCABAC, (tx>>i)&1 , 1 );
-    }
-    
-    if (gy > 3) {
-        ty -= MIN_IN_GROUP_TABLE[gy];
-        for (i=(((gy-2)>>1)-1); i>=0; i--)
-            CABACputBins(pCABAC, (ty>>i)&1 , 1 );
-    }
+    if (SUFFIX_LEN_TABLE[tx] + SUFFIX_LEN_TABLE[ty])                                        // the suffixes of x and y are adjacent bypass bins , put them in one step
+        CABACputBins(pCABAC, (SUFFIX_TABLE[tx] << SUFFIX_LEN_TABLE[ty]) | SUFFIX_TABLE[ty], SUFFIX_LEN_TABLE[tx] + SUFFIX_LEN_TABLE[ty]);
 }
 
 
-// description : get the context index of significance bit-map
-// return: ctx_idx
-I32 getSigCtxIdx (const I32 sz, const ChannelType ch, const ScanType scan_type, const I32 y, const I32 x, const I32 sig_ctx) {
-    static const UI8 CTX_OFFSET_4x4_TABLE [4][4] = {{0, 1, 4, 5}, {2, 3, 4, 5}, {6, 6, 8, 8}, {7, 7, 8, 8}};
-    static const UI8 CTX_OFFSET_POSITION []      = {2, 1, 1, 0, 0, 0, 0};
+// return scan_type
+// output the pointer pointing to a scan order table on **scan
+SIZED_INLINE ScanType  getScanOrder (const I32 sz, const I32 pmode, const UI8 (**scan) [2]) {
+    static const UI8 SCAN_HOR_8x8    [][2] = {{0,0},{0,1},{0,2},{0,3},{1,0},{1,1},{1,2},{1,3},{2,0},{2,1},{2,2},{2,3},{3,0},{3,1},{3,2},{3,3},{0,4},{0,5},{0,6},{0,7},{1,4},{1,5},{1,6},{1,7},{2,4},{2,5},{2,6},{2,7},{3,4},{3,5},{3,6},{3,7},{4,0},{4,1},{4,2},{4,3},{5,0},{5,1},{5,2},{5,3},{6,0},{6,1},{6,2},{6,3},{7,0},{7,1},{7,2},{7,3},{4,4},{4,5},{4,6},{4,7},{5,4},{5,5},{5,6},{5,7},{6,4},{6,5},{6,6},{6,7},{7,4},{7,5},{7,6},{7,7}};
+    static const UI8 SCAN_VER_8x8    [][2] = {{0,0},{1,0},{2,0},{3,0},{0,1},{1,1},{2,1},{3,1},{0,2},{1,2},{2,2},{3,2},{0,3},{1,3},{2,3},{3,3},{4,0},{5,0},{6,0},{7,0},{4,1},{5,1},{6,1},{7,1},{4,2},{5,2},{6,2},{7,2},{4,3},{5,3},{6,3},{7,3},{0,4},{1,4},{2,4},{3,4},{0,5},{1,5},{2,5},{3,5},{0,6},{1,6},{2,6},{3,6},{0,7},{1,7},{2,7},{3,7},{4,4},{5,4},{6,4},{7,4},{4,5},{5,5},{6,5},{7,5},{4,6},{5,6},{6,6},{7,6},{4,7},{5,7},{6,7},{7,7}};
+    static const UI8 SCAN_DIAG_8x8   [][2] = {{0,0},{1,0},{0,1},{2,0},{1,1},{0,2},{3,0},{2,1},{1,2},{0,3},{3,1},{2,2},{1,3},{3,2},{2,3},{3,3},{4,0},{5,0},{4,1},{6,0},{5,1},{4,2},{7,0},{6,1},{5,2},{4,3},{7,1},{6,2},{5,3},{7,2},{6,3},{7,3},{0,4},{1,4},{0,5},{2,4},{1,5},{0,6},{3,4},{2,5},{1,6},{0,7},{3,5},{2,6},{1,7},{3,6},{2,7},{3,7},{4,4},{5,4},{4,5},{6,4},{5,5},{4,6},{7,4},{6,5},{5,6},{4,7},{7,5},{6,6},{5,7},{7,6},{6,7},{7,7}};
+    static const UI8 SCAN_DIAG_16x16 [][2] = {{0,0},{1,0},{0,1},{2,0},{1,1},{0,2},{3,0},{2,1},{1,2},{0,3},{3,1},{2,2},{1,3},{3,2},{2,3},{3,3},{4,0},{5,0},{4,1},{6,0},{5,1},{4,2},{7,0},{6,1},{5,2},{4,3},{7,1},{6,2},{5,3},{7,2},{6,3},{7,3},{0,4},{1,4},{0,5},{2,4},{1,5},{0,6},{3,4},{2,5},{1,6},{0,7},{3,5},{2,6},{1,7},{3,6},{2,7},{3,7},{8,0},{9,0},{8,1},{10,0},{9,1},{8,2},{11,0},{10,1},{9,2},{8,3},{11,1},{10,2},{9,3},{11,2},{10,3},{11,3},{4,4},{5,4},{4,5},{6,4},{5,5},{4,6},{7,4},{6,5},{5,6},{4,7},{7,5},{6,6},{5,7},{7,6},{6,7},{7,7},{0,8},{1,8},{0,9},{2,8},{1,9},{0,10},{3,8},{2,9},{1,10},{0,11},{3,9},{2,10},{1,11},{3,10},{2,11},{3,11},{12,0},{13,0},{12,1},{14,0},{13,1},{12,2},{15,0},{14,1},{13,2},{12,3},{15,1},{14,2},{13,3},{15,2},{14,3},{15,3},{8,4},{9,4},{8,5},{10,4},{9,5},{8,6},{11,4},{10,5},{9,6},{8,7},{11,5},{10,6},{9,7},{11,6},{10,7},{11,7},{4,8},{5,8},{4,9},{6,8},{5,9},{4,10},{7,8},{6,9},{5,10},{4,11},{7,9},{6,10},{5,11},{7,10},{6,11},{7,11},{0,12},{1,12},{0,13},{2,12},{1,13},{0,14},{3,12},{2,13},{1,14},{0,15},{3,13},{2,14},{1,15},{3,14},{2,15},{3,15},{12,4},{13,4},{12,5},{14,4},{13,5},{12,6},{15,4},{14,5},{13,6},{12,7},{15,5},{14,6},{13,7},{15,6},{14,7},{15,7},{8,8},{9,8},{8,9},{10,8},{9,9},{8,10},{11,8},{10,9},{9,10},{8,11},{11,9},{10,10},{9,11},{11,10},{10,11},{11,11},{4,12},{5,12},{4,13},{6,12},{5,13},{4,14},{7,12},{6,13},{5,14},{4,15},{7,13},{6,14},{5,15},{7,14},{6,15},{7,15},{12,8},{13,8},{12,9},{14,8},{13,9},{12,10},{15,8},{14,9},{13,10},{12,11},{15,9},{14,10},{13,11},{15,10},{14,11},{15,11},{8,12},{9,12},{8,13},{10,12},{9,13},{8,14},{11,12},{10,13},{9,14},{8,15},{11,13},{10,14},{9,15},{11,14},{10,15},{11,15},{12,12},{13,12},{12,13},{14,12},{13,13},{12,14},{15,12},{14,13},{13,14},{12,15},{15,13},{14,14},{13,15},{15,14},{14,15},{15,15}};
+    static const UI8 SCAN_DIAG_32x32 [][2] = {{0,0},{1,0},{0,1},{2,0},{1,1},{0,2},{3,0},{2,1},{1,2},{0,3},{3,1},{2,2},{1,3},{3,2},{2,3},{3,3},{4,0},{5,0},{4,1},{6,0},{5,1},{4,2},{7,0},{6,1},{5,2},{4,3},{7,1},{6,2},{5,3},{7,2},{6,3},{7,3},{0,4},{1,4},{0,5},{2,4},{1,5},{0,6},{3,4},{2,5},{1,6},{0,7},{3,5},{2,6},{1,7},{3,6},{2,7},{3,7},{8,0},{9,0},{8,1},{10,0},{9,1},{8,2},{11,0},{10,1},{9,2},{8,3},{11,1},{10,2},{9,3},{11,2},{10,3},{11,3},{4,4},{5,4},{4,5},{6,4},{5,5},{4,6},{7,4},{6,5},{5,6},{4,7},{7,5},{6,6},{5,7},{7,6},{6,7},{7,7},{0,8},{1,8},{0,9},{2,8},{1,9},{0,10},{3,8},{2,9},{1,10},{0,11},{3,9},{2,10},{1,11},{3,10},{2,11},{3,11},{12,0},{13,0},{12,1},{14,0},{13,1},{12,2},{15,0},{14,1},{13,2},{12,3},{15,1},{14,2},{13,3},{15,2},{14,3},{15,3},{8,4},{9,4},{8,5},{10,4},{9,5},{8,6},{11,4},{10,5},{9,6},{8,7},{11,5},{10,6},{9,7},{11,6},{10,7},{11,7},{4,8},{5,8},{4,9},{6,8},{5,9},{4,10},{7,8},{6,9},{5,10},{4,11},{7,9},{6,10},{5,11},{7,10},{6,11},{7,11},{0,12},{1,12},{0,13},{2,12},{1,13},{0,14},{3,12},{2,13},{1,14},{0,15},{3,13},{2,14},{1,15},{3,14},{2,15},{3,15},{16,0},{17,0},{16,1},{18,0},{17,1},{16,2},{19,0},{18,1},{17,2},{16,3},{19,1},{18,2},{17,3},{19,2},{18,3},{19,3},{12,4},{13,4},{12,5},{14,4},{13,5},{12,6},{15,4},{14,5},{13,6},{12,7},{15,5},{14,6},{13,7},{15,6},{14,7},{15,7},{8,8},{9,8},{8,9},{10,8},{9,9},{8,10},{11,8},{10,9},{9,10},{8,11},{11,9},{10,10},{9,11},{11,10},{10,11},{11,11},{4,12},{5,12},{4,13},{6,12},{5,13},{4,14},{7,12},{6,13},{5,14},{4,15},{7,13},{6,14},{5,15},{7,14},{6,15},{7,15},{0,16},{1,16},{0,17},{2,16},{1,17},{0,18},{3,16},{2,17},{1,18},{0,19},{3,17},{2,18},{1,19},{3,18},{2,19},{3,19},{20,0},{21,0},{20,1},{22,0},{21,1},{20,2},{23,0},{22,1},{21,2},{20,3},{23,1},{22,2},{21,3},{23,2},{22,3},{23,3},{16,4},{17,4},{16,5},{18,4},{17,5},{16,6},{19,4},{18,5},{17,6},{16,7},{19,5},{18,6},{17,7},{19,6},{18,7},{19,7},{12,8},{13,8},{12,9},{14,8},{13,9},{12,10},{15,8},{14,9},{13,10},{12,11},{15,9},{14,10},{13,11},{15,10},{14,11},{15,11},{8,12},{9,12},{8,13},{10,12},{9,13},{8,14},{11,12},{10,13},{9,14},{8,15},{11,13},{10,14},{9,15},{11,14},{10,15},{11,15},{4,16},{5,16},{4,17},{6,16},{5,17},{4,18},{7,16},{6,17},{5,18},{4,19},{7,17},{6,18},{5,19},{7,18},{6,19},{7,19},{0,20},{1,20},{0,21},{2,20},{1,21},{0,22},{3,20},{2,21},{1,22},{0,23},{3,21},{2,22},{1,23},{3,22},{2,23},{3,23},{24,0},{25,0},{24,1},{26,0},{25,1},{24,2},{27,0},{26,1},{25,2},{24,3},{27,1},{26,2},{25,3},{27,2},{26,3},{27,3},{20,4},{21,4},{20,5},{22,4},{21,5},{20,6},{23,4},{22,5},{21,6},{20,7},{23,5},{22,6},{21,7},{23,6},{22,7},{23,7},{16,8},{17,8},{16,9},{18,8},{17,9},{16,10},{19,8},{18,9},{17,10},{16,11},{19,9},{18,10},{17,11},{19,10},{18,11},{19,11},{12,12},{13,12},{12,13},{14,12},{13,13},{12,14},{15,12},{14,13},{13,14},{12,15},{15,13},{14,14},{13,15},{15,14},{14,15},{15,15},{8,16},{9,16},{8,17},{10,16},{9,17},{8,18},{11,16},{10,17},{9,18},{8,19},{11,17},{10,18},{9,19},{11,18},{10,19},{11,19},{4,20},{5,20},{4,21},{6,20},{5,21},{4,22},{7,20},{6,21},{5,22},{4,23},{7,21},{6,22},{5,23},{7,22},{6,23},{7,23},{0,24},{1,24},{0,25},{2,24},{1,25},{0,26},{3,24},{2,25},{1,26},{0,27},{3,25},{2,26},{1,27},{3,26},{2,27},{3,27},{28,0},{29,0},{28,1},{30,0},{29,1},{28,2},{31,0},{30,1},{29,2},{28,3},{31,1},{30,2},{29,3},{31,2},{30,3},{31,3},{24,4},{25,4},{24,5},{26,4},{25,5},{24,6},{27,4},{26,5},{25,6},{24,7},{27,5},{26,6},{25,7},{27,6},{26,7},{27,7},{20,8},{21,8},{20,9},{22,8},{21,9},{20,10},{23,8},{22,9},{21,10},{20,11},{23,9},{22,10},{21,11},{23,10},{22,11},{23,11},{16,12},{17,12},{16,13},{18,12},{17,13},{16,14},{19,12},{18,13},{17,14},{16,15},{19,13},{18,14},{17,15},{19,14},{18,15},{19,15},{12,16},{13,16},{12,17},{14,16},{13,17},{12,18},{15,16},{14,17},{13,18},{12,19},{15,17},{14,18},{13,19},{15,18},{14,19},{15,19},{8,20},{9,20},{8,21},{10,20},{9,21},{8,22},{11,20},{10,21},{9,22},{8,23},{11,21},{10,22},{9,23},{11,22},{10,23},{11,23},{4,24},{5,24},{4,25},{6,24},{5,25},{4,26},{7,24},{6,25},{5,26},{4,27},{7,25},{6,26},{5,27},{7,26},{6,27},{7,27},{0,28},{1,28},{0,29},{2,28},{1,29},{0,30},{3,28},{2,29},{1,30},{0,31},{3,29},{2,30},{1,31},{3,30},{2,31},{3,31},{28,4},{29,4},{28,5},{30,4},{29,5},{28,6},{31,4},{30,5},{29,6},{28,7},{31,5},{30,6},{29,7},{31,6},{30,7},{31,7},{24,8},{25,8},{24,9},{26,8},{25,9},{24,10},{27,8},{26,9},{25,10},{24,11},{27,9},{26,10},{25,11},{27,10},{26,11},{27,11},{20,12},{21,12},{20,13},{22,12},{21,13},{20,14},{23,12},{22,13},{21,14},{20,15},{23,13},{22,14},{21,15},{23,14},{22,15},{23,15},{16,16},{17,16},{16,17},{18,16},{17,17},{16,18},{19,16},{18,17},{17,18},{16,19},{19,17},{18,18},{17,19},{19,18},{18,19},{19,19},{12,20},{13,20},{12,21},{14,20},{13,21},{12,22},{15,20},{14,21},{13,22},{12,23},{15,21},{14,22},{13,23},{15,22},{14,23},{15,23},{8,24},{9,24},{8,25},{10,24},{9,25},{8,26},{11,24},{10,25},{9,26},{8,27},{11,25},{10,26},{9,27},{11,26},{10,27},{11,27},{4,28},{5,28},{4,29},{6,28},{5,29},{4,30},{7,28},{6,29},{5,30},{4,31},{7,29},{6,30},{5,31},{7,30},{6,31},{7,31},{28,8},{29,8},{28,9},{30,8},{29,9},{28,10},{31,8},{30,9},{29,10},{28,11},{31,9},{30,10},{29,11},{31,10},{30,11},{31,11},{24,12},{25,12},{24,13},{26,12},{25,13},{24,14},{27,12},{26,13},{25,14},{24,15},{27,13},{26,14},{25,15},{27,14},{26,15},{27,15},{20,16},{21,16},{20,17},{22,16},{21,17},{20,18},{23,16},{22,17},{21,18},{20,19},{23,17},{22,18},{21,19},{23,18},{22,19},{23,19},{16,20},{17,20},{16,21},{18,20},{17,21},{16,22},{19,20},{18,21},{17,22},{16,23},{19,21},{18,22},{17,23},{19,22},{18,23},{19,23},{12,24},{13,24},{12,25},{14,24},{13,25},{12,26},{15,24},{14,25},{13,26},{12,27},{15,25},{14,26},{13,27},{15,26},{14,27},{15,27},{8,28},{9,28},{8,29},{10,28},{9,29},{8,30},{11,28},{10,29},{9,30},{8,31},{11,29},{10,30},{9,31},{11,30},{10,31},{11,31},{28,12},{29,12},{28,13},{30,12},{29,13},{28,14},{31,12},{30,13},{29,14},{28,15},{31,13},{30,14},{29,15},{31,14},{30,15},{31,15},{24,16},{25,16},{24,17},{26,16},{25,17},{24,18},{27,16},{26,17},{25,18},{24,19},{27,17},{26,18},{25,19},{27,18},{26,19},{27,19},{20,20},{21,20},{20,21},{22,20},{21,21},{20,22},{23,20},{22,21},{21,22},{20,23},{23,21},{22,22},{21,23},{23,22},{22,23},{23,23},{16,24},{17,24},{16,25},{18,24},{17,25},{16,26},{19,24},{18,25},{17,26},{16,27},{19,25},{18,26},{17,27},{19,26},{18,27},{19,27},{12,28},{13,28},{12,29},{14,28},{13,29},{12,30},{15,28},{14,29},{13,30},{12,31},{15,29},{14,30},{13,31},{15,30},{14,31},{15,31},{28,16},{29,16},{28,17},{30,16},{29,17},{28,18},{31,16},{30,17},{29,18},{28,19},{31,17},{30,18},{29,19},{31,18},{30,19},{31,19},{24,20},{25,20},{24,21},{26,20},{25,21},{24,22},{27,20},{26,21},{25,22},{24,23},{27,21},{26,22},{25,23},{27,22},{26,23},{27,23},{20,24},{21,24},{20,25},{22,24},{21,25},{20,26},{23,24},{22,25},{21,26},{20,27},{23,25},{22,26},{21,27},{23,26},{22,27},{23,27},{16,28},{17,28},{16,29},{18,28},{17,29},{16,30},{19,28},{18,29},{17,30},{16,31},{19,29},{18,30},{17,31},{19,30},{18,31},{19,31},{28,20},{29,20},{28,21},{30,20},{29,21},{28,22},{31,20},{30,21},{29,22},{28,23},{31,21},{30,22},{29,23},{31,22},{30,23},{31,23},{24,24},{25,24},{24,25},{26,24},{25,25},{24,26},{27,24},{26,25},{25,26},{24,27},{27,25},{26,26},{25,27},{27,26},{26,27},{27,27},{20,28},{21,28},{20,29},{22,28},{21,29},{20,30},{23,28},{22,29},{21,30},{20,31},{23,29},{22,30},{21,31},{23,30},{22,31},{23,31},{28,24},{29,24},{28,25},{30,24},{29,25},{28,26},{31,24},{30,25},{29,26},{28,27},{31,25},{30,26},{29,27},{31,26},{30,27},{31,27},{24,28},{25,28},{24,29},{26,28},{25,29},{24,30},{27,28},{26,29},{25,30},{24,31},{27,29},{26,30},{25,31},{27,30},{26,31},{27,31},{28,28},{29,28},{28,29},{30,28},{29,29},{28,30},{31,28},{30,29},{29,30},{28,31},{31,29},{30,30},{29,31},{31,30},{30,31},{31,31}};
 
-    I32 ctx_idx = ch == CH_Y ? 0 : 28;
-
-    if (y==0 && x==0)                                       // special case for the DC context variable
-        return ctx_idx;
-    
-    if (sz == 4)
-        return ctx_idx + CTX_OFFSET_4x4_TABLE[y][x];
-    
-    ctx_idx += 9;
-
-    if (ch == CH_Y) {                                      // for Y channel
-        if ( sz >= 16 )
-            ctx_idx += 12;
-        if ( sz == 8 && scan_type != SCAN_TYPE_DIAG )      // 8x8 Non-Diagonal Scan
-            ctx_idx += 6;
-        if ( !(GETnCG(y) == 0 && GETnCG(x) == 0) )         // not the first CG
-            ctx_idx += 3;
-    } else if ( sz >= 16 )
-        ctx_idx += 3;
-
-    switch (sig_ctx) {
-        case 0 :   return ctx_idx + CTX_OFFSET_POSITION[ GETn_inCG(y) + GETn_inCG(x) ];
-        case 1 :   return ctx_idx + CTX_OFFSET_POSITION[ GETn_inCG(y) << 1 ];
-        case 2 :   return ctx_idx + CTX_OFFSET_POSITION[ GETn_inCG(x) << 1 ];
-        default:   return ctx_idx + 2;
-    }
-}
-
-
-// return scan_type
-// output the pointer pointing to a scan order table on **scan
-ScanType  getScanOrder (const I32 sz, const I32 pmode, const UI8 (**scan) [2]) {
-    static const UI8 SCAN_HOR_8x8    [][2] = {{0,0},{0,1},{0,2},{0,3},{1,0},{1,1},{1,2},{1,3},{2,0},{2,1},{2,2},{2,3},{3,0},{3,1},{3,2},{3,3},{0,4},{0,5},{0,6},{0,7},{1,4},{1,5},{1,6},{1,7},{2,4},{2,5},{2,6},{2,7},{3,4},{3,5},{3,6},{3,7},{4,0},{4,1},{4,2},{4,3},{5,0},{5,1},{5,2},{5,3},{6,0},{6,1},{6,2},{6,3},{7,0},{7,1},{7,2},{7,3},{4,4},{4,5},{4,6},{4,7},{5,4},{5,5},{5,6},{5,7},{6,4},{6,5},{6,6},{6,7},{7,4},{7,5},{7,6},{7,7}};
-    static const UI8 SCAN_VER_8x8    [][2] = {{0,0},{1,0},{2,0},{3,0},{0,1},{1,1},{2,1},{3,1},{0,2},{1,2},{2,2},{3,2},{0,3},{1,3},{2,3},{3,3},{4,0},{5,0},{6,0},{7,0},{4,1},{5,1},{6,1},{7,1},{4,2},{5,2},{6,2},{7,2},{4,3},{5,3},{6,3},{7,3},{0,4},{1,4},{2,4},{3,4},{0,5},{1,5},{2,5},{3,5},{0,6},{1,6},{2,6},{3,6},{0,7},{1,7},{2,7},{3,7},{4,4},{5,4},{6,4},{7,4},{4,5},{5,5},{6,5},{7,5},{4,6},{5,6},{6,6},{7,6},{4,7},{5,7},{6,7},{7,7}};
-    static const UI8 SCAN_DIAG_8x8   [][2] = {{0,0},{1,0},{0,1},{2,0},{1,1},{0,2},{3,0},{2,1},{1,2},{0,3},{3,1},{2,2},{1,3},{3,2},{2,3},{3,3},{4,0},{5,0},{4,1},{6,0},{5,1},{4,2},{7,0},{6,1},{5,2},{4,3},{7,1},{6,2},{5,3},{7,2},{6,3},{7,3},{0,4},{1,4},{0,5},{2,4},{1,5},{0,6},{3,4},{2,5},{1,6},{0,7},{3,5},{2,6},{1,7},{3,6},{2,7},{3,7},{4,4},{5,4},{4,5},{6,4},{5,5},{4,6},{7,4},{6,5},{5,6},{4,7},{7,5},{6,6},{5,7},{7,6},{6,7},{7,7}};
-    static const UI8 SCAN_DIAG_16x16 [][2] = {{0,0},{1,0},{0,1},{2,0},{1,1},{0,2},{3,0},{2,1},{1,2},{0,3},{3,1},{2,2},{1,3},{3,2},{2,3},{3,3},{4,0},{5,0},{4,1},{6,0},{5,1},{4,2},{7,0},{6,1},{5,2},{4,3},{7,1},{6,2},{5,3},{7,2},{6,3},{7,3},{0,4},{1,4},{0,5},{2,4},{1,5},{0,6},{3,4},{2,5},{1,6},{0,7},{3,5},{2,6},{1,7},{3,6},{2,7},{3,7},{8,0},{9,0},{8,1},{10,0},{9,1},{8,2},{11,0},{10,1},{9,2},{8,3},{11,1},{10,2},{9,3},{11,2},{10,3},{11,3},{4,4},{5,4},{4,5},{6,4},{5,5},{4,6},{7,4},{6,5},{5,6},{4,7},{7,5},{6,6},{5,7},{7,6},{6,7},{7,7},{0,8},{1,8},{0,9},{2,8},{1,9},{0,10},{3,8},{2,9},{1,10},{0,11},{3,9},{2,10},{1,11},{3,10},{2,11},{3,11},{12,0},{13,0},{12,1},{14,0},{13,1},{12,2},{15,0},{14,1},{13,2},{12,3},{15,1},{14,2},{13,3},{15,2},{14,3},{15,3},{8,4},{9,4},{8,5},{10,4},{9,5},{8,6},{11,4},{10,5},{9,6},{8,7},{11,5},{10,6},{9,7},{11,6},{10,7},{11,7},{4,8},{5,8},{4,9},{6,8},{5,9},{4,10},{7,8},{6,9},{5,10},{4,11},{7,9},{6,10},{5,11},{7,10},{6,11},{7,11},{0,12},{1,12},{0,13},{2,12},{1,13},{0,14},{3,12},{2,13},{1,14},{0,15},{3,13},{2,14},{1,15},{3,14},{2,15},{3,15},{12,4},{13,4},{12,5},{14,4},{13,5},{12,6},{15,4},{14,5},{13,6},{12,7},{15,5},{14,6},{13,7},{15,6},{14,7},{15,7},{8,8},{9,8},{8,9},{10,8},{9,9},{8,10},{11,8},{10,9},{9,10},{8,11},{11,9},{10,10},{9,11},{11,10},{10,11},{11,11},{4,12},{5,12},{4,13},{6,12},{5,13},{4,14},{7,12},{6,13},{5,14},{4,15},{7,13},{6,14},{5,15},{7,14},{6,15},{7,15},{12,8},{13,8},{12,9},{14,8},{13,9},{12,10},{15,8},{14,9},{13,10},{12,11},{15,9},{14,10},{13,11},{15,10},{14,11},{15,11},{8,12},{9,12},{8,13},{10,12},{9,13},{8,14},{11,12},{10,13},{9,14},{8,15},{11,13},{10,14},{9,15},{11,14},{10,15},{11,15},{12,12},{13,12},{12,13},{14,12},{13,13},{12,14},{15,12},{14,13},{13,14},{12,15},{15,13},{14,14},{13,15},{15,14},{14,15},{15,15}};
-    static const UI8 SCAN_DIAG_32x32 [][2] = {{0,0},{1,0},{0,1},{2,0},{1,1},{0,2},{3,0},{2,1},{1,2},{0,3},{3,1},{2,2},{1,3},{3,2},{2,3},{3,3},{4,0},{5,0},{4,1},{6,0},{5,1},{4,2},{7,0},{6,1},{5,2},{4,3},{7,1},{6,2},{5,3},{7,2},{6,3},{7,3},{0,4},{1,4},{0,5},{2,4},{1,5},{0,6},{3,4},{2,5},{1,6},{0,7},{3,5},{2,6},{1,7},{3,6},{2,7},{3,7},{8,0},{9,0},{8,1},{10,0},{9,1},{8,2},{11,0},{10,1},{9,2},{8,3},{11,1},{10,2},{9,3},{11,2},{10,3},{11,3},{4,4},{5,4},{4,5},{6,4},{5,5},{4,6},{7,4},{6,5},{5,6},{4,7},{7,5},{6,6},{5,7},{7,6},{6,7},{7,7},{0,8},{1,8},{0,9},{2,8},{1,9},{0,10},{3,8},{2,9},{1,10},{0,11},{3,9},{2,10},{1,11},{3,10},{2,11},{3,11},{12,0},{13,0},{12,1},{14,0},{13,1},{12,2},{15,0},{14,1},{13,2},{12,3},{15,1},{14,2},{13,3},{15,2},{14,3},{15,3},{8,4},{9,4},{8,5},{10,4},{9,5},{8,6},{11,4},{10,5},{9,6},{8,7},{11,5},{10,6},{9,7},{11,6},{10,7},{11,7},{4,8},{5,8},{4,9},{6,8},{5,9},{4,10},{7,8},{6,9},{5,10},{4,11},{7,9},{6,10},{5,11},{7,10},{6,11},{7,11},{0,12},{1,12},{0,13},{2,12},{1,13},{0,14},{3,12},{2,13},{1,14},{0,15},{3,13},{2,14},{1,15},{3,14},{2,15},{3,15},{16,0},{17,0},{16,1},{18,0},{17,1},{16,2},{19,0},{18,1},{17,2},{16,3},{19,1},{18,2},{17,3},{19,2},{18,3},{19,3},{12,4},{13,4},{12,5},{14,4},{13,5},{12,6},{15,4},{14,5},{13,6},{12,7},{15,5},{14,6},{13,7},{15,6},{14,7},{15,7},{8,8},{9,8},{8,9},{10,8},{9,9},{8,10},{11,8},{10,9},{9,10},{8,11},{11,9},{10,10},{9,11},{11,10},{10,11},{11,11},{4,12},{5,12},{4,13},{6,12},{5,13},{4,14},{7,12},{6,13},{5,14},{4,15},{7,13},{6,14},{5,15},{7,14},{6,15},{7,15},{0,16},{1,16},{0,17},{2,16},{1,17},{0,18},{3,16},{2,17},{1,18},{0,19},{3,17},{2,18},{1,19},{3,18},{2,19},{3,19},{20,0},{21,0},{20,1},{22,0},{21,1},{20,2},{23,0},{22,1},{21,2},{20,3},{23,1},{22,2},{21,3},{23,2},{22,3},{23,3},{16,4},{17,4},{16,5},{18,4},{17,5},{16,6},{19,4},{18,5},{17,6},{16,7},{19,5},{18,6},{17,7},{19,6},{18,7},{19,7},{12,8},{13,8},{12,9},{14,8},{13,9},{12,10},{15,8},{14,9},{13,10},{12,11},{15,9},{14,10},{13,11},{15,10},{14,11},{15,11},{8,12},{9,12},{8,13},{10,12},{9,13},{8,14},{11,12},{10,13},{9,14},{8,15},{11,13},{10,14},{9,15},{11,14},{10,15},{11,15},{4,16},{5,16},{4,17},{6,16},{5,17},{4,18},{7,16},{6,17},{5,18},{4,19},{7,17},{6,18},{5,19},{7,18},{6,19},{7,19},{0,20},{1,20},{0,21},{2,20},{1,21},{0,22},{3,20},{2,21},{1,22},{0,23},{3,21},{2,22},{1,23},{3,22},{2,23},{3,23},{24,0},{25,0},{24,1},{26,0},{25,1},{24,2},{27,0},{26,1},{25,2},{24,3},{27,1},{26,2},{25,3},{27,2},{26,3},{27,3},{20,4},{21,4},{20,5},{22,4},{21,5},{20,6},{23,4},{22,5},{21,6},{20,7},{23,5},{22,6},{21,7},{23,6},{22,7},{23,7},{16,8},{17,8},{16,9},{18,8},{17,9},{16,10},{19,8},{18,9},{17,10},{16,11},{19,9},{18,10},{17,11},{19,10},{18,11},{19,11},{12,12},{13,12},{12,13},{14,12},{13,13},{12,14},{15,12},{14,13},{13,14},{12,15},{15,13},{14,14},{13,15},{15,14},{14,15},{15,15},{8,16},{9,16},{8,17},{10,16},{9,17},{8,18},{11,16},{10,17},{9,18},{8,19},{11,17},{10,18},{9,19},{11,18},{10,19},{11,19},{4,20},{5,20},{4,21},{6,20},{5,21},{4,22},{7,20},{6,21},{5,22},{4,23},{7,21},{6,22},{5,23},{7,22},{6,23},{7,23},{0,24},{1,24},{0,25},{2,24},{1,25},{0,26},{3,24},{2,25},{1,26},{0,27},{3,25},{2,26},{1,27},{3,26},{2,27},{3,27},{28,0},{29,0},{28,1},{30,0},{29,1},{28,2},{31,0},{30,1},{29,2},{28,3},{31,1},{30,2},{29,3},{31,2},{30,3},{31,3},{24,4},{25,4},{24,5},{26,4},{25,5},{24,6},{27,4},{26,5},{25,6},{24,7},{27,5},{26,6},{25,7},{27,6},{26,7},{27,7},{20,8},{21,8},{20,9},{22,8},{21,9},{20,10},{23,8},{22,9},{21,10},{20,11},{23,9},{22,10},{21,11},{23,10},{22,11},{23,11},{16,12},{17,12},{16,13},{18,12},{17,13},{16,14},{19,12},{18,13},{17,14},{16,15},{19,13},{18,14},{17,15},{19,14},{18,15},{19,15},{12,16},{13,16},{12,17},{14,16},{13,17},{12,18},{15,16},{14,17},{13,18},{12,19},{15,17},{14,18},{13,19},{15,18},{14,19},{15,19},{8,20},{9,20},{8,21},{10,20},{9,21},{8,22},{11,20},{10,21},{9,22},{8,23},{11,21},{10,22},{9,23},{11,22},{10,23},{11,23},{4,24},{5,24},{4,25},{6,24},{5,25},{4,26},{7,24},{6,25},{5,26},{4,27},{7,25},{6,26},{5,27},{7,26},{6,27},{7,27},{0,28},{1,28},{0,29},{2,28},{1,29},{0,30},{3,28},{2,29},{1,30},{0,31},{3,29},{2,30},{1,31},{3,30},{2,31},{3,31},{28,4},{29,4},{28,5},{30,4},{29,5},{28,6},{31,4},{30,5},{29,6},{28,7},{31,5},{30,6},{29,7},{31,6},{30,7},{31,7},{24,8},{25,8},{24,9},{26,8},{25,9},{24,10},{27,8},{26,9},{25,10},{24,11},{27,9},{26,10},{25,11},{27,10},{26,11},{27,11},{20,12},{21,12},{20,13},{22,12},{21,13},{20,14},{23,12},{22,13},{21,14},{20,15},{23,13},{22,14},{21,15},{23,14},{22,15},{23,15},{16,16},{17,16},{16,17},{18,16},{17,17},{16,18},{19,16},{18,17},{17,18},{16,19},{19,17},{18,18},{17,19},{19,18},{18,19},{19,19},{12,20},{13,20},{12,21},{14,20},{13,21},{12,22},{15,20},{14,21},{13,22},{12,23},{15,21},{14,22},{13,23},{15,22},{14,23},{15,23},{8,24},{9,24},{8,25},{10,24},{9,25},{8,26},{11,24},{10,25},{9,26},{8,27},{11,25},{10,26},{9,27},{11,26},{10,27},{11,27},{4,28},{5,28},{4,29},{6,28},{5,29},{4,30},{7,28},{6,29},{5,30},{4,31},{7,29},{6,30},{5,31},{7,30},{6,31},{7,31},{28,8},{29,8},{28,9},{30,8},{29,9},{28,10},{31,8},{30,9},{29,10},{28,11},{31,9},{30,10},{29,11},{31,10},{30,11},{31,11},{24,12},{25,12},{24,13},{26,12},{25,13},{24,14},{27,12},{26,13},{25,14},{24,15},{27,13},{26,14},{25,15},{27,14},{26,15},{27,15},{20,16},{21,16},{20,17},{22,16},{21,17},{20,18},{23,16},{22,17},{21,18},{20,19},{23,17},{22,18},{21,19},{23,18},{22,19},{23,19},{16,20},{17,20},{16,21},{18,20},{17,21},{16,22},{19,20},{18,21},{17,22},{16,23},{19,21},{18,22},{17,23},{19,22},{18,23},{19,23},{12,24},{13,24},{12,25},{14,24},{13,25},{12,26},{15,24},{14,25},{13,26},{12,27},{15,25},{14,26},{13,27},{15,26},{14,27},{15,27},{8,28},{9,28},{8,29},{10,28},{9,29},{8,30},{11,28},{10,29},{9,30},{8,31},{11,29},{10,30},{9,31},{11,30},{10,31},{11,31},{28,12},{29,12},{28,13},{30,12},{29,13},{28,14},{31,12},{30,13},{29,14},{28,15},{31,13},{30,14},{29,15},{31,14},{30,15},{31,15},{24,16},{25,16},{24,17},{26,16},{25,17},{24,18},{27,16},{26,17},{25,18},{24,19},{27,17},{26,18},{25,19},{27,18},{26,19},{27,19},{20,20},{21,20},{20,21},{22,20},{21,21},{20,22},{23,20},{22,21},{21,22},{20,23},{23,21},{22,22},{21,23},{23,22},{22,23},{23,23},{16,24},{17,24},{16,25},{18,24},{17,25},{16,26},{19,24},{18,25},{17,26},{16,27},{19,25},{18,26},{17,27},{19,26},{18,27},{19,27},{12,28},{13,28},{12,29},{14,28},{13,29},{12,30},{15,28},{14,29},{13,30},{12,31},{15,29},{14,30},{13,31},{15,30},{14,31},{15,31},{28,16},{29,16},{28,17},{30,16},{29,17},{28,18},{31,16},{30,17},{29,18},{28,19},{31,17},{30,18},{29,19},{31,18},{30,19},{31,19},{24,20},{25,20},{24,21},{26,20},{25,21},{24,22},{27,20},{26,21},{25,22},{24,23},{27,21},{26,22},{25,23},{27,22},{26,23},{27,23},{20,24},{21,24},{20,25},{22,24},{21,25},{20,26},{23,24},{22,25},{21,26},{20,27},{23,25},{22,26},{21,27},{23,26},{22,27},{23,27},{16,28},{17,28},{16,29},{18,28},{17,29},{16,30},{19,28},{18,29},{17,30},{16,31},{19,29},{18,30},{17,31},{19,30},{18,31},{19,31},{28,20},{29,20},{28,21},{30,20},{29,21},{28,22},{31,20},{30,21},{29,22},{28,23},{31,21},{30,22},{29,23},{31,22},{30,23},{31,23},{24,24},{25,24},{24,25},{26,24},{25,25},{24,26},{27,24},{26,25},{25,26},{24,27},{27,25},{26,26},{25,27},{27,26},{26,27},{27,27},{20,28},{21,28},{20,29},{22,28},{21,29},{20,30},{23,28},{22,29},{21,30},{20,31},{23,29},{22,30},{21,31},{23,30},{22,31},{23,31},{28,24},{29,24},{28,25},{30,24},{29,25},{28,26},{31,24},{30,25},{29,26},{28,27},{31,25},{30,26},{29,27},{31,26},{30,27},{31,27},{24,28},{25,28},{24,29},{26,28},{25,29},{24,30},{27,28},{26,29},{25,30},{24,31},{27,29},{26,30},{25,31},{27,30},{26,31},{27,31},{28,28},{29,28},{28,29},{30,28},{29,29},{28,30},{31,28},{30,29},{29,30},{28,31},{31,29},{30,30},{29,31},{31,30},{30,31},{31,31}};
-
-    if (sz <= 8) {                                       // 4x4 or 8x8 block
-        if        ( ABS(pmode-PMODE_VER) <= 4 ) {        // pmode is near vertical
-            *scan = SCAN_HOR_8x8;                        // for 4x4 block, since SCAN_HOR_4x4 is same as the previous 16 items in SCAN_HOR_8x8, so we needn't arange SCAN_HOR_4x4 additionaly
-            return SCAN_TYPE_HOR;
-        } else if ( ABS(pmode-PMODE_HOR) <= 4 ) {        // pmode is near horizontal
-            *scan = SCAN_VER_8x8;                        // for 4x4 block, since SCAN_VER_4x4 is same as the previous 16 items in SCAN_VER_8x8, so we needn't arange SCAN_VER_4x4 additionaly
-            return SCAN_TYPE_VER;
-        }
-    }
+    if (sz <= 8) {                                       // 4x4 or 8x8 block
+        if        ( ABS(pmode-PMODE_VER) <= 4 ) {        // pmode is near vertical
+            *scan = SCAN_HOR_8x8;                        // for 4x4 block, since SCAN_HOR_4x4 is same as the previous 16 items in SCAN_HOR_8x8, so we needn't arange SCAN_HOR_4x4 additionaly
+            return SCAN_TYPE_HOR;
+        } else if ( ABS(pmode-PMODE_HOR) <= 4 ) {        // pmode is near horizontal
+            *scan = SCAN_VER_8x8;                        // for 4x4 block, since SCAN_VER_4x4 is same as the previous 16 items in SCAN_VER_8x8, so we needn't arange SCAN_VER_4x4 additionaly
+            return SCAN_TYPE_VER;
+        }
+    }
 
     switch (sz) {
         case 4 :   *scan =  SCAN_DIAG_8x8;    break;     // for 4x4 block, since SCAN_DIAG_4x4 is same as the previous 16 items in SCAN_DIAG_8x8, so we needn't arange SCAN_DIAG_4x4 additionaly
@@ -1151,82 +1679,137 @@ ScanType  getScanOrder (const I32 sz, const I32 pmode, const UI8 (**scan) [2]) {
 }
 
 
-void putRemainExGolomb (CABACcoder *pCABAC, I32 value, I32 rparam) {
+void putRemainExGolomb (CABACcoder *pCABAC, I32 value, I32 rparam) {     // the prefix and the suffix are put in one step , unless they are longer than 31 bins together
     I32 len, tmp;
     if ( value < (3<<rparam) ) {
         len = value >> rparam;
-        CABACputBins(pCABAC, (1<<(len+1))-2    , len+1  );
-        CABACputBins(pCABAC, value%(1<<rparam) , rparam );
+        CABACputBins(pCABAC, (((1<<(len+1))-2) << rparam) | (value%(1<<rparam)) , len+1+rparam );
     } else {
         len = rparam;
         value -= (3<<rparam);
         for(; value>=(1<<len); len++)
             value -= (1<<len);
         tmp = 4 + len - rparam;
-        CABACputBins(pCABAC, (1<<tmp)-2 , tmp );
-        CABACputBins(pCABAC, value      , len );
+        if (tmp + len <= 31) {
+            CABACputBins(pCABAC, (((1<<tmp)-2) << len) | value , tmp+len );
+        } else {
+            CABACputBins(pCABAC, (1<<tmp)-2 , tmp );
+            CABACputBins(pCABAC, value      , len );
+        }
     }
 }
 
 
-// put a coefficient block
-void putCoef (CABACcoder *pCABAC, ContextSet *pCtxs, const I32 sz, const ChannelType ch, const I32 pmode, const I32 blk [][CTU_SZ]) {
+// the significance context offsets of the coefficients in a CG, in scan order. The base context of the CG is added (see putCoef)
+// 4x4 block : the only CG, whose contexts are not related to the neighbouring CGs
+const UI8 SIG_CTX_4x4_TABLE [3][CG_SZxSZ] = { {0, 2, 1, 6, 3, 4, 7, 6, 4, 5, 7, 8, 5, 8, 8, 8} ,                         // diag scan
+                                              {0, 1, 4, 5, 2, 3, 4, 5, 6, 6, 8, 8, 7, 7, 8, 8} ,                         // horizontal scan
+                                              {0, 2, 6, 7, 1, 3, 6, 7, 4, 4, 8, 8, 5, 5, 8, 8} };                        // vertical scan
+
+// 8x8, 16x16 and 32x32 blocks : for each sig_ctx (whether the right CG and the below CG are significant)
+const UI8 SIG_CTX_CG_TABLE [3][4][CG_SZxSZ] = {
+    { {2, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0} , {2, 1, 2, 0, 1, 2, 0, 0, 1, 2, 0, 0, 1, 0, 0, 0} , {2, 2, 1, 2, 1, 0, 2, 1, 0, 0, 1, 0, 0, 0, 0, 0} , {2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2} } ,   // diag scan
+    { {2, 1, 1, 0, 1, 1, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0} , {2, 2, 2, 2, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0} , {2, 1, 0, 0, 2, 1, 0, 0, 2, 1, 0, 0, 2, 1, 0, 0} , {2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2} } ,   // horizontal scan
+    { {2, 1, 1, 0, 1, 1, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0} , {2, 1, 0, 0, 2, 1, 0, 0, 2, 1, 0, 0, 2, 1, 0, 0} , {2, 2, 2, 2, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0} , {2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2} } }; // vertical scan
+
+
+// description : get the base significance context of a CG. The context of a coefficient is the base plus its offset in SIG_CTX_4x4_TABLE or SIG_CTX_CG_TABLE, except the DC coefficient
+SIZED_INLINE I32 getSigCtxBase (const I32 sz, const ChannelType ch, const ScanType scan_type, const BOOL is_first_cg) {
+    I32 ctx_idx = ch == CH_Y ? 0 : 28;
+
+    if (sz == 4)
+        return ctx_idx;
+    
+    ctx_idx += 9;
+
+    if (ch == CH_Y) {                                      // for Y channel
+        if ( sz >= 16 )
+            ctx_idx += 12;
+        if ( sz == 8 && scan_type != SCAN_TYPE_DIAG )      // 8x8 Non-Diagonal Scan
+            ctx_idx += 6;
+        if ( !is_first_cg )
+            ctx_idx += 3;
+    } else if ( sz >= 16 )
+        ctx_idx += 3;
+
+    return ctx_idx;
+}
+
+
+// put a coefficient block. Each CG gets a significance bit-mask in scan order at first (the all-zero CGs are found with the contiguous rows of the block, without scanning them), so that
+// the last significant coefficient is found by a bit scan, the significance of a coefficient is a bit test, and the all-zero CGs are skipped after their coded_sub_block_flag
+SIZED_INLINE void putCoef (CABACcoder *pCABAC, ContextSet *pCtxs, const I32 sz, const ChannelType ch, const I32 pmode, const I16 *blk) {           // blk : contiguous block (row stride = sz)
     const UI8 (*scan) [2] = NULL;
     const ScanType scan_type = getScanOrder(sz, pmode, &scan);
+    const I32  n_cg   = GETnCG(sz) * GETnCG(sz);
+    const I32  ctx_dc = ch == CH_Y ? 0 : 28;                                // the significance context of the DC coefficient
     
-    I32  i, i_last=0, j_nz=0, signs=0, sig_ctx=0, c1=1;
+    I32  cg, i, cg_last=0, i_last=0, c1=1;
     I32  arr_abs_nz [CG_SZxSZ];
 
-    BOOL  sig_map [ GETnCG(CTU_SZ) ][ GETnCG(CTU_SZ) ];
-    BLK_SET(GETnCG(sz), 0, sig_map);                                        // initialize sig_map to all-zero
+    I32  cg_mask [ GETnCG(CTU_SZ) * GETnCG(CTU_SZ) ];                       // the significance bit-mask of each CG (in CG scan order). Bit i is the i-th coefficient of the CG in scan order
+    BOOL sig_map [ GETnCG(CTU_SZ) ][ GETnCG(CTU_SZ) ];                      // whether each CG is significant (in raster order)
     
-    for (i=0; i<sz*sz; i++) {                                               // for all coefficient
-        const I32  y = scan[i][0];
-        const I32  x = scan[i][1];
-        if ( blk[y][x] != 0 ) {
-            sig_map[GETnCG(y)][GETnCG(x)] = 1;
-            i_last = i;
-        }
+    for (cg=0; cg<n_cg; cg++) {                                             // for all CGs
+        const UI8 (*cg_scan) [2] = scan + cg*CG_SZxSZ;                      // the first coefficient of a CG in scan order is its top-left one
+        const I16  *cg_blk = blk + cg_scan[0][0]*sz + cg_scan[0][1];
+        I32  nz = 0, y, x;
+        I32  mask = 0;
+        
+        for (y=0; y<CG_SZ; y++)
+            for (x=0; x<CG_SZ; x++)
+                nz |= cg_blk[y*sz+x];
+        
+        if (nz)
+            for (i=0; i<CG_SZxSZ; i++)
+                mask |= (blk[cg_scan[i][0]*sz + cg_scan[i][1]] != 0) << i;
+        
+        cg_mask[cg] = mask;
+        sig_map[GETnCG(cg_scan[0][0])][GETnCG(cg_scan[0][1])] = (mask != 0);
+        if (mask)
+            cg_last = cg;
     }
     
+    if (cg_mask[cg_last])
+        i_last = cg_last*CG_SZxSZ + getHighestBit(cg_mask[cg_last]);        // the last significant coefficient in scan order
+    
     putLastSignificantXY(pCABAC, pCtxs, sz, ch, scan_type, scan[i_last][0], scan[i_last][1]);
 
-    for (i=i_last; i>=0; i--) {                                             // for all coefficient (reverse scan)
-        const I32  y = scan[i][0];
-        const I32  x = scan[i][1];
-        const I32  y_cg = GETnCG(y);
-        const I32  x_cg = GETnCG(x);
-        const BOOL sig_cg = sig_map[y_cg][x_cg];
-        const BOOL sig  = (blk[y][x] != 0);
-        const BOOL sign = (blk[y][x] <  0);
-        const BOOL is_final       = i == i_last;
-        const BOOL is_first_cg    = y_cg==0 && x_cg==0;
-        const BOOL is_first_in_cg = GETi_inCG(i) == 0;
-        const BOOL is_final_in_cg = GETi_inCG(i) == CG_SZxSZ-1 || is_final;
-
-        if (is_final_in_cg) {                                                                 // scan to a new CG
-            const BOOL sig_cg_right = x_cg < GETnCG(sz)-1 && sig_map[y_cg][x_cg+1];           // this CG is not near the block's right border , and the right CG is significant
-            const BOOL sig_cg_below = y_cg < GETnCG(sz)-1 && sig_map[y_cg+1][x_cg];           // this CG is not near the block's bottom border, and the bottom CG is significant
-
-            sig_ctx = (sig_cg_below<<1) | sig_cg_right;
-            j_nz  = 0;
-            signs = 0;
-            
-            if ( !is_first_cg && !is_final )
-                CABACputBin(pCABAC, sig_cg, &pCtxs->sig_map[!!sig_ctx] );
-        }
+    for (cg=cg_last; cg>=0; cg--) {                                         // for all CGs from the last significant one (reverse scan)
+        const UI8 (*cg_scan) [2] = scan + cg*CG_SZxSZ;
+        const I32  y_cg = GETnCG(cg_scan[0][0]);
+        const I32  x_cg = GETnCG(cg_scan[0][1]);
+        const I32  mask = cg_mask[cg];
+        const BOOL is_first_cg  = cg == 0;
+        const BOOL sig_cg_right = x_cg < GETnCG(sz)-1 && sig_map[y_cg][x_cg+1];                // this CG is not near the block's right border , and the right CG is significant
+        const BOOL sig_cg_below = y_cg < GETnCG(sz)-1 && sig_map[y_cg+1][x_cg];                // this CG is not near the block's bottom border, and the bottom CG is significant
+        const I32  sig_ctx      = (sig_cg_below<<1) | sig_cg_right;
+        const I32  ctx_base     = getSigCtxBase(sz, ch, scan_type, is_first_cg);
+        const UI8 *ctx_offsets  = (sz == 4) ? SIG_CTX_4x4_TABLE[scan_type] : SIG_CTX_CG_TABLE[scan_type][sig_ctx];
+        I32  j_nz=0, signs=0;
         
-        if ( !is_final && ( is_first_cg || (sig_cg && (!is_first_in_cg || j_nz>0)) ) ) {
-            const I32 ctx_idx = getSigCtxIdx(sz, ch, scan_type, y, x, sig_ctx);
-            CABACputBin(pCABAC, sig, &pCtxs->sig_sc[ctx_idx] );
-        }
+        if ( !is_first_cg && cg != cg_last )
+            CABACputBin(pCABAC, (mask != 0), &pCtxs->sig_map[!!sig_ctx] );
+        
+        if ( !is_first_cg && mask == 0 )                                    // skip the all-zero CG, whose coefficients are not put
+            continue;
         
-        if (sig) {
-            arr_abs_nz[j_nz++] = ABS(blk[y][x]);
-            signs = (signs<<1) | sign;
+        for (i=(cg==cg_last ? GETi_inCG(i_last) : CG_SZxSZ-1); i>=0; i--) { // for all coefficients in this CG (reverse scan)
+            const BOOL sig = (mask >> i) & 1;
+            
+            if ( cg*CG_SZxSZ+i != i_last && ( is_first_cg || i > 0 || j_nz > 0 ) ) {             // the significance of the last significant coefficient, and of the first coefficient in a significant CG (except the first CG) in which all the others are zero, is inferred
+                const I32 ctx_idx = (is_first_cg && i == 0) ? ctx_dc : ctx_base + ctx_offsets[i];
+                CABACputBin(pCABAC, sig, &pCtxs->sig_sc[ctx_idx] );
+            }
+            
+            if (sig) {
+                const I32 val = blk[cg_scan[i][0]*sz + cg_scan[i][1]];
+                arr_abs_nz[j_nz++] = ABS(val);
+                signs = (signs<<1) | (val<0);
+            }
         }
         
-        if ( is_first_in_cg && j_nz>0 ) {
+        if (j_nz > 0) {
             const I32 ctx_set = (ch==CH_Y ? 0 : 4) + ((ch==CH_Y && !is_first_cg) ? 2 : 0) + (c1==0 ? 1 : 0);
             BOOL escape_flag = j_nz > 8;
             I32  j, c2_flag=-1;
@@ -1269,6 +1852,89 @@ void putCoef (CABACcoder *pCABAC, ContextSet *pCtxs, const I32 sz, const Channel
 }
 
 
+#define   QP_DELTA_CODED   0x7FFF                                                     // the value of the pending cu_qp_delta after it is put, so that it is put only once in a quantization group
+
+// put cu_qp_delta_abs and cu_qp_delta_sign_flag. It is put in the first TU with a non-zero Ycbf of a quantization group (here a CTU), just before its coefficients.
+// qp_delta=NULL means that cu_qp_delta is not enabled (or we are estimating in RDO, where a CTU has a fixed qp), otherwise *qp_delta is set to QP_DELTA_CODED after putting
+void putCuQpDelta (CABACcoder *pCABAC, ContextSet *pCtxs, I32 *qp_delta) {
+    I32 absval, i;
+    if (qp_delta == NULL || *qp_delta == QP_DELTA_CODED)
+        return;
+    absval = ABS(*qp_delta);
+    for (i=0; i<MIN(absval,5); i++)                                                       // prefix : truncated unary with cMax=5, the first bin uses context 0, the others use context 1
+        CABACputBin(pCABAC, 1, &(pCtxs->cu_qp_delta_abs[i>0]));
+    if (absval < 5) {
+        CABACputBin(pCABAC, 0, &(pCtxs->cu_qp_delta_abs[absval>0]));
+    } else {                                                                              // suffix : 0-th order Exp-Golomb of absval-5 , in bypass bins
+        I32 value = absval - 5 , k = 0;
+        for (; value>=(1<<k); k++) {
+            CABACputBins(pCABAC, 1, 1);
+            value -= (1<<k);
+        }
+        CABACputBins(pCABAC, 0, 1);
+        CABACputBins(pCABAC, value, k);
+    }
+    if (absval > 0)
+        CABACputBins(pCABAC, (*qp_delta < 0), 1);                                         // cu_qp_delta_sign_flag
+    *qp_delta = QP_DELTA_CODED;
+}
+
+
+
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// size-specialized kernels
+// The SIZED_INLINE functions above (predict, transform, quantize, deQuantize, blkNotAllZero, putCoef) are templates on the block size : each of them is instantiated
+// for the sizes 4, 8, 16 and 32 with a constant sz, so that the size tables (transform matrix, shifts, border filter flags, scan order, significance contexts)
+// are resolved at compile time, and the loops have constant bounds which the compiler can fully unroll and vectorize.
+// A CU gets the instances of its size from SIZED_KERNELS only once (see processCURecurs) , instead of branching on sz in every kernel.
+// The kernels called through KERNELS (the pixel block kernels and the partial butterflies) are instantiated in the same way for each size and each instruction set (see SIZED_ENTRIES)
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+typedef struct {
+    void (*predict)       (const ChannelType ch, const I32 pmode, const PIX ubla, const PIX ublb [CTU_SZ*2], const PIX ubar [CTU_SZ*2], const PIX fbla, const PIX fblb [CTU_SZ*2], const PIX fbar [CTU_SZ*2], PIX *dst);
+    void (*transform)     (const BOOL inverse, const I16 *src, I16 *dst);
+    void (*quantize)      (const QPConsts *qc, const I32 pmode, const I16 *src, I16 *dst);
+    void (*deQuantize)    (const QPConsts *qc, const I16 *src, I16 *dst);
+    BOOL (*blkNotAllZero) (const I16 *src);
+    void (*putCoef)       (CABACcoder *pCABAC, ContextSet *pCtxs, const ChannelType ch, const I32 pmode, const I16 *blk);
+    void (*processCU)     (const QPConsts *qc, const ContextSet *pCtxs_init, const I32 speed, CABACcoder *pCABAC, ContextSet *pCtxs, const PIX *ctu_orig, PIX *ctu_rcon, I16 *blk_coef, UI8 *map_cu_sz, UI8 *map_pmode, UI8 *map_part,
+                           const I32 y, const I32 x, const BOOL bll_exist, const BOOL blb_exist, const BOOL baa_exist, const BOOL bar_exist, const BOOL bla_exist);     // CU sizes only (8, 16 and 32) , see DEFINE_PROCESS_CU
+} SizedKernels;
+
+
+#define DEFINE_SIZED_KERNELS(SZ)                                                                                                                                        \
+void predict##SZ (const ChannelType ch, const I32 pmode, const PIX ubla, const PIX ublb [CTU_SZ*2], const PIX ubar [CTU_SZ*2], const PIX fbla, const PIX fblb [CTU_SZ*2], const PIX fbar [CTU_SZ*2], PIX *dst) { \
+    predict(SZ, ch, pmode, ubla, ublb, ubar, fbla, fblb, fbar, dst);                                                                                                    \
+}                                                                                                                                                                       \
+void transform##SZ (const BOOL inverse, const I16 *src, I16 *dst) {                                                                                                     \
+    I32 tmp1 [SZ*SZ], tmp2 [SZ*SZ];                                                                                                                                     \
+    transform(SZ, inverse, src, dst, tmp1, tmp2);                                                                                                                       \
+}                                                                                                                                                                       \
+void quantize##SZ (const QPConsts *qc, const I32 pmode, const I16 *src, I16 *dst) {                                                                                     \
+    quantize(qc, SZ, pmode, src, dst);                                                                                                                                  \
+}                                                                                                                                                                       \
+void deQuantize##SZ (const QPConsts *qc, const I16 *src, I16 *dst) {                                                                                                    \
+    deQuantize(qc, SZ, src, dst);                                                                                                                                       \
+}                                                                                                                                                                       \
+BOOL blkNotAllZero##SZ (const I16 *src) {                                                                                                                               \
+    return blkNotAllZero(SZ, src);                                                                                                                                      \
+}                                                                                                                                                                       \
+void putCoef##SZ (CABACcoder *pCABAC, ContextSet *pCtxs, const ChannelType ch, const I32 pmode, const I16 *blk) {                                                       \
+    putCoef(pCABAC, pCtxs, SZ, ch, pmode, blk);                                                                                                                         \
+}
+
+DEFINE_SIZED_KERNELS(4)
+DEFINE_SIZED_KERNELS(8)
+DEFINE_SIZED_KERNELS(16)
+DEFINE_SIZED_KERNELS(32)
+
+extern const SizedKernels SIZED_KERNELS [5];        // defined after the instances of processCURecurs, which is the last kernel
+
+#define    SIZED(sz)            ( &SIZED_KERNELS[(sz)/8] )                                  // get the size-specialized kernels of a block size (4, 8, 16 or 32) , indexed by sz/8 like the other size tables
+
+
 void putCU_Part2Nx2N_noTUsplit (                // put a CU to HEVC stream, where part_type = part2Nx2N , no splitting to 4 TUs
     CABACcoder *pCABAC,
     ContextSet *pCtxs,
@@ -1276,9 +1942,11 @@ void putCU_Part2Nx2N_noTUsplit (                // put a CU to HEVC stream, wher
     const I32   pmode,
     const I32   pmode_left,
     const I32   pmode_above,
-    const I32   blk [][CTU_SZ]
+    const I16  *blk,
+    I32        *qp_delta                                                           // the pending cu_qp_delta (see putCuQpDelta)
 ) {
-    BOOL Ycbf = blkNotAllZero(sz, blk);
+    const SizedKernels *ks = SIZED(sz);
+    BOOL Ycbf = ks->blkNotAllZero(blk);
     putPartSize   (pCABAC, pCtxs, sz, 0);                                             // 0 indicate part2Nx2N
     putYpmode     (pCABAC, pCtxs, 0, &pmode, &pmode_left, &pmode_above);              // 0 indicate part2Nx2N
     putUVpmode    (pCABAC, pCtxs);                                                    //
@@ -1286,8 +1954,10 @@ void putCU_Part2Nx2N_noTUsplit (                // put a CU to HEVC stream, wher
     putQtCbf      (pCABAC, pCtxs, 0, CH_U, 0);                                        // U channel is always zero, so Ucbf = 0. Note that TU depth in CU = 0
     putQtCbf      (pCABAC, pCtxs, 0, CH_V, 0);                                        // V channel is always zero, so Vcbf = 0. Note that TU depth in CU = 0
     putQtCbf      (pCABAC, pCtxs, 0, CH_Y, Ycbf);                                     // Ycbf. Note that TU depth in CU = 0
-    if (Ycbf)
-        putCoef   (pCABAC, pCtxs, sz, CH_Y, pmode, blk);
+    if (Ycbf) {
+        putCuQpDelta(pCABAC, pCtxs, qp_delta);
+        ks->putCoef(pCABAC, pCtxs, CH_Y, pmode, blk);
+    }
 }
 
 
@@ -1298,8 +1968,11 @@ void putCU_Part2Nx2N_TUsplit (                  // put a CU to HEVC stream, wher
     const I32   pmode,
     const I32   pmode_left,
     const I32   pmode_above,
-          I32   sub_blk      [4][CTU_SZ/2][CTU_SZ]
+    const I16  *blk,                                                               // the 4 TUs are the 4 contiguous quarters of blk , in z-order
+    I32        *qp_delta                                                           // the pending cu_qp_delta (see putCuQpDelta)
 ) {
+    const I16 *sub_blk [4] = { blk , blk + sz*sz/4 , blk + sz*sz/4*2 , blk + sz*sz/4*3 };
+    const SizedKernels *ks_sub = SIZED(sz/2);                                          // the kernels of the TU size
     I32  isub;
     putPartSize   (pCABAC, pCtxs, sz, 0);                                          // 0 indicate part2Nx2N
     putYpmode     (pCABAC, pCtxs, 0, &pmode, &pmode_left, &pmode_above);           // 0 indicate part2Nx2N
@@ -1308,10 +1981,12 @@ void putCU_Part2Nx2N_TUsplit (                  // put a CU to HEVC stream, wher
     putQtCbf      (pCABAC, pCtxs, 0, CH_U, 0);                                     // U channel is always zero, so Ucbf = 0. Note that TU depth in CU = 0
     putQtCbf      (pCABAC, pCtxs, 0, CH_V, 0);                                     // V channel is always zero, so Vcbf = 0. Note that TU depth in CU = 0
     for (isub=0; isub<4; isub++) {
-        BOOL Ycbf = blkNotAllZero(sz/2, sub_blk[isub]) ;
+        BOOL Ycbf = ks_sub->blkNotAllZero(sub_blk[isub]) ;
         putQtCbf  (pCABAC, pCtxs, 1, CH_Y, Ycbf);                                  // Ycbf. Note that TU depth in CU = 1
-        if (Ycbf)
-            putCoef(pCABAC, pCtxs, sz/2, CH_Y, pmode, sub_blk[isub]);
+        if (Ycbf) {
+            putCuQpDelta(pCABAC, pCtxs, qp_delta);
+            ks_sub->putCoef(pCABAC, pCtxs, CH_Y, pmode, sub_blk[isub]);
+        }
     }
 }
 
@@ -1323,8 +1998,11 @@ void putCU_PartNxN (                            // put a CU to HEVC stream, wher
     const I32   pmodes       [4],
     const I32   pmodes_left  [4],
     const I32   pmodes_above [4],
-          I32   sub_blk      [4][CTU_SZ/2][CTU_SZ]
+    const I16  *blk,                                                               // the 4 TUs are the 4 contiguous quarters of blk , in z-order
+    I32        *qp_delta                                                           // the pending cu_qp_delta (see putCuQpDelta)
 ) {
+    const I16 *sub_blk [4] = { blk , blk + sz*sz/4 , blk + sz*sz/4*2 , blk + sz*sz/4*3 };
+    const SizedKernels *ks_sub = SIZED(sz/2);                                          // the kernels of the TU size
     I32  isub;
     putPartSize   (pCABAC, pCtxs, sz, 1);                                          // 1 indicate partNxN
     putYpmode     (pCABAC, pCtxs, 1, pmodes, pmodes_left, pmodes_above);           // 1 indicate partNxN
@@ -1332,10 +2010,12 @@ void putCU_PartNxN (                            // put a CU to HEVC stream, wher
     putQtCbf      (pCABAC, pCtxs, 0, CH_U, 0);                                     // U channel is always zero, so Ucbf = 0. Note that TU depth in CU = 0
     putQtCbf      (pCABAC, pCtxs, 0, CH_V, 0);                                     // V channel is always zero, so Vcbf = 0. Note that TU depth in CU = 0
     for (isub=0; isub<4; isub++) {
-        BOOL Ycbf = blkNotAllZero(sz/2, sub_blk[isub]) ;
+        BOOL Ycbf = ks_sub->blkNotAllZero(sub_blk[isub]) ;
         putQtCbf  (pCABAC, pCtxs, 1, CH_Y, Ycbf);                                  // Ycbf. Note that TU depth in CU = 1
-        if (Ycbf)
-            putCoef(pCABAC, pCtxs, sz/2, CH_Y, pmodes[isub], sub_blk[isub]);
+        if (Ycbf) {
+            putCuQpDelta(pCABAC, pCtxs, qp_delta);
+            ks_sub->putCoef(pCABAC, pCtxs, CH_Y, pmodes[isub], sub_blk[isub]);
+        }
     }
 }
 
@@ -1344,307 +2024,2229 @@ void putCU_PartNxN (                            // put a CU to HEVC stream, wher
 
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// process a CU (recursive). This function will give you some small small C pointer shake
+// fast intra mode decision : rank all prediction modes by a rough cost (SATD + estimated mode bits), and only send the best few modes to full RDO
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-void processCURecurs (
-    const I32   qpd6,
-    CABACcoder *pCABAC,
-    ContextSet *pCtxs,
-          UI8   blk_orig   [][CTU_SZ],                          // pointing to the original pixels block of this CU (blk_orig[0][0] will be the pixel on top-left corner in this CU)
-          UI8   blk_rcon   [][1+CTU_SZ*2],                      // pointing to the reconstructed pixels block of this CU
-          UI8   map_cu_sz  [][1+nTUinROW],                      // pointing to the context buffer of this CU
-          UI8   map_pmode  [][1+nTUinROW],                      // pointing to the context buffer of this CU
-    const I32   sz,                                             // CU size
-    const BOOL  bll_exist,                                      // whether border on left exist
-    const BOOL  blb_exist,                                      // whether border on left-below exist
-    const BOOL  baa_exist,                                      // whether border on above exist
-    const BOOL  bar_exist                                       // whether border on above-right exist
-) {
-    const CABACcoder oCABAC = *pCABAC;                          // backup the original CABAC coder at oCABAC. note that this operation will copy all the struct elements.
-    const ContextSet oCtxs  = *pCtxs;                           // backup the original Context set at oCtxs . note that this operation will copy all the struct elements.
+#define    SPEED_COUNT          4                                  // speed preset : 0 (exhaustive RDO, slowest) ~ 3 (fastest)
 
-    const I32  nTU = GETnTU(sz);                                // indicate how many rows/columns of minimal TUs in this CU
-    
-    const BOOL larger_than_left_cu  = sz > map_cu_sz[0][-1];    // current CU is larger than the left CU
-    const BOOL larger_than_above_cu = sz > map_cu_sz[-1][0];    // current CU is larger than the above CU
-    
-    const I32  pmode_left  = map_pmode[0][-1];                  // left pmode context of this CU
-    const I32  pmode_above = map_pmode[-1][0];                  // above pmode context of this CU
-
-    // judge border existance for sub blocks:  left-top sub block  right-top sub block  left-bottom sub block  right-bottom sub block
-    const BOOL sub_bll_exist [4] =           { bll_exist,          1        ,           bll_exist,             1 };
-    const BOOL sub_blb_exist [4] =           { bll_exist,          0        ,           blb_exist,             0 };
-    const BOOL sub_baa_exist [4] =           { baa_exist,          baa_exist,           1        ,             1 };
-    const BOOL sub_bar_exist [4] =           { baa_exist,          bar_exist,           1        ,             0 };
+const I32  FAST_RDO_PMODE_COUNT [SPEED_COUNT] = {PMODE_COUNT, 8, 4, 2};                      // for each speed preset, how many best modes (ranked by rough cost) are sent to full RDO. The probable modes (MPMs) are always sent to full RDO
 
-    // construct pointers for sub blocks:                            left-top sub block                          right-top sub block                         left-bottom sub block                           right-bottom sub block
-    UI8 (*(sub_blk_orig  [4])) [CTU_SZ]     = { (UI8(*)[CTU_SZ])     & (blk_orig[0][0]) , (UI8(*)[CTU_SZ])     & (blk_orig[0][sz/2])  , (UI8(*)[CTU_SZ])     & (blk_orig[sz/2][0])  , (UI8(*)[CTU_SZ])     & (blk_orig[sz/2][sz/2])   };
-    UI8 (*(sub_blk_rcon  [4])) [1+CTU_SZ*2] = { (UI8(*)[1+CTU_SZ*2]) & (blk_rcon[0][0]) , (UI8(*)[1+CTU_SZ*2]) & (blk_rcon[0][sz/2])  , (UI8(*)[1+CTU_SZ*2]) & (blk_rcon[sz/2][0])  , (UI8(*)[1+CTU_SZ*2]) & (blk_rcon[sz/2][sz/2])   };
-    UI8 (*(sub_map_cu_sz [4])) [1+nTUinROW] = { (UI8(*)[1+nTUinROW]) &(map_cu_sz[0][0]) , (UI8(*)[1+nTUinROW]) &(map_cu_sz[0][nTU/2]) , (UI8(*)[1+nTUinROW]) &(map_cu_sz[nTU/2][0]) , (UI8(*)[1+nTUinROW]) &(map_cu_sz[nTU/2][nTU/2]) };
-    UI8 (*(sub_map_pmode [4])) [1+nTUinROW] = { (UI8(*)[1+nTUinROW]) &(map_pmode[0][0]) , (UI8(*)[1+nTUinROW]) &(map_pmode[0][nTU/2]) , (UI8(*)[1+nTUinROW]) &(map_pmode[nTU/2][0]) , (UI8(*)[1+nTUinROW]) &(map_pmode[nTU/2][nTU/2]) };
-    
-    UI8 ubla , ublb[CTU_SZ*2] , ubar[CTU_SZ*2];                 // to save unfiltered border pixels
-    UI8 fbla , fblb[CTU_SZ*2] , fbar[CTU_SZ*2];                 // to save   filtered border pixels
+const BOOL FAST_CU_DECISION     [SPEED_COUNT]    = {0, 0, 1, 1};                              // for each speed preset, whether to use fast CU decision : try the un-split CU before splitting, and skip some of them
+const I32  TEXTURE_VAR_X16      [SPEED_COUNT][2] = {{0,0}, {0,0}, {16,0}, {16,32}};          // for each speed preset and CU size (32x32, 16x16), a CU is regarded as textured (always split, un-split CU not tried) if its variance > TEXTURE_VAR_X16/16 * Qstep^2. 0 means never
+const I32  SKIP_SPLIT_BPP_X16   [SPEED_COUNT][2] = {{0,0}, {0,0}, { 0,0}, { 2, 4}};          // for each speed preset and CU size (32x32, 16x16), splitting is not tried if the RD-cost of the best un-split CU < the cost of SKIP_SPLIT_BPP_X16/16 bits per pixel
+const I32  QSTEP_SQ_X16         [QP_COUNT]       = {                                          // 16 * Qstep^2 for each QP, where Qstep = 2^((QP-4)/6)
+         6,      8,     10,     13,     16,     20,     25,     32,     40,     51,     64,     81,    102,    128,    161,    203,    256,    323,    406,    512,    645,    813,   1024,   1290,   1625,   2048,
+      2580,   3251,   4096,   5161,   6502,   8192,  10321,  13004,  16384,  20643,  26008,  32768,  41285,  52016,  65536,  82570, 104032, 131072, 165140, 208064, 262144, 330281, 416128, 524288, 660561, 832255};
 
-    UI8 blk_tmp1  [CTU_SZ][CTU_SZ];
-    I32 blk_tmp2  [CTU_SZ][CTU_SZ];
-    I32 blk_quat  [CTU_SZ][CTU_SZ];
-    I32 sub_blk_quat [4][CTU_SZ/2][CTU_SZ];
-    UI8 best_rcon [CTU_SZ][CTU_SZ];                             // always hold the best reconstructed CU pixels, for finally recover the reconstructed CU
 
-    I32 isub, pmode, distortion, rdcost, rdcost_best=I32_MAX_VALUE;
+// description : calculate the variance of the pixels in a block, in the scale of 8-bit pixels
+I32 calcBlkVariance (const I32 sz, const PIX *blk, const I32 stride) {
+    I32 i, j, diff, mean = 0;
+    I64 var = 0;
+    for (i=0; i<sz; i++)
+        for (j=0; j<sz; j++)
+            mean += blk[i*stride+j];
+    mean /= sz*sz;
+    for (i=0; i<sz; i++)
+        for (j=0; j<sz; j++) {
+            diff = (I32)blk[i*stride+j] - mean;
+            var += diff * diff;
+        }
+    return (I32)( (var / (sz*sz)) >> (2*BD_SHIFT) );
+}
 
 
-    //--------------------------------------------------------------------------------------------------------------------------------------------------------
-    // step1 : try splitting to 4 CUs
-    //--------------------------------------------------------------------------------------------------------------------------------------------------------
+// description : do Hadamard transform on a n x n block (n=4 or 8) in place, and return the sum of the absolute values of the transformed block
+I32 calcHadamardSum (const I32 n, I32 blk [][8]) {
+    I32 i, j, k, step, tmp, sum = 0;
     
-    if (sz > MIN_CU_SZ) {                                                                                               // if CU not larger than the smallest CU, try splitting to 4 CUs
-        putSplitCUflag(pCABAC, pCtxs, sz, 1, larger_than_left_cu, larger_than_above_cu);                                // split_cu_flag=1 (split to 4 CUs)
+    for (step=1; step<n; step<<=1)                                                           // horizontal butterflies
+        for (i=0; i<n; i++)
+            for (j=0; j<n; j+=2*step)
+                for (k=j; k<j+step; k++) {
+                    tmp = blk[i][k];
+                    blk[i][k]      = tmp + blk[i][k+step];
+                    blk[i][k+step] = tmp - blk[i][k+step];
+                }
+    
+    for (step=1; step<n; step<<=1)                                                           // vertical butterflies
+        for (j=0; j<n; j++)
+            for (i=0; i<n; i+=2*step)
+                for (k=i; k<i+step; k++) {
+                    tmp = blk[k][j];
+                    blk[k][j]      = tmp + blk[k+step][j];
+                    blk[k+step][j] = tmp - blk[k+step][j];
+                }
+    
+    for (i=0; i<n; i++)
+        for (j=0; j<n; j++)
+            sum += ABS(blk[i][j]);
+    
+    return sum;
+}
 
-        for (isub=0; isub<4; isub++)
-            processCURecurs(qpd6, pCABAC, pCtxs, sub_blk_orig[isub], sub_blk_rcon[isub], sub_map_cu_sz[isub], sub_map_pmode[isub], sz/2, sub_bll_exist[isub], sub_blb_exist[isub], sub_baa_exist[isub], sub_bar_exist[isub]);
-        
-        CALC_BLK_SSE(sz, blk_orig, blk_rcon, distortion);
-        rdcost_best = calcRDcost(qpd6, distortion, (CABAClen(pCABAC) - CABAClen(&oCABAC)) );
 
-        BLK_COPY(sz, blk_rcon, best_rcon);                                                                              // backup the reconstructed block, since subsequent code will modify it
+// description : calculate SATD (sum of absolute Hadamard-transformed differences) between two blocks, using 8x8 Hadamard transform (4x4 for 4x4 blocks), in the scale of 8-bit pixels
+SIZED_INLINE I32 calcBlkSATD (const I32 sz, const PIX *src1, const I32 stride1, const PIX *src2, const I32 stride2) {
+    const I32 n = MIN(sz, 8);
+    I32 blk [8][8];
+    I32 y, x, i, j, satd = 0;
+    
+    for (y=0; y<sz; y+=n) {
+        for (x=0; x<sz; x+=n) {
+            for (i=0; i<n; i++)
+                for (j=0; j<n; j++)
+                    blk[i][j] = (I32)src1[(y+i)*stride1+x+j] - src2[(y+i)*stride2+x+j];
+            satd += (n==8) ? ((calcHadamardSum(8, blk) + 2) >> 2) : ((calcHadamardSum(4, blk) + 1) >> 1);     // normalize the Hadamard transform
+        }
     }
     
+    return satd >> BD_SHIFT;
+}
 
-    //--------------------------------------------------------------------------------------------------------------------------------------------------------
-    // step2 : try no splitting to 4 CUs, part2Nx2N (no splitting to 4 PUs), no splitting to 4 TUs. Try all prediction modes
-    //--------------------------------------------------------------------------------------------------------------------------------------------------------
-    
-    getBorder(sz, bll_exist, blb_exist, baa_exist, bar_exist, blk_rcon, &ubla, ublb, ubar, &fbla, fblb, fbar);          // get border pixels for reconstructed image
 
-    for (pmode=0; pmode<PMODE_COUNT; pmode++) {                                                                         // for all prediction modes
-        CABACcoder tCABAC = oCABAC;                                                                                     // copy for trying.
-        ContextSet tCtxs  = oCtxs;
+// description : calculate the rough cost of a prediction mode : SATD + sqrt(lambda) * mode_bits
+const I32 SQRT_LAMBDA_X16 [QP_COUNT] = {                                                     // 16*sqrt(lambda), where lambda = RDCOST_WEIGHT_BITS / RDCOST_WEIGHT_DIST
+       3,   3,   4,   4,   5,   5,   6,   7,   8,   9,  10,  11,  12,  14,  15,  17,  19,  21,  24,  27,  31,  34,  38,  43,  48,  54,
+      61,  68,  77,  86,  96, 109, 122, 137, 153, 172, 193, 217, 244, 273, 307, 344, 387, 434, 487, 547, 614, 689, 773, 868, 974,1093};
+
+I32 calcSATDcost (const QPConsts *qc, const I32 satd, const I32 bits) {
+    return 16 * satd + qc->sqrt_lambda_x16 * bits;
+}
+
 
-        predict   (sz, CH_Y, pmode, ubla, ublb, ubar, fbla, fblb, fbar, blk_tmp1);                                      // predict, dst=blk_tmp1
-        BLK_SUB   (sz, blk_orig, blk_tmp1, blk_tmp2);                                                                   // calculate residual, dst=blk_tmp2
-        transform (sz, 0, blk_tmp2, blk_tmp2);                                                                          // src=blk_tmp2  dst=blk_tmp2
-        quantize  (qpd6, sz, pmode, blk_tmp2, blk_quat);                                                                // src=blk_tmp2  dst=blk_quat
-        deQuantize(qpd6, sz, blk_quat, blk_tmp2);                                                                       // src=blk_quat  dst=blk_tmp2
-        transform (sz, 1, blk_tmp2, blk_tmp2);                                                                          // src=blk_tmp2  dst=blk_tmp2
-        BLK_ADD_CLIP_TO_PIX(sz, blk_tmp2, blk_tmp1, blk_tmp1);                                                          // reconstruction, dst=blk_tmp1
+// description : select the candidate prediction modes for full RDO. When speed=0, all the modes are selected.
+//               Otherwise, all the modes are ranked by the rough cost, the best FAST_RDO_PMODE_COUNT[speed] modes and the probable modes (MPMs) are selected.
+// return      : the number of selected modes, which are saved in pmodes[] in ascending order
+I32 selectRDOpmodes (
+    const QPConsts *qc,
+    const I32   speed,
+    const I32   sz,
+    const PIX  *blk_orig,                                                                    // row stride = CTU_SZ
+    const PIX   ubla,
+    const PIX   ublb  [CTU_SZ*2],
+    const PIX   ubar  [CTU_SZ*2],
+    const PIX   fbla,
+    const PIX   fblb  [CTU_SZ*2],
+    const PIX   fbar  [CTU_SZ*2],
+    const I32   pmode_left,
+    const I32   pmode_above,
+          PIX  *blk_pred,                                                                    // scratch : sz*sz items , the predicted block of each mode (row stride = sz)
+          I32   pmodes [PMODE_COUNT]
+) {
+    const I32 n_best = FAST_RDO_PMODE_COUNT[speed];
+    const SizedKernels *ks = SIZED(sz);
+    
+    I32  probable_pmodes [3];
+    I32  best_pmodes [PMODE_COUNT];                                                          // the best modes sorted by rough cost (ascending)
+    I32  best_costs  [PMODE_COUNT];
+    BOOL selected    [PMODE_COUNT] = {0};
+    I32  pmode, i, cost, bits, count = 0;
+    
+    if (n_best >= PMODE_COUNT) {
+        for (pmode=0; pmode<PMODE_COUNT; pmode++)
+            pmodes[pmode] = pmode;
+        return PMODE_COUNT;
+    }
+    
+    getProbablePmodes(pmode_left, pmode_above, probable_pmodes);
+    
+    for (pmode=0; pmode<PMODE_COUNT; pmode++) {
+        if      (pmode == probable_pmodes[0])
+            bits = 2;                                                                        // estimated mode bits : prev_intra_luma_pred_flag + mpm_idx
+        else if (pmode == probable_pmodes[1] || pmode == probable_pmodes[2])
+            bits = 3;
+        else
+            bits = 6;                                                                        // estimated mode bits : prev_intra_luma_pred_flag + rem_intra_luma_pred_mode
         
-        putSplitCUflag(&tCABAC, &tCtxs, sz, 0, larger_than_left_cu, larger_than_above_cu);                              // split_cu_flag=0 (do not split to 4 CUs)
-        putCU_Part2Nx2N_noTUsplit(&tCABAC, &tCtxs, sz, pmode, pmode_left, pmode_above, blk_quat);                       // encode CU
+        ks->predict(CH_Y, pmode, ubla, ublb, ubar, fbla, fblb, fbar, blk_pred);
+        cost = calcSATDcost(qc, KERNELS.calcBlkSATD[sz/8](blk_orig, CTU_SZ, blk_pred, sz), bits);
         
-        CALC_BLK_SSE(sz, blk_orig, blk_tmp1, distortion);
-        rdcost = calcRDcost(qpd6, distortion, (CABAClen(&tCABAC) - CABAClen(&oCABAC)) );
-
-        if (rdcost_best>= rdcost) {                                                                                     // if current pmode can let RD-cost be smaller than the previous best RD-cost
-            rdcost_best = rdcost;
-            *pCABAC     = tCABAC;                                                                                       // update the best CABAC coder
-            *pCtxs      = tCtxs;                                                                                        // update the best Context set
-            BLK_COPY(sz, blk_tmp1, best_rcon);
-            BLK_SET (nTU, (UI8)sz   , map_cu_sz);                                                                       // fill map_cu_sz. Provide context for subsequent CUs
-            BLK_SET (nTU, (UI8)pmode, map_pmode);                                                                       // fill map_pmode. Provide context for subsequent CUs
+        if (count < n_best || cost < best_costs[n_best-1]) {                                 // insert to the sorted best list, which keeps at most n_best items
+            for (i=MIN(count, n_best-1); i>0 && best_costs[i-1]>cost; i--) {
+                best_costs [i] = best_costs [i-1];
+                best_pmodes[i] = best_pmodes[i-1];
+            }
+            best_costs [i] = cost;
+            best_pmodes[i] = pmode;
+            count = MIN(count+1, n_best);
         }
     }
     
-
-    //--------------------------------------------------------------------------------------------------------------------------------------------------------
-    // step3 : try no splitting to 4 CUs, part2Nx2N (no splitting to 4 PUs), but splitting to 4 TUs. Try all prediction modes
-    //--------------------------------------------------------------------------------------------------------------------------------------------------------
+    for (i=0; i<count; i++)
+        selected[best_pmodes[i]] = 1;
+    for (i=0; i<3; i++)
+        selected[probable_pmodes[i]] = 1;
     
-    for (pmode=0; pmode<PMODE_COUNT; pmode++) {                                                                         // for all prediction modes
-        CABACcoder tCABAC = oCABAC;                                                                                     // copy for trying.
-        ContextSet tCtxs  = oCtxs;
+    count = 0;
+    for (pmode=0; pmode<PMODE_COUNT; pmode++)
+        if (selected[pmode])
+            pmodes[count++] = pmode;
+    
+    return count;
+}
 
-        for (isub=0; isub<4; isub++) {
-            getBorder (sz/2, sub_bll_exist[isub], sub_blb_exist[isub], sub_baa_exist[isub], sub_bar_exist[isub], sub_blk_rcon[isub], &ubla, ublb, ubar, &fbla, fblb, fbar);    // get border pixels for reconstructed image
-            predict   (sz/2, CH_Y, pmode, ubla, ublb, ubar, fbla, fblb, fbar, blk_tmp1);                                // predict, dst=blk_tmp1
-            BLK_SUB   (sz/2, sub_blk_orig[isub], blk_tmp1, blk_tmp2);                                                   // calculate residual, dst=blk_tmp2
-            transform (sz/2, 0, blk_tmp2, blk_tmp2);                                                                    // src=blk_tmp2  dst=blk_tmp2
-            quantize  (qpd6, sz/2, pmode, blk_tmp2, sub_blk_quat[isub]);                                                // src=blk_tmp2  dst=sub_blk_quat[isub]
-            deQuantize(qpd6, sz/2, sub_blk_quat[isub], blk_tmp2);                                                       // src=sub_blk_quat[isub]  dst=blk_tmp2
-            transform (sz/2, 1, blk_tmp2, blk_tmp2);                                                                    // src=blk_tmp2  dst=blk_tmp2
-            BLK_ADD_CLIP_TO_PIX(sz/2, blk_tmp2, blk_tmp1, sub_blk_rcon[isub]);                                          // reconstruction, dst=sub_blk_rcon[isub]
-        }
 
-        putSplitCUflag(&tCABAC, &tCtxs, sz, 0, larger_than_left_cu, larger_than_above_cu);                              // split_cu_flag=0 (do not split to 4 CUs)
-        putCU_Part2Nx2N_TUsplit(&tCABAC, &tCtxs, sz, pmode, pmode_left, pmode_above, sub_blk_quat);                     // encode CU
 
-        CALC_BLK_SSE(sz, blk_orig, blk_rcon, distortion);
-        rdcost = calcRDcost(qpd6, distortion, (CABAClen(&tCABAC) - CABAClen(&oCABAC)) );
 
-        if (rdcost_best>= rdcost) {                                                                                     // if current pmode can let RD-cost be smaller than the previous best RD-cost
-            rdcost_best = rdcost;
-            *pCABAC     = tCABAC;                                                                                       // update the best CABAC coder
-            *pCtxs      = tCtxs;                                                                                        // update the best Context set
-            BLK_COPY(sz, blk_rcon, best_rcon);
-            BLK_SET (nTU, (UI8)sz   , map_cu_sz);                                                                       // fill map_cu_sz. Provide context for subsequent CUs
-            BLK_SET (nTU, (UI8)pmode, map_pmode);                                                                       // fill map_pmode. Provide context for subsequent CUs
-        }
-    }
-    
 
-    //--------------------------------------------------------------------------------------------------------------------------------------------------------
-    // step3 : try no splitting to 4 CUs, partNxN (splitting to 4 PUs).
-    //--------------------------------------------------------------------------------------------------------------------------------------------------------
-    
-    if (sz == MIN_CU_SZ) {
-        CABACcoder tCABAC = oCABAC;                                                                                     // copy for trying.
-        ContextSet tCtxs  = oCtxs;
+// instantiate the pixel block kernels of an instruction set (ISA is empty for C, or SSE41, AVX2 , the suffix of the templates) for a block size. TARGET is the attribute of the instruction set
+#define DEFINE_SIZED_PIXEL_KERNELS(SZ, ISA, TARGET)                                                                                                                         \
+TARGET void blkSub##SZ##ISA (const PIX *src1, const I32 stride1, const PIX *src2, const I32 stride2, I16 *dst) {                                                            \
+    blkSub##ISA(SZ, src1, stride1, src2, stride2, dst);                                                                                                                     \
+}                                                                                                                                                                           \
+TARGET void blkAddClipToPix##SZ##ISA (const I16 *src1, const PIX *src2, const I32 stride2, PIX *dst, const I32 dst_stride) {                                                \
+    blkAddClipToPix##ISA(SZ, src1, src2, stride2, dst, dst_stride);                                                                                                         \
+}                                                                                                                                                                           \
+TARGET I32 calcBlkSSE##SZ##ISA (const PIX *src1, const I32 stride1, const PIX *src2, const I32 stride2) {                                                                   \
+    return calcBlkSSE##ISA(SZ, src1, stride1, src2, stride2);                                                                                                               \
+}                                                                                                                                                                           \
+TARGET I32 calcBlkSATD##SZ##ISA (const PIX *src1, const I32 stride1, const PIX *src2, const I32 stride2) {                                                                  \
+    return calcBlkSATD##ISA(SZ, src1, stride1, src2, stride2);                                                                                                              \
+}                                                                                                                                                                           \
+TARGET void interpAngular##SZ##ISA (const PIX *ref, const I32 frac, PIX *dst) {                                                                                             \
+    interpAngular##ISA(SZ, ref, frac, dst);                                                                                                                                 \
+}
 
-        I32  sub_pmodes       [4] = {-1, -1, -1, -1};
-        I32  sub_pmodes_left  [4] = {-1, -1, -1, -1};
-        I32  sub_pmodes_above [4] = {-1, -1, -1, -1};
-        
-        for (isub=0; isub<4; isub++) {
-            I32 rdcost_subpart_best = I32_MAX_VALUE;
+DEFINE_SIZED_PIXEL_KERNELS(4 , , )
+DEFINE_SIZED_PIXEL_KERNELS(8 , , )
+DEFINE_SIZED_PIXEL_KERNELS(16, , )
+DEFINE_SIZED_PIXEL_KERNELS(32, , )
 
-            getBorder(sz/2, sub_bll_exist[isub], sub_blb_exist[isub], sub_baa_exist[isub], sub_bar_exist[isub], sub_blk_rcon[isub], &ubla, ublb, ubar, &fbla, fblb, fbar);
+#define    SIZED_ENTRIES(name, ISA)        { name##4##ISA, name##8##ISA, name##16##ISA, NULL, name##32##ISA }        // the instances of a kernel in a KernelTable , indexed by sz/8
+#define    BUTTERFLY_ENTRIES(name, ISA)    { NULL        , name##8##ISA, name##16##ISA, NULL, name##32##ISA }        // the 4x4 DST does not use the partial butterflies
 
-            for (pmode=0; pmode<PMODE_COUNT; pmode++) {
-                CABACcoder nCABAC = newCABACcoder();
-                ContextSet nCtxs  = newContextSet(qpd6);
 
-                predict   (sz/2, CH_Y, pmode, ubla, ublb, ubar, fbla, fblb, fbar, blk_tmp1);                            // predict, dst=blk_tmp1
-                BLK_SUB   (sz/2, sub_blk_orig[isub], blk_tmp1, blk_tmp2);                                               // calculate residual, dst=blk_tmp2
-                transform (sz/2, 0, blk_tmp2, blk_tmp2);                                                                // src=blk_tmp2  dst=blk_tmp2
-                quantize  (qpd6, sz/2, pmode, blk_tmp2, blk_quat);                                                      // src=blk_tmp2  dst=blk_quat
-                deQuantize(qpd6, sz/2, blk_quat, blk_tmp2);                                                             // src=blk_quat  dst=blk_tmp2
-                transform (sz/2, 1, blk_tmp2, blk_tmp2);                                                                // src=blk_tmp2  dst=blk_tmp2
-                BLK_ADD_CLIP_TO_PIX(sz/2, blk_tmp2, blk_tmp1, blk_tmp1);                                                // reconstruction, dst=blk_tmp1
 
-                putCoef(&nCABAC, &nCtxs, sz/2, CH_Y, pmode, blk_quat);
 
-                CALC_BLK_SSE(sz/2, sub_blk_orig[isub], blk_tmp1, distortion);
-                rdcost = calcRDcost(qpd6, distortion, CABAClen(&nCABAC) );
 
-                if (rdcost_subpart_best>= rdcost) {
-                    rdcost_subpart_best = rdcost;
-                    sub_pmodes[isub] = pmode;                                                                           // save the currently best pmode of this sub-part
-                    BLK_COPY(sz/2, blk_quat, sub_blk_quat[isub]);                                                       // backup the currently best quat to sub_blk_quat[isub], for further encoding.
-                    BLK_COPY(sz/2, blk_tmp1, sub_blk_rcon[isub]);                                                       // backup the reconstructed sub-part , as next sub-part's border reference.
-                }
-            }
-        }
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// SIMD kernels for x86 (SSE4.1 and AVX2) , and the runtime selection of the kernels according to CPUID
+// All of them give exactly the same results as the C kernels. Define HEVCE_NO_SIMD to build with the C kernels only
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-        // organize the context predict modes of the 4 PUs
-        sub_pmodes_left [0] = pmode_left;
-        sub_pmodes_above[0] = pmode_above;
-        sub_pmodes_left [1] = sub_pmodes[0];
-        sub_pmodes_above[1] = sub_map_pmode[1][-1][ 0];
-        sub_pmodes_left [2] = sub_map_pmode[2][ 0][-1];
-        sub_pmodes_above[2] = sub_pmodes[0];
-        sub_pmodes_left [3] = sub_pmodes[2];
-        sub_pmodes_above[3] = sub_pmodes[1];
+#ifdef HEVCE_SIMD
 
-        putSplitCUflag(&tCABAC, &tCtxs, sz, 0, larger_than_left_cu, larger_than_above_cu);                              // split_cu_flag=0 (do not split to 4 CUs)
-        putCU_PartNxN(&tCABAC, &tCtxs, sz, sub_pmodes, sub_pmodes_left, sub_pmodes_above, sub_blk_quat);                // encode CU
+#ifdef __GNUC__
+#define    TARGET_SSE41         __attribute__((target("sse4.1")))  // let gcc/clang generate SSE4.1 instructions for this function, even if the whole file is not compiled with -msse4.1
+#define    TARGET_AVX2          __attribute__((target("avx2")))
+typedef int UNALIGNED_I32 __attribute__((may_alias, aligned(1)));  // for loading/storing 4 pixels
+#else
+#define    TARGET_SSE41
+#define    TARGET_AVX2
+typedef int UNALIGNED_I32;
+#endif
 
-        CALC_BLK_SSE(sz, blk_orig, blk_rcon, distortion);
-        rdcost = calcRDcost(qpd6, distortion, (CABAClen(&tCABAC) - CABAClen(&oCABAC)) );
+#define    LOAD4(p)             _mm_cvtsi32_si128( *(const UNALIGNED_I32 *)(p) )                             // load 4 pixels to the low 32 bits
+#define    STORE4(p, v)         ( *(UNALIGNED_I32 *)(p) = _mm_cvtsi128_si32(v) )                             // store the low 32 bits as 4 pixels
+#define    LOAD8(p)             _mm_loadl_epi64 ((const __m128i *)(p))
+#define    LOAD16(p)            _mm_loadu_si128 ((const __m128i *)(p))
+#define    LOAD32(p)            _mm256_loadu_si256((const __m256i *)(p))
 
-        if (rdcost_best>= rdcost) {                                                                                     // if current pmode can let RD-cost be smaller than the previous best RD-cost
-            rdcost_best = rdcost;
-            *pCABAC     = tCABAC;                                                                                       // update the best CABAC coder
-            *pCtxs      = tCtxs;                                                                                        // update the best Context set
-            BLK_SET (nTU, (UI8)sz   , map_cu_sz);                                                                       // fill map_cu_sz. Provide context for subsequent CUs
-            BLK_SET (nTU/2, (UI8)sub_pmodes[0], sub_map_pmode[0]);                                                      // fill map_pmode. Provide context for subsequent CUs
-            BLK_SET (nTU/2, (UI8)sub_pmodes[1], sub_map_pmode[1]);                                                      // fill map_pmode. Provide context for subsequent CUs
-            BLK_SET (nTU/2, (UI8)sub_pmodes[2], sub_map_pmode[2]);                                                      // fill map_pmode. Provide context for subsequent CUs
-            BLK_SET (nTU/2, (UI8)sub_pmodes[3], sub_map_pmode[3]);                                                      // fill map_pmode. Provide context for subsequent CUs
-            return;
+
+TARGET_SSE41 I32 sumI32x4 (const __m128i v) {
+    const __m128i s = _mm_add_epi32(v, _mm_srli_si128(v, 8));
+    return _mm_cvtsi128_si32( _mm_add_epi32(s, _mm_srli_si128(s, 4)) );
+}
+
+
+#if HEVCE_BIT_DEPTH == 8                                       // the SIMD pixel kernels only handle 8-bit pixels. The high bit depths use the C pixel kernels and the SIMD transform kernels
+
+SIZED_INLINE TARGET_SSE41 void blkSubSSE41 (const I32 sz, const UI8 *src1, const I32 stride1, const UI8 *src2, const I32 stride2, I16 *dst) {
+    I32 i, j;
+    for (i=0; i<sz; i++, src1+=stride1, src2+=stride2, dst+=sz) {
+        if (sz == 4) {
+            _mm_storel_epi64((__m128i *)dst, _mm_sub_epi16( _mm_cvtepu8_epi16(LOAD4(src1)), _mm_cvtepu8_epi16(LOAD4(src2)) ) );
+        } else {
+            for (j=0; j<sz; j+=8)
+                _mm_storeu_si128((__m128i *)(dst+j), _mm_sub_epi16( _mm_cvtepu8_epi16(LOAD8(src1+j)), _mm_cvtepu8_epi16(LOAD8(src2+j)) ) );
         }
     }
+}
+
 
-    BLK_COPY(sz, best_rcon, blk_rcon);                                                                                  // finially write the best reconstructed CU to blk_rcon
+SIZED_INLINE TARGET_SSE41 void blkAddClipToPixSSE41 (const I32 sz, const I16 *src1, const UI8 *src2, const I32 stride2, UI8 *dst, const I32 dst_stride) {
+    I32 i, j;
+    __m128i r, p;
+    for (i=0; i<sz; i++, src1+=sz, src2+=stride2, dst+=dst_stride) {
+        if (sz == 4) {
+            r = _mm_loadl_epi64((const __m128i *)src1);
+            p = _mm_cvtepu8_epi16(LOAD4(src2));
+            STORE4(dst, _mm_packus_epi16(_mm_adds_epi16(r, p), p));                                         // the saturations of adds_epi16 and packus_epi16 are the same as PIX_CLIP
+        } else {
+            for (j=0; j<sz; j+=8) {
+                r = _mm_loadu_si128((const __m128i *)(src1+j));
+                p = _mm_cvtepu8_epi16(LOAD8(src2+j));
+                _mm_storel_epi64((__m128i *)(dst+j), _mm_packus_epi16(_mm_adds_epi16(r, p), p));
+            }
+        }
+    }
 }
 
 
+SIZED_INLINE TARGET_SSE41 I32 calcBlkSSESSE41 (const I32 sz, const UI8 *src1, const I32 stride1, const UI8 *src2, const I32 stride2) {
+    __m128i acc = _mm_setzero_si128(), d;
+    I32 i, j;
+    for (i=0; i<sz; i++, src1+=stride1, src2+=stride2) {
+        if (sz == 4) {
+            d   = _mm_sub_epi16( _mm_cvtepu8_epi16(LOAD4(src1)), _mm_cvtepu8_epi16(LOAD4(src2)) );
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(d, d));
+        } else {
+            for (j=0; j<sz; j+=8) {
+                d   = _mm_sub_epi16( _mm_cvtepu8_epi16(LOAD8(src1+j)), _mm_cvtepu8_epi16(LOAD8(src2+j)) );
+                acc = _mm_add_epi32(acc, _mm_madd_epi16(d, d));
+            }
+        }
+    }
+    return sumI32x4(acc);
+}
 
 
+// 8-point Hadamard butterflies between the 8 vectors r[0]~r[7] , for each 16-bit element
+#define HADAMARD8(r, ADD, SUB) {                                                \
+    I32 k_, s_;                                                                 \
+    for (s_=1; s_<8; s_<<=1)                                                    \
+        for (k_=0; k_<8; k_++)                                                  \
+            if ((k_ & s_) == 0) {                                               \
+                const T_ t_ = r[k_];                                            \
+                r[k_]    = ADD(t_, r[k_+s_]);                                   \
+                r[k_+s_] = SUB(t_, r[k_+s_]);                                   \
+            }                                                                   \
+}
 
-///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// top function of HEVC intra-frame image encoder
-///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// transpose the 8x8 16-bit elements in r[0]~r[7] (in each 128-bit lane)
+#define TRANSPOSE8x8_I16(r, UNPACK16L, UNPACK16H, UNPACK32L, UNPACK32H, UNPACK64L, UNPACK64H) {                            \
+    T_ a_[8], b_[8];                                                                                                         \
+    a_[0] = UNPACK16L(r[0], r[1]);   a_[1] = UNPACK16H(r[0], r[1]);   a_[2] = UNPACK16L(r[2], r[3]);   a_[3] = UNPACK16H(r[2], r[3]);   \
+    a_[4] = UNPACK16L(r[4], r[5]);   a_[5] = UNPACK16H(r[4], r[5]);   a_[6] = UNPACK16L(r[6], r[7]);   a_[7] = UNPACK16H(r[6], r[7]);   \
+    b_[0] = UNPACK32L(a_[0], a_[2]); b_[1] = UNPACK32H(a_[0], a_[2]); b_[2] = UNPACK32L(a_[1], a_[3]); b_[3] = UNPACK32H(a_[1], a_[3]); \
+    b_[4] = UNPACK32L(a_[4], a_[6]); b_[5] = UNPACK32H(a_[4], a_[6]); b_[6] = UNPACK32L(a_[5], a_[7]); b_[7] = UNPACK32H(a_[5], a_[7]); \
+    r[0]  = UNPACK64L(b_[0], b_[4]); r[1]  = UNPACK64H(b_[0], b_[4]); r[2]  = UNPACK64L(b_[1], b_[5]); r[3]  = UNPACK64H(b_[1], b_[5]); \
+    r[4]  = UNPACK64L(b_[2], b_[6]); r[5]  = UNPACK64H(b_[2], b_[6]); r[6]  = UNPACK64L(b_[3], b_[7]); r[7]  = UNPACK64H(b_[3], b_[7]); \
+}
 
-I32 HEVCImageEncoder (           // return   HEVC stream length (in bytes)
-          UI8 *pbuffer,          // buffer to save HEVC stream
-    const UI8 *img,              // 2-D array in 1-D buffer, height=ysz, width=xsz. Input the image to be compressed.
-          UI8 *img_rcon,         // 2-D array in 1-D buffer, height=ysz, width=xsz. The HEVC encoder will save the reconstructed image here.
-          I32 *ysz,              // point to image height, will be modified (clip to a multiple of CTU_SZ)
-          I32 *xsz,              // point to image width , will be modified (clip to a multiple of CTU_SZ)
-    const I32  qpd6              // quant value, must be 0~4. The larger, the higher compression ratio, but the lower quality.
-) {
-    CABACcoder tCABAC = newCABACcoder();
-    ContextSet tCtxs  = newContextSet(qpd6);
+
+SIZED_INLINE TARGET_SSE41 I32 calcBlkSATDSSE41 (const I32 sz, const UI8 *src1, const I32 stride1, const UI8 *src2, const I32 stride2) {
+    typedef __m128i T_;
+    const __m128i ones = _mm_set1_epi16(1);
+    __m128i r [8], acc;
+    I32 y, x, i, satd = 0;
     
-    const I32 yszn = ((MIN(*ysz, MAX_YSZ) + CTU_SZ - 1) / CTU_SZ) * CTU_SZ;                                            // pad the image height to multiple of CTU_SZ
-    const I32 xszn = ((MIN(*xsz, MAX_XSZ) + CTU_SZ - 1) / CTU_SZ) * CTU_SZ;                                            // pad the image width  to multiple of CTU_SZ
+    if (sz < 8)
+        return calcBlkSATD(sz, src1, stride1, src2, stride2);
     
-    UI8 *pbuf = pbuffer;
-
-    I32 y, x, i, j;
+    for (y=0; y<sz; y+=8) {
+        for (x=0; x<sz; x+=8) {
+            for (i=0; i<8; i++)
+                r[i] = _mm_sub_epi16( _mm_cvtepu8_epi16(LOAD8(src1+(y+i)*stride1+x)), _mm_cvtepu8_epi16(LOAD8(src2+(y+i)*stride2+x)) );
+            HADAMARD8(r, _mm_add_epi16, _mm_sub_epi16);                                                       // vertical
+            TRANSPOSE8x8_I16(r, _mm_unpacklo_epi16, _mm_unpackhi_epi16, _mm_unpacklo_epi32, _mm_unpackhi_epi32, _mm_unpacklo_epi64, _mm_unpackhi_epi64);
+            HADAMARD8(r, _mm_add_epi16, _mm_sub_epi16);                                                       // horizontal
+            acc = _mm_setzero_si128();
+            for (i=0; i<8; i++)
+                acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_abs_epi16(r[i]), ones));
+            satd += (sumI32x4(acc) + 2) >> 2;
+        }
+    }
+    return satd;
+}
 
-    UI8   ctu_orig   [  CTU_SZ][  CTU_SZ  ];
-    UI8   ctu_rcon_0 [1+CTU_SZ][1+CTU_SZ*2];
-    UI8 (*ctu_rcon)            [1+CTU_SZ*2] = (UI8 (*) [1+CTU_SZ*2]) &(ctu_rcon_0[1][1]) ;                             // ctu_rcon <- ctu_rcon_0[1][1]
-    
-    UI8 map_cu_sz_0 [1+nTUinCTU][1+nTUinROW];                                                                          // context line-buffer for CU-size
-    UI8 map_pmode_0 [1+nTUinCTU][1+nTUinROW];                                                                          // context line-buffer for predict mode
 
-    for (i=0; i<=nTUinCTU; i++) {
-        for (j=0; j<=nTUinROW; j++) {
-            map_cu_sz_0[i][j] = CTU_SZ;                                                                                // set all items in map_cu_sz_0 = CTU_SZ
-            map_pmode_0[i][j] = PMODE_DC;                                                                              // set all items in map_pmode_0 = PMODE_DC
+SIZED_INLINE TARGET_SSE41 void interpAngularSSE41 (const I32 sz, const UI8 *ref, const I32 frac, UI8 *dst) {
+    const __m128i w   = _mm_set1_epi16( (short)((frac << 8) | (32 - frac)) );                                 // the weights of the 2 adjacent pixels, as bytes
+    const __m128i r16 = _mm_set1_epi16(16);
+    __m128i lo, hi;
+    I32 j;
+    if (sz <= 8) {
+        lo = _mm_maddubs_epi16( _mm_unpacklo_epi8(LOAD8(ref), LOAD8(ref+1)), w );
+        lo = _mm_srli_epi16( _mm_add_epi16(lo, r16), 5 );
+        lo = _mm_packus_epi16(lo, lo);
+        if (sz == 4)
+            STORE4(dst, lo);
+        else
+            _mm_storel_epi64((__m128i *)dst, lo);
+    } else {
+        for (j=0; j<sz; j+=16) {
+            const __m128i a = LOAD16(ref+j);
+            const __m128i b = LOAD16(ref+j+1);
+            lo = _mm_srli_epi16( _mm_add_epi16(_mm_maddubs_epi16(_mm_unpacklo_epi8(a, b), w), r16), 5 );
+            hi = _mm_srli_epi16( _mm_add_epi16(_mm_maddubs_epi16(_mm_unpackhi_epi8(a, b), w), r16), 5 );
+            _mm_storeu_si128((__m128i *)(dst+j), _mm_packus_epi16(lo, hi));
         }
     }
-    
-    putHeaderToBuffer(&pbuf, qpd6, yszn, xszn);
-    
-    for (y=0; y<yszn; y+=CTU_SZ) {                                                                                     // for all CTU rows
-        for (x=0; x<xszn; x+=CTU_SZ) {                                                                                 // for all CTU columns
-            const BOOL bll_exist = x > 0;
-            const BOOL blb_exist = 0;
-            const BOOL baa_exist = y > 0;
-            const BOOL bar_exist = baa_exist && (x+CTU_SZ < xszn);
+}
+
+DEFINE_SIZED_PIXEL_KERNELS(4 , SSE41, TARGET_SSE41)
+DEFINE_SIZED_PIXEL_KERNELS(8 , SSE41, TARGET_SSE41)
+DEFINE_SIZED_PIXEL_KERNELS(16, SSE41, TARGET_SSE41)
+DEFINE_SIZED_PIXEL_KERNELS(32, SSE41, TARGET_SSE41)
+
+#endif // HEVCE_BIT_DEPTH == 8
+
+
+// partial butterfly (see partialButterfly) on 4 columns at a time. e (sz items) and o (sz/2 items) are the scratch vectors
+SIZED_INLINE TARGET_SSE41 void partialButterflySSE41 (const I32 sz, const I32 mat [][CTU_SZ], const I32 sft, const I32 *src, I32 *dst, __m128i *e, __m128i *o) {
+    const __m128i add  = _mm_set1_epi32(1 << sft >> 1);
+    const __m128i vsft = _mm_cvtsi32_si128(sft);
+    __m128i t;
+    I32 n, step, i, j, k;
+    
+    for (j=0; j<sz; j+=4) {
+        for (k=0; k<sz; k++)
+            e[k] = _mm_loadu_si128((const __m128i *)&src[k*sz+j]);
+        
+        for (n=sz, step=1; n>2; n/=2, step*=2) {
+            for (k=0; k<n/2; k++) {
+                o[k] = _mm_sub_epi32(e[k], e[n-1-k]);
+                e[k] = _mm_add_epi32(e[k], e[n-1-k]);
+            }
+            for (i=step; i<sz; i+=2*step) {
+                t = add;
+                for (k=0; k<n/2; k++)
+                    t = _mm_add_epi32(t, _mm_mullo_epi32(_mm_set1_epi32(mat[i][k]), o[k]));
+                _mm_storeu_si128((__m128i *)&dst[i*sz+j], _mm_sra_epi32(t, vsft));
+            }
+        }
+        
+        t = _mm_add_epi32(add, _mm_add_epi32(_mm_mullo_epi32(_mm_set1_epi32(mat[0][0]), e[0]), _mm_mullo_epi32(_mm_set1_epi32(mat[0][1]), e[1])));
+        _mm_storeu_si128((__m128i *)&dst[0*sz+j], _mm_sra_epi32(t, vsft));
+        t = _mm_add_epi32(add, _mm_add_epi32(_mm_mullo_epi32(_mm_set1_epi32(mat[step][0]), e[0]), _mm_mullo_epi32(_mm_set1_epi32(mat[step][1]), e[1])));
+        _mm_storeu_si128((__m128i *)&dst[step*sz+j], _mm_sra_epi32(t, vsft));
+    }
+}
+
+
+// inverse partial butterfly (see partialButterflyInv) on 4 columns at a time. s, e and o (sz items each) are the scratch vectors
+SIZED_INLINE TARGET_SSE41 void partialButterflyInvSSE41 (const I32 sz, const I32 mat [][CTU_SZ], const I32 sft, const I32 *src, I32 *dst, __m128i *s, __m128i *e, __m128i *o) {
+    const __m128i add  = _mm_set1_epi32(1 << sft >> 1);
+    const __m128i vsft = _mm_cvtsi32_si128(sft);
+    const __m128i vmin = _mm_set1_epi32(COEF_MIN_VALUE);
+    const __m128i vmax = _mm_set1_epi32(COEF_MAX_VALUE);
+    __m128i t;
+    I32 n, step, i, j, k;
+    
+    for (j=0; j<sz; j+=4) {
+        for (k=0; k<sz; k++)
+            s[k] = _mm_loadu_si128((const __m128i *)&src[k*sz+j]);
+        
+        for (n=sz, step=1; n>2; n/=2, step*=2) {
+            for (k=0; k<n/2; k++) {
+                t = _mm_setzero_si128();
+                for (i=step; i<sz; i+=2*step)
+                    t = _mm_add_epi32(t, _mm_mullo_epi32(_mm_set1_epi32(mat[i][k]), s[i]));
+                o[n/2+k] = t;
+            }
+        }
+        
+        e[0] = _mm_add_epi32(_mm_mullo_epi32(_mm_set1_epi32(mat[0][0]), s[0]), _mm_mullo_epi32(_mm_set1_epi32(mat[step][0]), s[step]));
+        e[1] = _mm_add_epi32(_mm_mullo_epi32(_mm_set1_epi32(mat[0][1]), s[0]), _mm_mullo_epi32(_mm_set1_epi32(mat[step][1]), s[step]));
+        
+        for (n=4; n<=sz; n*=2) {
+            for (k=0; k<n/2; k++) {
+                e[n-1-k] = _mm_sub_epi32(e[k], o[n/2+k]);
+                e[k]     = _mm_add_epi32(e[k], o[n/2+k]);
+            }
+        }
+        
+        for (k=0; k<sz; k++) {
+            t = _mm_sra_epi32(_mm_add_epi32(e[k], add), vsft);
+            _mm_storeu_si128((__m128i *)&dst[k*sz+j], _mm_min_epi32(_mm_max_epi32(t, vmin), vmax));
+        }
+    }
+}
+
+
+// instantiate the SIMD partial butterflies of an instruction set for a DCT size, with its matrix. VEC is the vector type of the instruction set, the scratch vectors are declared here with the size
+#define DEFINE_SIZED_BUTTERFLIES_SIMD(SZ, ISA, TARGET, VEC)                                     \
+TARGET void partialButterfly##SZ##ISA (const I32 sft, const I32 *src, I32 *dst) {               \
+    VEC e [SZ], o [SZ/2];                                                                       \
+    partialButterfly##ISA(SZ, DCT##SZ##_MAT, sft, src, dst, e, o);                              \
+}                                                                                               \
+TARGET void partialButterflyInv##SZ##ISA (const I32 sft, const I32 *src, I32 *dst) {            \
+    VEC s [SZ], e [SZ], o [SZ];                                                                 \
+    partialButterflyInv##ISA(SZ, DCT##SZ##_MAT, sft, src, dst, s, e, o);                        \
+}
+
+DEFINE_SIZED_BUTTERFLIES_SIMD(8 , SSE41, TARGET_SSE41, __m128i)
+DEFINE_SIZED_BUTTERFLIES_SIMD(16, SSE41, TARGET_SSE41, __m128i)
+DEFINE_SIZED_BUTTERFLIES_SIMD(32, SSE41, TARGET_SSE41, __m128i)
+
+
+
+#ifdef HEVCE_AVX2
+
+#if HEVCE_BIT_DEPTH == 8
+
+SIZED_INLINE TARGET_AVX2 void blkSubAVX2 (const I32 sz, const UI8 *src1, const I32 stride1, const UI8 *src2, const I32 stride2, I16 *dst) {
+    I32 i, j;
+    if (sz < 16) {
+        blkSubSSE41(sz, src1, stride1, src2, stride2, dst);
+        return;
+    }
+    for (i=0; i<sz; i++, src1+=stride1, src2+=stride2, dst+=sz)
+        for (j=0; j<sz; j+=16)
+            _mm256_storeu_si256((__m256i *)(dst+j), _mm256_sub_epi16( _mm256_cvtepu8_epi16(LOAD16(src1+j)), _mm256_cvtepu8_epi16(LOAD16(src2+j)) ) );
+}
+
+
+SIZED_INLINE TARGET_AVX2 void blkAddClipToPixAVX2 (const I32 sz, const I16 *src1, const UI8 *src2, const I32 stride2, UI8 *dst, const I32 dst_stride) {
+    __m256i r, p;
+    I32 i, j;
+    if (sz < 16) {
+        blkAddClipToPixSSE41(sz, src1, src2, stride2, dst, dst_stride);
+        return;
+    }
+    for (i=0; i<sz; i++, src1+=sz, src2+=stride2, dst+=dst_stride) {
+        for (j=0; j<sz; j+=16) {
+            r = LOAD32(src1+j);
+            p = _mm256_cvtepu8_epi16(LOAD16(src2+j));
+            r = _mm256_packus_epi16(_mm256_adds_epi16(r, p), p);
+            r = _mm256_permute4x64_epi64(r, 0xD8);                                                              // packus_epi16 works in each 128-bit lane, recover the order
+            _mm_storeu_si128((__m128i *)(dst+j), _mm256_castsi256_si128(r));
+        }
+    }
+}
+
+
+SIZED_INLINE TARGET_AVX2 I32 calcBlkSSEAVX2 (const I32 sz, const UI8 *src1, const I32 stride1, const UI8 *src2, const I32 stride2) {
+    __m256i acc = _mm256_setzero_si256(), d;
+    I32 i, j;
+    if (sz < 16)
+        return calcBlkSSESSE41(sz, src1, stride1, src2, stride2);
+    for (i=0; i<sz; i++, src1+=stride1, src2+=stride2) {
+        for (j=0; j<sz; j+=16) {
+            d   = _mm256_sub_epi16( _mm256_cvtepu8_epi16(LOAD16(src1+j)), _mm256_cvtepu8_epi16(LOAD16(src2+j)) );
+            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(d, d));
+        }
+    }
+    return sumI32x4( _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1)) );
+}
+
+
+// two 8x8 blocks (left and right) at a time, one in each 128-bit lane
+SIZED_INLINE TARGET_AVX2 I32 calcBlkSATDAVX2 (const I32 sz, const UI8 *src1, const I32 stride1, const UI8 *src2, const I32 stride2) {
+    typedef __m256i T_;
+    const __m256i ones = _mm256_set1_epi16(1);
+    __m256i r [8], acc;
+    I32 y, x, i, satd = 0;
+    
+    if (sz < 16)
+        return calcBlkSATDSSE41(sz, src1, stride1, src2, stride2);
+    
+    for (y=0; y<sz; y+=8) {
+        for (x=0; x<sz; x+=16) {
+            for (i=0; i<8; i++)
+                r[i] = _mm256_sub_epi16( _mm256_cvtepu8_epi16(LOAD16(src1+(y+i)*stride1+x)), _mm256_cvtepu8_epi16(LOAD16(src2+(y+i)*stride2+x)) );
+            HADAMARD8(r, _mm256_add_epi16, _mm256_sub_epi16);
+            TRANSPOSE8x8_I16(r, _mm256_unpacklo_epi16, _mm256_unpackhi_epi16, _mm256_unpacklo_epi32, _mm256_unpackhi_epi32, _mm256_unpacklo_epi64, _mm256_unpackhi_epi64);
+            HADAMARD8(r, _mm256_add_epi16, _mm256_sub_epi16);
+            acc = _mm256_setzero_si256();
+            for (i=0; i<8; i++)
+                acc = _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_abs_epi16(r[i]), ones));
+            satd += (sumI32x4(_mm256_castsi256_si128(acc)) + 2) >> 2;                                         // the left  block
+            satd += (sumI32x4(_mm256_extracti128_si256(acc, 1)) + 2) >> 2;                                     // the right block
+        }
+    }
+    return satd;
+}
+
+
+SIZED_INLINE TARGET_AVX2 void interpAngularAVX2 (const I32 sz, const UI8 *ref, const I32 frac, UI8 *dst) {
+    const __m256i w   = _mm256_set1_epi16( (short)((frac << 8) | (32 - frac)) );
+    const __m256i r16 = _mm256_set1_epi16(16);
+    __m256i a, b, lo, hi;
+    if (sz < 32) {
+        interpAngularSSE41(sz, ref, frac, dst);
+        return;
+    }
+    a  = LOAD32(ref);
+    b  = LOAD32(ref+1);
+    lo = _mm256_srli_epi16( _mm256_add_epi16(_mm256_maddubs_epi16(_mm256_unpacklo_epi8(a, b), w), r16), 5 );     // pixel 0~7  and 16~23
+    hi = _mm256_srli_epi16( _mm256_add_epi16(_mm256_maddubs_epi16(_mm256_unpackhi_epi8(a, b), w), r16), 5 );     // pixel 8~15 and 24~31
+    _mm256_storeu_si256((__m256i *)dst, _mm256_packus_epi16(lo, hi));
+}
+
+DEFINE_SIZED_PIXEL_KERNELS(4 , AVX2, TARGET_AVX2)                                           // the sizes below 16 are the SSE4.1 kernels inlined
+DEFINE_SIZED_PIXEL_KERNELS(8 , AVX2, TARGET_AVX2)
+DEFINE_SIZED_PIXEL_KERNELS(16, AVX2, TARGET_AVX2)
+DEFINE_SIZED_PIXEL_KERNELS(32, AVX2, TARGET_AVX2)
+
+#endif // HEVCE_BIT_DEPTH == 8
+
+
+// partial butterfly (see partialButterfly) on 8 columns at a time. e (sz items) and o (sz/2 items) are the scratch vectors
+SIZED_INLINE TARGET_AVX2 void partialButterflyAVX2 (const I32 sz, const I32 mat [][CTU_SZ], const I32 sft, const I32 *src, I32 *dst, __m256i *e, __m256i *o) {
+    const __m256i add  = _mm256_set1_epi32(1 << sft >> 1);
+    const __m128i vsft = _mm_cvtsi32_si128(sft);
+    __m256i t;
+    I32 n, step, i, j, k;
+    
+    for (j=0; j<sz; j+=8) {
+        for (k=0; k<sz; k++)
+            e[k] = LOAD32(&src[k*sz+j]);
+        
+        for (n=sz, step=1; n>2; n/=2, step*=2) {
+            for (k=0; k<n/2; k++) {
+                o[k] = _mm256_sub_epi32(e[k], e[n-1-k]);
+                e[k] = _mm256_add_epi32(e[k], e[n-1-k]);
+            }
+            for (i=step; i<sz; i+=2*step) {
+                t = add;
+                for (k=0; k<n/2; k++)
+                    t = _mm256_add_epi32(t, _mm256_mullo_epi32(_mm256_set1_epi32(mat[i][k]), o[k]));
+                _mm256_storeu_si256((__m256i *)&dst[i*sz+j], _mm256_sra_epi32(t, vsft));
+            }
+        }
+        
+        t = _mm256_add_epi32(add, _mm256_add_epi32(_mm256_mullo_epi32(_mm256_set1_epi32(mat[0][0]), e[0]), _mm256_mullo_epi32(_mm256_set1_epi32(mat[0][1]), e[1])));
+        _mm256_storeu_si256((__m256i *)&dst[0*sz+j], _mm256_sra_epi32(t, vsft));
+        t = _mm256_add_epi32(add, _mm256_add_epi32(_mm256_mullo_epi32(_mm256_set1_epi32(mat[step][0]), e[0]), _mm256_mullo_epi32(_mm256_set1_epi32(mat[step][1]), e[1])));
+        _mm256_storeu_si256((__m256i *)&dst[step*sz+j], _mm256_sra_epi32(t, vsft));
+    }
+}
+
+
+// inverse partial butterfly (see partialButterflyInv) on 8 columns at a time. s, e and o (sz items each) are the scratch vectors
+SIZED_INLINE TARGET_AVX2 void partialButterflyInvAVX2 (const I32 sz, const I32 mat [][CTU_SZ], const I32 sft, const I32 *src, I32 *dst, __m256i *s, __m256i *e, __m256i *o) {
+    const __m256i add  = _mm256_set1_epi32(1 << sft >> 1);
+    const __m128i vsft = _mm_cvtsi32_si128(sft);
+    const __m256i vmin = _mm256_set1_epi32(COEF_MIN_VALUE);
+    const __m256i vmax = _mm256_set1_epi32(COEF_MAX_VALUE);
+    __m256i t;
+    I32 n, step, i, j, k;
+    
+    for (j=0; j<sz; j+=8) {
+        for (k=0; k<sz; k++)
+            s[k] = LOAD32(&src[k*sz+j]);
+        
+        for (n=sz, step=1; n>2; n/=2, step*=2) {
+            for (k=0; k<n/2; k++) {
+                t = _mm256_setzero_si256();
+                for (i=step; i<sz; i+=2*step)
+                    t = _mm256_add_epi32(t, _mm256_mullo_epi32(_mm256_set1_epi32(mat[i][k]), s[i]));
+                o[n/2+k] = t;
+            }
+        }
+        
+        e[0] = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_set1_epi32(mat[0][0]), s[0]), _mm256_mullo_epi32(_mm256_set1_epi32(mat[step][0]), s[step]));
+        e[1] = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_set1_epi32(mat[0][1]), s[0]), _mm256_mullo_epi32(_mm256_set1_epi32(mat[step][1]), s[step]));
+        
+        for (n=4; n<=sz; n*=2) {
+            for (k=0; k<n/2; k++) {
+                e[n-1-k] = _mm256_sub_epi32(e[k], o[n/2+k]);
+                e[k]     = _mm256_add_epi32(e[k], o[n/2+k]);
+            }
+        }
+        
+        for (k=0; k<sz; k++) {
+            t = _mm256_sra_epi32(_mm256_add_epi32(e[k], add), vsft);
+            _mm256_storeu_si256((__m256i *)&dst[k*sz+j], _mm256_min_epi32(_mm256_max_epi32(t, vmin), vmax));
+        }
+    }
+}
+
+
+DEFINE_SIZED_BUTTERFLIES_SIMD(8 , AVX2, TARGET_AVX2, __m256i)
+DEFINE_SIZED_BUTTERFLIES_SIMD(16, AVX2, TARGET_AVX2, __m256i)
+DEFINE_SIZED_BUTTERFLIES_SIMD(32, AVX2, TARGET_AVX2, __m256i)
+
+#endif // HEVCE_AVX2
+
+
+
+// description : get the best SIMD instruction set that the CPU (and the OS) supports
+// return      : 0:none  1:SSE4.1  2:AVX2
+I32 getSIMDLevel () {
+#if defined(_MSC_VER)
+    int info [4];
+    I32 level = 0;
+    __cpuid(info, 1);
+    if ( (info[2] >> 19) & 1 ) {                                                                // SSE4.1
+        level = 1;
+#ifdef HEVCE_AVX2
+        if ( ((info[2] >> 27) & 1) && ((info[2] >> 28) & 1) && (_xgetbv(0) & 6) == 6 ) {      // OSXSAVE, AVX, and the OS saves the YMM registers
+            __cpuidex(info, 7, 0);
+            if ( (info[1] >> 5) & 1 )                                                           // AVX2
+                level = 2;
+        }
+#endif
+    }
+    return level;
+#else
+    __builtin_cpu_init();
+#ifdef HEVCE_AVX2
+    if (__builtin_cpu_supports("avx2"))
+        return 2;
+#endif
+    return __builtin_cpu_supports("sse4.1") ? 1 : 0;
+#endif
+}
+
+#endif // HEVCE_SIMD
 
-            UI8 (*map_cu_sz) [1+nTUinROW] = (UI8 (*) [1+nTUinROW]) &(map_cu_sz_0[1][1+GETnTU(x)]);                     // pointer: map_cu_sz <- map_cu_sz_0[1][1+x]
-            UI8 (*map_pmode) [1+nTUinROW] = (UI8 (*) [1+nTUinROW]) &(map_pmode_0[1][1+GETnTU(x)]);                     // pointer: map_pmode <- map_pmode_0[1][1+x]
+
+
+#define    PIXEL_KERNEL_ENTRIES(ISA)    SIZED_ENTRIES(blkSub, ISA), SIZED_ENTRIES(blkAddClipToPix, ISA), SIZED_ENTRIES(calcBlkSSE, ISA), SIZED_ENTRIES(calcBlkSATD, ISA), SIZED_ENTRIES(interpAngular, ISA)
+#define    BUTTERFLY_KERNEL_ENTRIES(ISA)    BUTTERFLY_ENTRIES(partialButterfly, ISA), BUTTERFLY_ENTRIES(partialButterflyInv, ISA)
+
+const KernelTable KERNELS_C = { PIXEL_KERNEL_ENTRIES(), BUTTERFLY_KERNEL_ENTRIES() };
+
+#ifdef HEVCE_SIMD
+
+#if HEVCE_BIT_DEPTH == 8
+const KernelTable KERNELS_SSE41 = { PIXEL_KERNEL_ENTRIES(SSE41), BUTTERFLY_KERNEL_ENTRIES(SSE41) };
+#else
+const KernelTable KERNELS_SSE41 = { PIXEL_KERNEL_ENTRIES(), BUTTERFLY_KERNEL_ENTRIES(SSE41) };                                  // the SIMD pixel kernels are for 8-bit pixels only
+#endif
+
+#ifdef HEVCE_AVX2
+#if HEVCE_BIT_DEPTH == 8
+const KernelTable KERNELS_AVX2 = { PIXEL_KERNEL_ENTRIES(AVX2), BUTTERFLY_KERNEL_ENTRIES(AVX2) };
+#else
+const KernelTable KERNELS_AVX2 = { PIXEL_KERNEL_ENTRIES(), BUTTERFLY_KERNEL_ENTRIES(AVX2) };
+#endif
+#endif
+
+#if defined(_MSC_VER)
+#define    PTR_LOAD(p)                                 ( *(void *volatile *)&(p) )                                                                  // volatile accesses have the acquire/release semantics on x86
+#define    PTR_COMPARE_AND_SWAP(p, old_val, new_val)   _InterlockedCompareExchangePointer((void *volatile *)&(p), (void *)(new_val), (void *)(old_val))
+#else
+#define    PTR_LOAD(p)                                 __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define    PTR_COMPARE_AND_SWAP(p, old_val, new_val)   __atomic_compare_exchange_n(&(p), &(old_val), (new_val), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#endif
+
+#endif // HEVCE_SIMD
+
+
+
+// description : select the kernels (C, SSE4.1 or AVX2) according to the CPU. It is called at the beginning of each encoding, and multiple encodings may call it concurrently,
+//               so KERNELS_SELECTED is only switched once from the C table to the SIMD table with an atomic compare-and-swap. A call that finds it already switched
+//               (or a CPU without SIMD) writes nothing, so the threads which are already encoding never see a write
+void initKernels () {
+#ifdef HEVCE_SIMD
+    const I32 simd_level = getSIMDLevel();
+    const KernelTable *kernels_c = &KERNELS_C;
+    const KernelTable *kernels = (simd_level >= 1) ? &KERNELS_SSE41 : kernels_c;
+#ifdef HEVCE_AVX2
+    if (simd_level >= 2)
+        kernels = &KERNELS_AVX2;
+#endif
+    if (kernels != kernels_c && PTR_LOAD(KERNELS_SELECTED) == kernels_c)
+        (void)PTR_COMPARE_AND_SWAP(KERNELS_SELECTED, kernels_c, kernels);                               // fails (and writes nothing) if another encoding has switched it first
+#endif
+}
+
+
+
+// description : get a random integer in min~max (Park-Miller random number generator, 0 < *seed < 2^31-1)
+I32 randomInt (I32 *seed, const I32 min, const I32 max) {
+    *seed = 16807 * (*seed % 127773) - 2836 * (*seed / 127773);
+    if (*seed < 0)
+        *seed += 2147483647;
+    return min + *seed % (max - min + 1);
+}
+
+
+
+// description : check the fast transforms (the size-specialized transform) with the reference transforms (transformRef) on random blocks of all sizes,
+//               and check the selected kernels (SIMD) with the C kernels (KERNELS_C) on random blocks of all sizes
+int HEVCImageEncoderSelfCheck (const int n_blocks) {
+    I32 src  [CTU_SZ][CTU_SZ], dst_ref  [CTU_SZ][CTU_SZ];
+    I16 coef [CTU_SZ*CTU_SZ], coef2 [CTU_SZ*CTU_SZ], coef_ref [CTU_SZ*CTU_SZ];
+    PIX pix1 [CTU_SZ*CTU_SZ], pix2 [CTU_SZ*CTU_SZ], pix3 [CTU_SZ*CTU_SZ], pix_ref [CTU_SZ*CTU_SZ];          // row stride = CTU_SZ
+    PIX ref  [CTU_SZ*2+2];
+    I32 seed = 1, n_fail = 0, iblk, sz, inverse, range, frac, i, j;
+    
+    initKernels();
+    
+    for (iblk=0; iblk<n_blocks; iblk++) {
+        for (sz=4; sz<=CTU_SZ; sz*=2) {
+            BOOL fail = 0;
+            
+            for (inverse=0; inverse<=1; inverse++) {
+                range = !inverse ? PIX_MAX_VALUE : (iblk%2) ? 32767 : 64;                           // residuals are HEVCE_BIT_DEPTH bits , coefficients can be as large as the clip range
+                for (i=0; i<sz; i++)
+                    for (j=0; j<sz; j++)
+                        coef[i*sz+j] = (I16)( src[i][j] = randomInt(&seed, -range, range) );
+                SIZED(sz)->transform((BOOL)inverse, coef, coef2);
+                transformRef(sz, (BOOL)inverse, src, dst_ref);
+                for (i=0; i<sz; i++)
+                    for (j=0; j<sz; j++)
+                        fail |= (coef2[i*sz+j] != dst_ref[i][j]);
+            }
+            
+            range = (iblk%2) ? 32767 : 300;
+            for (i=0; i<sz; i++) {
+                for (j=0; j<sz; j++) {
+                    pix1[i*CTU_SZ+j] = (PIX)randomInt(&seed, 0, PIX_MAX_VALUE);
+                    pix2[i*CTU_SZ+j] = (iblk%4<2) ? (PIX)randomInt(&seed, 0, PIX_MAX_VALUE) : PIX_CLIP(pix1[i*CTU_SZ+j] + randomInt(&seed, -8, 8));    // random , or similar to pix1
+                    coef[i*sz+j] = (I16)randomInt(&seed, -range, range);
+                }
+            }
             
+            BLK_SUB(sz, pix1, CTU_SZ, pix2, CTU_SZ, coef2);
+            KERNELS_C.blkSub[sz/8] (pix1, CTU_SZ, pix2, CTU_SZ, coef_ref);
+            BLK_ADD_CLIP_TO_PIX(sz, coef, pix1, CTU_SZ, pix3, CTU_SZ);
+            KERNELS_C.blkAddClipToPix[sz/8](coef, pix1, CTU_SZ, pix_ref, CTU_SZ);
+            for (i=0; i<sz; i++)
+                for (j=0; j<sz; j++)
+                    fail |= (coef2[i*sz+j] != coef_ref[i*sz+j]) || (pix3[i*CTU_SZ+j] != pix_ref[i*CTU_SZ+j]);
+            
+            CALC_BLK_SSE(sz, pix1, CTU_SZ, pix2, CTU_SZ, i);
+            fail |= i != KERNELS_C.calcBlkSSE[sz/8](pix1, CTU_SZ, pix2, CTU_SZ);
+            fail |= KERNELS.calcBlkSATD[sz/8](pix1, CTU_SZ, pix2, CTU_SZ) != KERNELS_C.calcBlkSATD[sz/8](pix1, CTU_SZ, pix2, CTU_SZ);
+            
+            frac = randomInt(&seed, 0, 31);
+            for (i=0; i<sz+1; i++)
+                ref[i] = (PIX)randomInt(&seed, 0, PIX_MAX_VALUE);
+            KERNELS.interpAngular  [sz/8](ref, frac, pix3);
+            KERNELS_C.interpAngular[sz/8](ref, frac, pix_ref);
+            for (j=0; j<sz; j++)
+                fail |= (pix3[j] != pix_ref[j]);
+            
+            n_fail += fail;
+        }
+    }
+    
+    return n_fail;
+}
+
+
+
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// process a CU (recursive). This function will give you some small small C pointer shake
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+SIZED_INLINE void processCURecurs (
+    const QPConsts   *qc,                                       // the constants of the QP of this CTU
+    const ContextSet *pCtxs_init,                               // the initial context set of the QP of this CTU, for the trials of PartNxN
+    const I32   speed,                                          // speed preset
+    CABACcoder *pCABAC,
+    ContextSet *pCtxs,
+    const PIX  *ctu_orig,                                       // the original pixels of the CTU (row stride = CTU_SZ)
+          PIX  *ctu_rcon,                                       // the reconstructed pixels of the CTU, with the above line and the left column (see RCON_STRIDE)
+          I16  *blk_coef,                                       // pointing to the quantized coefficients of this CU (sz*sz contiguous items). The best ones are saved here, for putCURecurs
+          UI8  *map_cu_sz,                                      // the CU-size     context of the CTU, with the above line and the left column (see MAP_STRIDE)
+          UI8  *map_pmode,                                      // the predict mode context of the CTU, with the above line and the left column (see MAP_STRIDE)
+          UI8  *map_part,                                       // the part types of the CTU (row stride = nTUinCTU). The best part type of this CU is saved here, for putCURecurs
+    const I32   sz,                                             // CU size
+    const I32   y,                                              // vertical   position of this CU in the CTU
+    const I32   x,                                              // horizontal position of this CU in the CTU
+    const BOOL  bll_exist,                                      // whether border on left exist
+    const BOOL  blb_exist,                                      // whether border on left-below exist
+    const BOOL  baa_exist,                                      // whether border on above exist
+    const BOOL  bar_exist,                                      // whether border on above-right exist
+    const BOOL  bla_exist,                                      // whether border on left-above exist
+          PIX  *blk_tmp1,                                       // scratch : sz*sz items , the predicted and reconstructed pixels of a trial (row stride = the block size)
+          I16  *blk_tmp2,                                       // scratch : sz*sz items , the residual and the coefficients of a TU , contiguous (row stride = TU size)
+          I16  *blk_quat,                                       // scratch : sz*sz items
+          I16  *blk_quat4,                                      // scratch : sz*sz items , the quantized coefficients of 4 TUs (or 4 PUs) , each is a contiguous quarter , in z-order
+          PIX  *best_rcon,                                      // scratch : sz*sz items , always hold the best reconstructed CU pixels, for finally recover the reconstructed CU (row stride = sz)
+          I16  *best_quat                                       // scratch : sz*sz items , always hold the quantized coefficients of the best CU, for finally recover blk_coef
+) {
+    const CABACcoder oCABAC = *pCABAC;                          // backup the original CABAC coder at oCABAC. It is an estimator (tmpbuf=NULL) , so the copy is small
+    const ContextSet oCtxs  = *pCtxs;                           // backup the original Context set at oCtxs . note that this operation will copy all the struct elements.
+
+    const I32  nTU = GETnTU(sz);                                // indicate how many rows/columns of minimal TUs in this CU
+    const I32  ty  = GETnTU(y);                                 // position of this CU in the CTU, in minimal TUs
+    const I32  tx  = GETnTU(x);
+    
+    const BOOL larger_than_left_cu  = sz > map_cu_sz[(ty+1)*MAP_STRIDE + tx  ];    // current CU is larger than the left CU
+    const BOOL larger_than_above_cu = sz > map_cu_sz[ ty   *MAP_STRIDE + tx+1];    // current CU is larger than the above CU
+    
+    const I32  pmode_left  = map_pmode[(ty+1)*MAP_STRIDE + tx  ];                  // left pmode context of this CU
+    const I32  pmode_above = map_pmode[ ty   *MAP_STRIDE + tx+1];                  // above pmode context of this CU
+
+    const PIX *blk_orig  = &ctu_orig [ y   *CTU_SZ      +  x   ];                  // the original      pixels of this CU (row stride = CTU_SZ)
+          PIX *blk_rcon  = &ctu_rcon [(y+1)*RCON_STRIDE + (x+1)];                  // the reconstructed pixels of this CU (row stride = RCON_STRIDE)
+          UI8 *blk_cu_sz = &map_cu_sz[(ty+1)*MAP_STRIDE + (tx+1)];                 // the contexts of this CU (row stride = MAP_STRIDE)
+          UI8 *blk_pmode = &map_pmode[(ty+1)*MAP_STRIDE + (tx+1)];
+          UI8 *blk_part  = &map_part [ ty   *nTUinCTU   +  tx   ];                 // the part types of this CU (row stride = nTUinCTU)
+
+    // judge border existance for sub blocks:  left-top sub block  right-top sub block  left-bottom sub block  right-bottom sub block
+    const BOOL sub_bll_exist [4] =           { bll_exist,          1        ,           bll_exist,             1 };
+    const BOOL sub_blb_exist [4] =           { bll_exist,          0        ,           blb_exist,             0 };
+    const BOOL sub_baa_exist [4] =           { baa_exist,          baa_exist,           1        ,             1 };
+    const BOOL sub_bar_exist [4] =           { baa_exist,          bar_exist,           1        ,             0 };
+    const BOOL sub_bla_exist [4] =           { bla_exist,          baa_exist,           bll_exist,             1 };
+
+    // the positions and pointers of sub blocks : left-top     right-top          left-bottom                  right-bottom
+    const I32   sub_y         [4] = { y         , y               , y+sz/2                     , y+sz/2                           };
+    const I32   sub_x         [4] = { x         , x+sz/2          , x                          , x+sz/2                           };
+    const PIX  *sub_blk_orig  [4] = { blk_orig  , blk_orig+sz/2   , blk_orig+sz/2*CTU_SZ       , blk_orig+sz/2*CTU_SZ+sz/2        };
+          PIX  *sub_blk_rcon  [4] = { blk_rcon  , blk_rcon+sz/2   , blk_rcon+sz/2*RCON_STRIDE  , blk_rcon+sz/2*RCON_STRIDE+sz/2   };
+          UI8  *sub_blk_pmode [4] = { blk_pmode , blk_pmode+nTU/2 , blk_pmode+nTU/2*MAP_STRIDE , blk_pmode+nTU/2*MAP_STRIDE+nTU/2 };
+          I16  *sub_blk_coef  [4] = { blk_coef  , blk_coef+sz*sz/4, blk_coef+sz*sz/4*2         , blk_coef+sz*sz/4*3               };    // the coefficients of the sub CUs (or the 4 TUs, or the 4 PUs) are the 4 contiguous quarters , in z-order
+    
+    PIX ubla , ublb[CTU_SZ*2] , ubar[CTU_SZ*2];                 // to save unfiltered border pixels
+    PIX fbla , fblb[CTU_SZ*2] , fbar[CTU_SZ*2];                 // to save   filtered border pixels
+
+    I16  *sub_blk_quat   [4]                = {                      blk_quat4          ,                      blk_quat4+sz*sz/4    ,                      blk_quat4+sz*sz/4*2  ,                      blk_quat4+sz*sz/4*3      };
+
+    I32 rdo_pmodes [PMODE_COUNT];                               // the candidate prediction modes for full RDO
+    I32 n_rdo_pmodes, ipm;
+
+    const SizedKernels *ks     = SIZED(sz);                     // the size-specialized kernels of this CU , resolved once here
+    const SizedKernels *ks_sub = SIZED(sz/2);                   // the size-specialized kernels of the quarters of this CU (sub CUs, TUs or PUs)
+
+    const BOOL fast_cu  = FAST_CU_DECISION[speed];
+    const I32  qstep_sq = qc->qstep_sq_x16;                     // the square of quantize step, x16
+    BOOL try_split      = sz > MIN_CU_SZ;                       // if CU not larger than the smallest CU, try splitting to 4 CUs
+    BOOL try_nosplit    = 1;
+    BOOL best_cbf       = 1;                                    // whether the best un-split CU has non-zero coefficients
+    I32  best_pmode     = PMODE_DC;                             // the pmode of the best un-split CU (part2Nx2N)
+    I32  best_part      = PART_2Nx2N;                           // the part type of the best un-split CU (part2Nx2N)
+
+    I32 isub, pmode, distortion, rdcost, rdcost_best=I32_MAX_VALUE;
+
+    //--------------------------------------------------------------------------------------------------------------------------------------------------------
+    // step0 : (fast CU decision only) pre-decide CU depth by texture. A highly textured CU is always split, so the un-split CU is not tried
+    //--------------------------------------------------------------------------------------------------------------------------------------------------------
+    
+    if (fast_cu) {
+        const I32 th = TEXTURE_VAR_X16[speed][sz<CTU_SZ];
+        if (try_split && th > 0 && 256 * calcBlkVariance(sz, blk_orig, CTU_SZ) > th * qstep_sq)
+            try_nosplit = 0;
+    }
+    
+
+    //--------------------------------------------------------------------------------------------------------------------------------------------------------
+    // step1 : try splitting to 4 CUs. When fast CU decision is used, it is tried in step4 instead, after the un-split CU is known
+    //--------------------------------------------------------------------------------------------------------------------------------------------------------
+    
+    if (try_split && !fast_cu) {
+        putSplitCUflag(pCABAC, pCtxs, sz, 1, larger_than_left_cu, larger_than_above_cu);                                // split_cu_flag=1 (split to 4 CUs)
+
+        for (isub=0; isub<4; isub++)
+            ks_sub->processCU(qc, pCtxs_init, speed, pCABAC, pCtxs, ctu_orig, ctu_rcon, sub_blk_coef[isub], map_cu_sz, map_pmode, map_part, sub_y[isub], sub_x[isub], sub_bll_exist[isub], sub_blb_exist[isub], sub_baa_exist[isub], sub_bar_exist[isub], sub_bla_exist[isub]);
+        
+        CALC_BLK_SSE(sz, blk_orig, CTU_SZ, blk_rcon, RCON_STRIDE, distortion);
+        rdcost_best = calcRDcostEst(qc, distortion, (pCABAC->est_bits - oCABAC.est_bits) );
+
+        BLK_COPY(sz, blk_rcon, RCON_STRIDE, best_rcon, sz);                                                         // backup the reconstructed block, since subsequent code will modify it
+        VEC_COPY(sz*sz, blk_coef, best_quat);                                                                           // backup the quantized coefficients of the sub CUs
+    }
+    
+
+    //--------------------------------------------------------------------------------------------------------------------------------------------------------
+    // step2 : try no splitting to 4 CUs, part2Nx2N (no splitting to 4 PUs), no splitting to 4 TUs. Try all prediction modes
+    //--------------------------------------------------------------------------------------------------------------------------------------------------------
+    
+    n_rdo_pmodes = 0;
+    
+    getBorder(sz, bll_exist, blb_exist, baa_exist, bar_exist, bla_exist, ctu_rcon, y, x, &ubla, ublb, ubar, &fbla, fblb, fbar);        // get border pixels for reconstructed image
+
+    if (try_nosplit) {
+        n_rdo_pmodes = selectRDOpmodes(qc, speed, sz, blk_orig, ubla, ublb, ubar, fbla, fblb, fbar, pmode_left, pmode_above, blk_tmp1, rdo_pmodes);    // select the candidate prediction modes, they are also used in step3
+    }
+
+    for (ipm=0; ipm<n_rdo_pmodes; ipm++) {                                                                              // for all candidate prediction modes
+        CABACcoder tCABAC = oCABAC;                                                                                     // copy for trying.
+        ContextSet tCtxs  = oCtxs;
+
+        pmode = rdo_pmodes[ipm];
+        ks->predict   (CH_Y, pmode, ubla, ublb, ubar, fbla, fblb, fbar, blk_tmp1);                                      // predict, dst=blk_tmp1
+        BLK_SUB   (sz, blk_orig, CTU_SZ, blk_tmp1, sz, blk_tmp2);                                                       // calculate residual, dst=blk_tmp2
+        ks->transform (0, blk_tmp2, blk_tmp2);                                                                          // src=blk_tmp2  dst=blk_tmp2
+        ks->quantize  (qc, pmode, blk_tmp2, blk_quat);                                                                // src=blk_tmp2  dst=blk_quat
+        ks->deQuantize(qc, blk_quat, blk_tmp2);                                                                       // src=blk_quat  dst=blk_tmp2
+        ks->transform (1, blk_tmp2, blk_tmp2);                                                                          // src=blk_tmp2  dst=blk_tmp2
+        BLK_ADD_CLIP_TO_PIX(sz, blk_tmp2, blk_tmp1, sz, blk_tmp1, sz);                                                  // reconstruction, dst=blk_tmp1
+        
+        putSplitCUflag(&tCABAC, &tCtxs, sz, 0, larger_than_left_cu, larger_than_above_cu);                              // split_cu_flag=0 (do not split to 4 CUs)
+        putCU_Part2Nx2N_noTUsplit(&tCABAC, &tCtxs, sz, pmode, pmode_left, pmode_above, blk_quat, NULL);                 // encode CU
+        
+        CALC_BLK_SSE(sz, blk_orig, CTU_SZ, blk_tmp1, sz, distortion);
+        rdcost = calcRDcostEst(qc, distortion, (tCABAC.est_bits - oCABAC.est_bits) );
+
+        if (rdcost_best>= rdcost) {                                                                                     // if current pmode can let RD-cost be smaller than the previous best RD-cost
+            rdcost_best = rdcost;
+            *pCABAC     = tCABAC;                                                                                       // update the best CABAC coder
+            *pCtxs      = tCtxs;                                                                                        // update the best Context set
+            best_pmode  = pmode;
+            best_part   = PART_2Nx2N;
+            best_cbf    = ks->blkNotAllZero(blk_quat);
+            BLK_COPY(sz, blk_tmp1, sz, best_rcon, sz);
+            VEC_COPY(sz*sz, blk_quat, best_quat);
+            BLK_SET (nTU, (UI8)PART_2Nx2N, blk_part, nTUinCTU);
+            BLK_SET (nTU, (UI8)sz   , blk_cu_sz, MAP_STRIDE);                                                           // fill map_cu_sz. Provide context for subsequent CUs
+            BLK_SET (nTU, (UI8)pmode, blk_pmode, MAP_STRIDE);                                                           // fill map_pmode. Provide context for subsequent CUs
+        }
+    }
+    
+
+    //--------------------------------------------------------------------------------------------------------------------------------------------------------
+    // step3 : try no splitting to 4 CUs, part2Nx2N (no splitting to 4 PUs), but splitting to 4 TUs. Try all prediction modes
+    //--------------------------------------------------------------------------------------------------------------------------------------------------------
+    
+    for (ipm=0; ipm<n_rdo_pmodes; ipm++) {                                                                              // for all candidate prediction modes
+        CABACcoder tCABAC = oCABAC;                                                                                     // copy for trying.
+        ContextSet tCtxs  = oCtxs;
+
+        pmode = rdo_pmodes[ipm];
+        for (isub=0; isub<4; isub++) {
+            getBorder (sz/2, sub_bll_exist[isub], sub_blb_exist[isub], sub_baa_exist[isub], sub_bar_exist[isub], sub_bla_exist[isub], ctu_rcon, sub_y[isub], sub_x[isub], &ubla, ublb, ubar, &fbla, fblb, fbar);    // get border pixels for reconstructed image
+            ks_sub->predict   (CH_Y, pmode, ubla, ublb, ubar, fbla, fblb, fbar, blk_tmp1);                              // predict, dst=blk_tmp1
+            BLK_SUB   (sz/2, sub_blk_orig[isub], CTU_SZ, blk_tmp1, sz/2, blk_tmp2);                                     // calculate residual, dst=blk_tmp2
+            ks_sub->transform (0, blk_tmp2, blk_tmp2);                                                                  // src=blk_tmp2  dst=blk_tmp2
+            ks_sub->quantize  (qc, pmode, blk_tmp2, sub_blk_quat[isub]);                                              // src=blk_tmp2  dst=sub_blk_quat[isub]
+            ks_sub->deQuantize(qc, sub_blk_quat[isub], blk_tmp2);                                                     // src=sub_blk_quat[isub]  dst=blk_tmp2
+            ks_sub->transform (1, blk_tmp2, blk_tmp2);                                                                  // src=blk_tmp2  dst=blk_tmp2
+            BLK_ADD_CLIP_TO_PIX(sz/2, blk_tmp2, blk_tmp1, sz/2, sub_blk_rcon[isub], RCON_STRIDE);                       // reconstruction, dst=sub_blk_rcon[isub]
+        }
+
+        putSplitCUflag(&tCABAC, &tCtxs, sz, 0, larger_than_left_cu, larger_than_above_cu);                              // split_cu_flag=0 (do not split to 4 CUs)
+        putCU_Part2Nx2N_TUsplit(&tCABAC, &tCtxs, sz, pmode, pmode_left, pmode_above, blk_quat4, NULL);                  // encode CU
+
+        CALC_BLK_SSE(sz, blk_orig, CTU_SZ, blk_rcon, RCON_STRIDE, distortion);
+        rdcost = calcRDcostEst(qc, distortion, (tCABAC.est_bits - oCABAC.est_bits) );
+
+        if (rdcost_best>= rdcost) {                                                                                     // if current pmode can let RD-cost be smaller than the previous best RD-cost
+            rdcost_best = rdcost;
+            *pCABAC     = tCABAC;                                                                                       // update the best CABAC coder
+            *pCtxs      = tCtxs;                                                                                        // update the best Context set
+            best_pmode  = pmode;
+            best_part   = PART_2Nx2N_TUsplit;
+            best_cbf    = ks->blkNotAllZero(blk_quat4);
+            BLK_COPY(sz, blk_rcon, RCON_STRIDE, best_rcon, sz);
+            VEC_COPY(sz*sz, blk_quat4, best_quat);
+            BLK_SET (nTU, (UI8)PART_2Nx2N_TUsplit, blk_part, nTUinCTU);
+            BLK_SET (nTU, (UI8)sz   , blk_cu_sz, MAP_STRIDE);                                                           // fill map_cu_sz. Provide context for subsequent CUs
+            BLK_SET (nTU, (UI8)pmode, blk_pmode, MAP_STRIDE);                                                           // fill map_pmode. Provide context for subsequent CUs
+        }
+    }
+    
+
+    //--------------------------------------------------------------------------------------------------------------------------------------------------------
+    // step3 : try no splitting to 4 CUs, partNxN (splitting to 4 PUs).
+    //--------------------------------------------------------------------------------------------------------------------------------------------------------
+    
+    if (sz == MIN_CU_SZ) {
+        CABACcoder tCABAC = oCABAC;                                                                                     // copy for trying.
+        ContextSet tCtxs  = oCtxs;
+        const CABACcoder iCABAC = newCABACestimator();                                                                  // each PU is tried with a new CABAC coder and a new context set. Get them only once here
+        const ContextSet iCtxs  = *pCtxs_init;
+
+        I32  sub_pmodes       [4] = {-1, -1, -1, -1};
+        I32  sub_pmodes_left  [4] = {-1, -1, -1, -1};
+        I32  sub_pmodes_above [4] = {-1, -1, -1, -1};
+        
+        for (isub=0; isub<4; isub++) {
+            const I32 sub_pmode_left  = (isub==0) ? pmode_left  : (isub==1) ? sub_pmodes[0] : (isub==2) ? map_pmode[(ty+nTU/2+1)*MAP_STRIDE + tx] : sub_pmodes[2];
+            const I32 sub_pmode_above = (isub==0) ? pmode_above : (isub==1) ? map_pmode[ty*MAP_STRIDE + tx+1+nTU/2] : (isub==2) ? sub_pmodes[0] : sub_pmodes[1];
+            I32 rdcost_subpart_best = I32_MAX_VALUE;
+
+            getBorder(sz/2, sub_bll_exist[isub], sub_blb_exist[isub], sub_baa_exist[isub], sub_bar_exist[isub], sub_bla_exist[isub], ctu_rcon, sub_y[isub], sub_x[isub], &ubla, ublb, ubar, &fbla, fblb, fbar);
+
+            n_rdo_pmodes = selectRDOpmodes(qc, speed, sz/2, sub_blk_orig[isub], ubla, ublb, ubar, fbla, fblb, fbar, sub_pmode_left, sub_pmode_above, blk_tmp1, rdo_pmodes);
+
+            for (ipm=0; ipm<n_rdo_pmodes; ipm++) {
+                CABACcoder nCABAC = iCABAC;
+                ContextSet nCtxs  = iCtxs;
+
+                pmode = rdo_pmodes[ipm];
+                ks_sub->predict   (CH_Y, pmode, ubla, ublb, ubar, fbla, fblb, fbar, blk_tmp1);                          // predict, dst=blk_tmp1
+                BLK_SUB   (sz/2, sub_blk_orig[isub], CTU_SZ, blk_tmp1, sz/2, blk_tmp2);                                 // calculate residual, dst=blk_tmp2
+                ks_sub->transform (0, blk_tmp2, blk_tmp2);                                                              // src=blk_tmp2  dst=blk_tmp2
+                ks_sub->quantize  (qc, pmode, blk_tmp2, blk_quat);                                                    // src=blk_tmp2  dst=blk_quat
+                ks_sub->deQuantize(qc, blk_quat, blk_tmp2);                                                           // src=blk_quat  dst=blk_tmp2
+                ks_sub->transform (1, blk_tmp2, blk_tmp2);                                                              // src=blk_tmp2  dst=blk_tmp2
+                BLK_ADD_CLIP_TO_PIX(sz/2, blk_tmp2, blk_tmp1, sz/2, blk_tmp1, sz/2);                                    // reconstruction, dst=blk_tmp1
+
+                ks_sub->putCoef(&nCABAC, &nCtxs, CH_Y, pmode, blk_quat);
+
+                CALC_BLK_SSE(sz/2, sub_blk_orig[isub], CTU_SZ, blk_tmp1, sz/2, distortion);
+                rdcost = calcRDcostEst(qc, distortion, nCABAC.est_bits );
+
+                if (rdcost_subpart_best>= rdcost) {
+                    rdcost_subpart_best = rdcost;
+                    sub_pmodes[isub] = pmode;                                                                           // save the currently best pmode of this sub-part
+                    VEC_COPY(sz*sz/4, blk_quat, sub_blk_quat[isub]);                                                    // backup the currently best quat to sub_blk_quat[isub], for further encoding.
+                    BLK_COPY(sz/2, blk_tmp1, sz/2, sub_blk_rcon[isub], RCON_STRIDE);                                    // backup the reconstructed sub-part , as next sub-part's border reference.
+                }
+            }
+        }
+
+        // organize the context predict modes of the 4 PUs
+        sub_pmodes_left [0] = pmode_left;
+        sub_pmodes_above[0] = pmode_above;
+        sub_pmodes_left [1] = sub_pmodes[0];
+        sub_pmodes_above[1] = map_pmode[ty*MAP_STRIDE + tx+1+nTU/2];
+        sub_pmodes_left [2] = map_pmode[(ty+nTU/2+1)*MAP_STRIDE + tx];
+        sub_pmodes_above[2] = sub_pmodes[0];
+        sub_pmodes_left [3] = sub_pmodes[2];
+        sub_pmodes_above[3] = sub_pmodes[1];
+
+        putSplitCUflag(&tCABAC, &tCtxs, sz, 0, larger_than_left_cu, larger_than_above_cu);                              // split_cu_flag=0 (do not split to 4 CUs)
+        putCU_PartNxN(&tCABAC, &tCtxs, sz, sub_pmodes, sub_pmodes_left, sub_pmodes_above, blk_quat4, NULL);             // encode CU
+
+        CALC_BLK_SSE(sz, blk_orig, CTU_SZ, blk_rcon, RCON_STRIDE, distortion);
+        rdcost = calcRDcostEst(qc, distortion, (tCABAC.est_bits - oCABAC.est_bits) );
+
+        if (rdcost_best>= rdcost) {                                                                                     // if current pmode can let RD-cost be smaller than the previous best RD-cost
+            rdcost_best = rdcost;
+            *pCABAC     = tCABAC;                                                                                       // update the best CABAC coder
+            *pCtxs      = tCtxs;                                                                                        // update the best Context set
+            VEC_COPY(sz*sz, blk_quat4, blk_coef);
+            BLK_SET (nTU, (UI8)PART_NxN, blk_part, nTUinCTU);
+            BLK_SET (nTU, (UI8)sz   , blk_cu_sz, MAP_STRIDE);                                                           // fill map_cu_sz. Provide context for subsequent CUs
+            BLK_SET (nTU/2, (UI8)sub_pmodes[0], sub_blk_pmode[0], MAP_STRIDE);                                          // fill map_pmode. Provide context for subsequent CUs
+            BLK_SET (nTU/2, (UI8)sub_pmodes[1], sub_blk_pmode[1], MAP_STRIDE);                                          // fill map_pmode. Provide context for subsequent CUs
+            BLK_SET (nTU/2, (UI8)sub_pmodes[2], sub_blk_pmode[2], MAP_STRIDE);                                          // fill map_pmode. Provide context for subsequent CUs
+            BLK_SET (nTU/2, (UI8)sub_pmodes[3], sub_blk_pmode[3], MAP_STRIDE);                                          // fill map_pmode. Provide context for subsequent CUs
+            return;
+        }
+    }
+    
+
+    //--------------------------------------------------------------------------------------------------------------------------------------------------------
+    // step4 : (fast CU decision only) try splitting to 4 CUs, unless the best un-split CU is already good enough : it has no residual, or its RD-cost is small enough.
+    //         If the un-split CU is not tried (step0), the split is always taken, and blk_rcon and blk_coef already hold it
+    //--------------------------------------------------------------------------------------------------------------------------------------------------------
+    
+    if (try_split && !try_nosplit) {
+        putSplitCUflag(pCABAC, pCtxs, sz, 1, larger_than_left_cu, larger_than_above_cu);                                // split_cu_flag=1 (split to 4 CUs)
+        
+        for (isub=0; isub<4; isub++)
+            ks_sub->processCU(qc, pCtxs_init, speed, pCABAC, pCtxs, ctu_orig, ctu_rcon, sub_blk_coef[isub], map_cu_sz, map_pmode, map_part, sub_y[isub], sub_x[isub], sub_bll_exist[isub], sub_blb_exist[isub], sub_baa_exist[isub], sub_bar_exist[isub], sub_bla_exist[isub]);
+        
+        return;
+    }
+    
+    if (try_split && fast_cu && best_cbf && rdcost_best >= calcRDcost(qc, 0, sz*sz*SKIP_SPLIT_BPP_X16[speed][sz<CTU_SZ]/16) ) {
+        CABACcoder tCABAC = oCABAC;                                                                                     // copy for trying.
+        ContextSet tCtxs  = oCtxs;
+        
+        putSplitCUflag(&tCABAC, &tCtxs, sz, 1, larger_than_left_cu, larger_than_above_cu);                              // split_cu_flag=1 (split to 4 CUs)
+        
+        for (isub=0; isub<4; isub++)
+            ks_sub->processCU(qc, pCtxs_init, speed, &tCABAC, &tCtxs, ctu_orig, ctu_rcon, sub_blk_coef[isub], map_cu_sz, map_pmode, map_part, sub_y[isub], sub_x[isub], sub_bll_exist[isub], sub_blb_exist[isub], sub_baa_exist[isub], sub_bar_exist[isub], sub_bla_exist[isub]);
+        
+        CALC_BLK_SSE(sz, blk_orig, CTU_SZ, blk_rcon, RCON_STRIDE, distortion);
+        rdcost = calcRDcostEst(qc, distortion, (tCABAC.est_bits - oCABAC.est_bits) );
+        
+        if (rdcost_best > rdcost) {                                                                                     // splitting is better than the best un-split CU
+            rdcost_best = rdcost;
+            *pCABAC     = tCABAC;                                                                                       // update the best CABAC coder
+            *pCtxs      = tCtxs;                                                                                        // update the best Context set
+            BLK_COPY(sz, blk_rcon, RCON_STRIDE, best_rcon, sz);
+            VEC_COPY(sz*sz, blk_coef, best_quat);
+        } else {
+            BLK_SET (nTU, (UI8)sz        , blk_cu_sz, MAP_STRIDE);                                                      // the sub CUs have modified map_cu_sz, recover it
+            BLK_SET (nTU, (UI8)best_pmode, blk_pmode, MAP_STRIDE);                                                      // the sub CUs have modified map_pmode, recover it
+            BLK_SET (nTU, (UI8)best_part , blk_part , nTUinCTU  );                                                      // the sub CUs have modified map_part , recover it
+        }
+    }
+
+    BLK_COPY(sz, best_rcon, sz, blk_rcon, RCON_STRIDE);                                                                 // finially write the best reconstructed CU to blk_rcon
+    VEC_COPY(sz*sz, best_quat, blk_coef);                                                                               // finially write the quantized coefficients of the best CU to blk_coef
+}
+
+
+
+// description : put a CU (recursive) to HEVC stream, according to the decisions made by processCURecurs : the CU sizes (map_cu_sz), the prediction modes (map_pmode), the part types (map_part), and the quantized coefficients (blk_coef).
+//               processCURecurs only estimates the bits of its trials, so the CTU is really coded only once here, after the whole CTU is decided.
+//               The bins and their contexts are exactly the same as those of the best trials in processCURecurs, so the context set will end in the same state.
+
+
+
+// instantiate processCURecurs for a CU size, with the scratch buffers of its size. Each level of the recursion has its own instance, so its stack frame only holds the buffers of its size
+#define DEFINE_PROCESS_CU(SZ)                                                                                                                                           \
+void processCURecurs##SZ (const QPConsts *qc, const ContextSet *pCtxs_init, const I32 speed, CABACcoder *pCABAC, ContextSet *pCtxs, const PIX *ctu_orig, PIX *ctu_rcon, I16 *blk_coef, UI8 *map_cu_sz, UI8 *map_pmode, UI8 *map_part, \
+                          const I32 y, const I32 x, const BOOL bll_exist, const BOOL blb_exist, const BOOL baa_exist, const BOOL bar_exist, const BOOL bla_exist) {                  \
+    PIX blk_tmp1 [SZ*SZ], best_rcon [SZ*SZ];                                                                                                                            \
+    I16 blk_tmp2 [SZ*SZ], blk_quat [SZ*SZ], blk_quat4 [SZ*SZ], best_quat [SZ*SZ];                                                                                       \
+    processCURecurs(qc, pCtxs_init, speed, pCABAC, pCtxs, ctu_orig, ctu_rcon, blk_coef, map_cu_sz, map_pmode, map_part, SZ, y, x, bll_exist, blb_exist, baa_exist, bar_exist, bla_exist, \
+                    blk_tmp1, blk_tmp2, blk_quat, blk_quat4, best_rcon, best_quat);                                                                                     \
+}
+
+DEFINE_PROCESS_CU(8)
+DEFINE_PROCESS_CU(16)
+DEFINE_PROCESS_CU(32)
+
+#define SIZED_KERNELS_OF(SZ, process_cu)    { predict##SZ, transform##SZ, quantize##SZ, deQuantize##SZ, blkNotAllZero##SZ, putCoef##SZ, process_cu }
+
+//                                  block size        4x4                        8x8                                      16x16                                              32x32
+const SizedKernels SIZED_KERNELS [5] = { SIZED_KERNELS_OF(4, NULL), SIZED_KERNELS_OF(8, processCURecurs8), SIZED_KERNELS_OF(16, processCURecurs16), {NULL}, SIZED_KERNELS_OF(32, processCURecurs32) };
+
+
+
+void putCURecurs (
+    CABACcoder *pCABAC,
+    ContextSet *pCtxs,
+    const I16  *blk_coef,                                       // pointing to the quantized coefficients of this CU (sz*sz contiguous items)
+    const UI8  *map_cu_sz,                                      // the CU-size     context of the CTU, with the above line and the left column (see MAP_STRIDE)
+    const UI8  *map_pmode,                                      // the predict mode context of the CTU, with the above line and the left column (see MAP_STRIDE)
+    const UI8  *map_part,                                       // the part types of the CTU (row stride = nTUinCTU)
+    const I32   sz,                                             // CU size
+    const I32   y,                                              // vertical   position of this CU in the CTU
+    const I32   x,                                              // horizontal position of this CU in the CTU
+    I32        *qp_delta                                        // the pending cu_qp_delta of the CTU, NULL if cu_qp_delta is not enabled (see putCuQpDelta)
+) {
+    const I32  nTU = GETnTU(sz);
+    const I32  ty  = GETnTU(y);                                 // position of this CU in the CTU, in minimal TUs
+    const I32  tx  = GETnTU(x);
+    
+    const BOOL larger_than_left_cu  = sz > map_cu_sz[(ty+1)*MAP_STRIDE + tx  ];    // current CU is larger than the left CU
+    const BOOL larger_than_above_cu = sz > map_cu_sz[ ty   *MAP_STRIDE + tx+1];    // current CU is larger than the above CU
+    
+    const I32  pmode_left  = map_pmode[(ty+1)*MAP_STRIDE + tx  ];                  // left pmode context of this CU
+    const I32  pmode_above = map_pmode[ ty   *MAP_STRIDE + tx+1];                  // above pmode context of this CU
+    const I32  pmode       = map_pmode[(ty+1)*MAP_STRIDE + tx+1];                  // the pmode of this CU (of its left-top PU for partNxN)
+    const I32  part        = map_part [ ty   *nTUinCTU   + tx  ];
+    
+    I32 isub;
+    
+    if (map_cu_sz[(ty+1)*MAP_STRIDE + tx+1] < sz) {                                                                     // split to 4 CUs
+        const I16 *sub_blk_coef [4] = { blk_coef , blk_coef+sz*sz/4 , blk_coef+sz*sz/4*2 , blk_coef+sz*sz/4*3 };
+        const I32  sub_y        [4] = { y        , y                , y+sz/2             , y+sz/2             };
+        const I32  sub_x        [4] = { x        , x+sz/2           , x                  , x+sz/2             };
+        
+        putSplitCUflag(pCABAC, pCtxs, sz, 1, larger_than_left_cu, larger_than_above_cu);                                // split_cu_flag=1 (split to 4 CUs)
+        for (isub=0; isub<4; isub++)
+            putCURecurs(pCABAC, pCtxs, sub_blk_coef[isub], map_cu_sz, map_pmode, map_part, sz/2, sub_y[isub], sub_x[isub], qp_delta);
+        
+    } else {
+        putSplitCUflag(pCABAC, pCtxs, sz, 0, larger_than_left_cu, larger_than_above_cu);                                // split_cu_flag=0 (do not split to 4 CUs)
+        
+        if (part == PART_NxN) {
+            const I32 sub_pmodes       [4] = { pmode       , map_pmode[(ty+1)*MAP_STRIDE + tx+1+nTU/2] , map_pmode[(ty+1+nTU/2)*MAP_STRIDE + tx+1] , map_pmode[(ty+1+nTU/2)*MAP_STRIDE + tx+1+nTU/2] };
+            const I32 sub_pmodes_left  [4] = { pmode_left  , sub_pmodes[0]                             , map_pmode[(ty+1+nTU/2)*MAP_STRIDE + tx  ] , sub_pmodes[2]                                  };
+            const I32 sub_pmodes_above [4] = { pmode_above , map_pmode[ ty   *MAP_STRIDE + tx+1+nTU/2] , sub_pmodes[0]                             , sub_pmodes[1]                                  };
+            putCU_PartNxN(pCABAC, pCtxs, sz, sub_pmodes, sub_pmodes_left, sub_pmodes_above, blk_coef, qp_delta);
+        } else if (part == PART_2Nx2N_TUsplit) {
+            putCU_Part2Nx2N_TUsplit(pCABAC, pCtxs, sz, pmode, pmode_left, pmode_above, blk_coef, qp_delta);
+        } else {
+            putCU_Part2Nx2N_noTUsplit(pCABAC, pCtxs, sz, pmode, pmode_left, pmode_above, blk_coef, qp_delta);
+        }
+    }
+}
+
+
+
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// adaptive quantization : a cheap analysis pass before encoding, which gives each CTU a QP offset according to its spatial activity.
+// The textured CTUs hide the quantization error, so they get larger QPs, and the flat CTUs (where the artifacts are visible) get smaller QPs
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#define AQ_MAX_STRENGTH   32                                    // aq_strength is in 1/8 units, so the max strength is 4.0
+#define AQ_MAX_OFFSET     12                                    // the QP offsets are clipped to +-12, so that the cu_qp_delta between any two CTUs (<= 24) is always in the legal range
+
+#define QP_MAP_LEN(nctus) (((nctus) + 63) / 64 * 64)            // the QP offsets of the CTUs in the work buffer, padded to 64 bytes so that the buffers after them stay aligned
+
+
+// description : approximate 4*log2(1+v) with integers : the integer part by the leading bit, and the fraction by the next 2 bits
+I32 calcLog2x4 (I32 v) {
+    I32 k;
+    v ++;
+    for (k=0; (v>>k) >= 2; k++);                                                      // k = floor(log2(v))
+    return 4*k + ((k >= 2) ? ((v >> (k-2)) & 3) : ((v << (2-k)) & 3));
+}
+
+
+// description : the activities of the CTUs in a CTU row. img points to the top-left pixel of the CTU row, and ysz is the number of image rows from it (at least 1).
+//               the activity of a CTU is 4*log2(1+v), where v is the average variance of its 8x8 blocks. The pixels out of the image are replicated from the edges, as encodeCTU does
+void analyzeCTURow (const PIX *img, const I32 img_stride, const I32 ysz, const I32 xsz, I8 *acts) {
+    PIX ctu [CTU_SZ*CTU_SZ];
+    I32 x, i, j, var;
+    for (x=0; x<xsz; x+=CTU_SZ) {
+        for (i=0; i<CTU_SZ; i++)
+            for (j=0; j<CTU_SZ; j++)
+                ctu[i*CTU_SZ+j] = GET2D(img, img_stride, ysz, xsz, i, x+j);
+        var = 0;
+        for (i=0; i<CTU_SZ; i+=8)
+            for (j=0; j<CTU_SZ; j+=8)
+                var += calcBlkVariance(8, &ctu[i*CTU_SZ+j], CTU_SZ);
+        *(acts++) = (I8)calcLog2x4(var / ((CTU_SZ/8)*(CTU_SZ/8)));
+    }
+}
+
+
+// description : turn the activities of n CTUs into their QP offsets (in place) : offset = strength * (activity - average activity), where aq_strength is in 1/8 units.
+//               a negative aq_strength reverses the direction, so that the textured CTUs get the smaller QPs
+void calcQPOffsets (I8 *map, const I32 n, I32 aq_strength) {
+    I64 sum = 0;
+    I32 i, mean, d;
+    aq_strength = CLIP(aq_strength, -AQ_MAX_STRENGTH, AQ_MAX_STRENGTH);
+    for (i=0; i<n; i++)
+        sum += map[i];
+    mean = (I32)((sum + n/2) / n);
+    for (i=0; i<n; i++) {
+        d = aq_strength * (map[i] - mean);                                                // in 1/32 QP, since the activity is in 1/4 and the strength is in 1/8
+        map[i] = (I8)CLIP((d >= 0 ? d+16 : d-16) / 32, -AQ_MAX_OFFSET, AQ_MAX_OFFSET);    // round to the nearest QP
+    }
+}
+
+
+typedef struct {                      // the analysis of an image, a job for each CTU row
+    const PIX  *img;
+    I32         img_stride, ysz, xsz;
+    I8         *map;
+} AnalysisJobs;
+
+
+void analyzeJob (void *job_arg, I32 job_idx) {
+    const AnalysisJobs *pa = (const AnalysisJobs *)job_arg;
+    const I32 ncols = (pa->xsz + CTU_SZ - 1) / CTU_SZ;
+    analyzeCTURow(pa->img + (I64)job_idx*CTU_SZ*pa->img_stride, pa->img_stride, pa->ysz-job_idx*CTU_SZ, pa->xsz, pa->map + (I64)job_idx*ncols);
+}
+
+
+I32 HEVCeAnalyze (const PIX *img, I32 img_stride, I32 ysz, I32 xsz, I32 aq_strength, I8 *qp_offsets) {
+    const I32 nrows = (ysz + CTU_SZ - 1) / CTU_SZ;
+    const I32 ncols = (xsz + CTU_SZ - 1) / CTU_SZ;
+    AnalysisJobs a;
+    I32 row;
+    
+    if (ysz < 1 || xsz < 1 || (I64)nrows*ncols > I32_MAX_VALUE)
+        return -1;
+    
+    a.img        = img;
+    a.img_stride = img_stride;
+    a.ysz        = ysz;
+    a.xsz        = xsz;
+    a.map        = qp_offsets;
+    for (row=0; row<nrows; row++)                                                                                      // sequentially in the calling thread, which is usually not the encoding thread
+        analyzeJob(&a, row);
+    calcQPOffsets(qp_offsets, nrows*ncols, aq_strength);
+    return nrows * ncols;
+}
+
+
+
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// top function of HEVC intra-frame image encoder
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// run jobs using the parallel_for provided by user, or run them sequentially if the user does not provide it
+void runJobs (const HEVCeConfig *cfg, HEVCeJobFunc func, void *job_arg, I32 njobs) {
+    I32 i;
+    if (cfg->parallel_for != NULL)
+        cfg->parallel_for(cfg->pool, func, job_arg, njobs);
+    else
+        for (i=0; i<njobs; i++)
+            func(job_arg, i);
+}
+
+
+
+#define MAX_SLICES   600              // the max number of slices in a picture allowed by level 6.x
+
+// get the actual tile grid from the config. Main profile requires that each tile column is at least 256 pixels wide and each tile row is at least 64 pixels high.
+void getTileGrid (const HEVCeConfig *cfg, const I32 nrows, const I32 ncols, I32 *tile_rows, I32 *tile_cols) {
+    *tile_rows = MAX(1, MIN(MIN(cfg->tile_rows, MAX_TILE_ROWS), nrows/( 64/CTU_SZ)));
+    *tile_cols = MAX(1, MIN(MIN(cfg->tile_cols, MAX_TILE_COLS), ncols/(256/CTU_SZ)));
+}
+
+
+// get the actual number of slices (split by CTU count) from the config
+I32 getSliceCount (const HEVCeConfig *cfg, const I32 nctus) {
+    return CLIP(cfg->slices, 1, MIN(nctus, MAX_SLICES));
+}
+
+
+
+typedef struct {                      // the line-buffers of a substream : what the next CTUs refer to in the CTU row above and in the left CTU
+    UI8        *cu_sz_above;          // the CU-sizes of the bottom minimal-TU line of the CTU row above, indexed by GETnTU(x)
+    PIX        *rcon_above;           // (only when img_rcon=NULL) the bottom pixel row of the CTU row above, indexed by x
+    UI8         cu_sz_left [nTUinCTU];// the CU-sizes of the right minimal-TU column of the left CTU
+    UI8         pmode_left [nTUinCTU];// the predict modes of the right minimal-TU column of the left CTU
+    PIX         rcon_left  [CTU_SZ];  // (only when img_rcon=NULL) the right pixel column of the left CTU
+    PIX         rcon_above_left;      // (only when img_rcon=NULL) the above-left pixel of the next CTU, saved before the bottom row of the current CTU overwrites it in rcon_above
+} LineBuffers;
+
+#define LINE_BUFFERS_LEN(xszn)  ((xszn)*(I32)sizeof(PIX) + GETnTU(xszn))   // the length (in bytes) of the above lines of LineBuffers (rcon_above and cu_sz_above), which are sized at runtime with the padded image width
+
+
+// let the above lines of a LineBuffers point to pline, which has LINE_BUFFERS_LEN(xszn) bytes. The substreams which never write the same columns at the same time can share them
+void setLineBuffers (LineBuffers *plb, UI8 *pline, const I32 xszn) {
+    plb->rcon_above  = (PIX *)pline;
+    plb->cu_sz_above = pline + xszn*(I32)sizeof(PIX);
+}
+
+
+typedef struct {                      // the constants of all the QPs, prepared once when the encoder context is created, and shared by all the images encoded with the context
+    QPConsts    consts [QP_COUNT];
+    ContextSet  ctxs   [QP_COUNT];    // the initial context set of each QP, copied at the start of each slice, tile and WPP row, and in the trials of PartNxN (see processCURecurs)
+} QPCache;
+
+
+void initQPCache (QPCache *qpc) {
+    I32 qp;
+    for (qp=0; qp<QP_COUNT; qp++) {
+        QPConsts *qc = &qpc->consts[qp];
+        qc->weight_dist     = RDCOST_WEIGHT_DIST[qp];
+        qc->weight_bits     = RDCOST_WEIGHT_BITS[qp];
+        qc->sqrt_lambda_x16 = SQRT_LAMBDA_X16[qp];
+        qc->qstep_sq_x16    = QSTEP_SQ_X16[qp];
+        qc->qscale          = QUANT_SCALE[qp%6];
+        qc->lscale          = LEVEL_SCALE[qp%6];
+        qc->dqscale         = LEVEL_SCALE[qp%6] << (qp/6);
+        qc->qp_per          = qp/6;
+        qpc->ctxs[qp]       = newContextSet(qp);
+    }
+}
+
+
+typedef struct {                      // a substream : a CTU row (WPP), a tile, or a slice. Each substream has its own CABAC coder and context set
+    CABACcoder  cabac;
+    UI8         cabac_buf [TMPBUF_LEN]; // (WPP only) the buffer of the CABAC coder
+    ContextSet  ctxs;
+    ContextSet  ctxs_sync;            // (WPP only) backup the context set after the 2nd CTU of this row is encoded, for initializing the next row
+    I32         qp_prev;              // (WPP only) the QP of the previous CTU in this row (see encodeCTU)
+    LineBuffers lines;
+    UI8        *stream;               // the compressed bytes of this substream
+    I32         stream_len;
+} Substream;
+
+
+typedef struct {                      // the state of a picture which is shared by the jobs of encoding it
+    I32         qp;                   // 0 ~ QP_COUNT-1, the slice QP
+    const QPCache *qpc;               // the constants of the QPs, in the encoder context
+    const I8   *qp_map;               // the QP offset of each CTU (adaptive quantization), or NULL if cu_qp_delta is not enabled. In streaming mode, it only holds the current CTU row
+    I32         max_len;              // >0 : (rate control) a trial encoding, which is aborted as soon as the stream is known to be longer than max_len bytes
+    I32         speed;                // speed preset, 0 ~ SPEED_COUNT-1
+    const PIX  *img;
+          PIX  *img_rcon;             // can be NULL, then each substream keeps the reconstructed pixels in its LineBuffers
+    I32         img_stride, rcon_stride;  // row strides (in pixels) of img and img_rcon
+    I32         img_y0;               // the image row that img points to. It is 0, except in streaming mode, where img only holds the current CTU row
+    I32         ysz, xsz;             // original image size
+    I32         yszn, xszn;           // padded image size
+    I32         tile_rows, tile_cols; // tile grid, 1x1 means tiles are not enabled
+    I32         n_slices;             // number of slices split by CTU count
+    I32         step;                 // current wavefront step
+    Substream  *substreams;
+} PictureJobs;
+
+
+
+// description : encode a CTU : sample it from the original image, process it, and write the reconstructed CTU back to the reconstructed image
+//               the caller tells which neighbouring CTUs are available (inside the same slice and tile). The pixels of unavailable CTUs are never touched, since they may be being written by other jobs
+//               With adaptive quantization, the CTU is a quantization group : its QP is predicted by the QP of the previous CTU (*qp_prev), which the caller resets to the slice QP
+//               at the start of each slice, tile and WPP row. The delta is coded in the first TU with a non-zero cbf, and a CTU without one keeps the predicted QP
+void encodeCTU (
+    const PictureJobs *pic,
+    CABACcoder *pCABAC,
+    ContextSet *pCtxs,
+    I32        *qp_prev,                                        // the QP of the previous CTU in this substream, updated to the QP of this CTU
+    LineBuffers *plb,                                           // the line-buffers of this substream
+    const I32   y,                                              // vertical   position of the CTU's top-left pixel
+    const I32   x,                                              // horizontal position of the CTU's top-left pixel
+    const BOOL  bll_exist,                                      // whether the left        CTU is available
+    const BOOL  baa_exist,                                      // whether the above       CTU is available
+    const BOOL  bar_exist,                                      // whether the above-right CTU is available
+    const BOOL  bla_exist                                       // whether the left-above  CTU is available
+) {
+    const BOOL blb_exist = 0;
+    
+    PIX   ctu_orig   [CTU_SZ * CTU_SZ];                                                                                // the original pixels of the CTU (row stride = CTU_SZ)
+    PIX   ctu_rcon   [(1+CTU_SZ) * RCON_STRIDE];                                                                       // the reconstructed pixels of the CTU, with the above line (including the above-right CTU) and the left column. Pixel (y,x) is at [(y+1)*RCON_STRIDE + (x+1)]
+    I16   ctu_coef   [CTU_SZ * CTU_SZ];                                                                                // the quantized coefficients of the CTU, decided by processCURecurs. Each CU and TU is contiguous, in z-order
+    UI8   map_part   [nTUinCTU * nTUinCTU];                                                                            // the part types of the CUs in the CTU, decided by processCURecurs (row stride = nTUinCTU)
+    UI8   map_cu_sz  [(1+nTUinCTU) * MAP_STRIDE];                                                                      // the CU-size     context of the CTU, with the above line and the left column. Minimal TU (ty,tx) is at [(ty+1)*MAP_STRIDE + (tx+1)]
+    UI8   map_pmode  [(1+nTUinCTU) * MAP_STRIDE];                                                                      // the predict mode context of the CTU, with the above line and the left column
+    
+    CABACcoder eCABAC = newCABACestimator();                                                                           // processCURecurs only needs to estimate the bits
+    ContextSet eCtxs  = *pCtxs;
+    
+    const I32  rstride = pic->rcon_stride;
+    const I32  istride = pic->img_stride;
+          PIX *prcon   = pic->img_rcon ? pic->img_rcon + (I64)y*rstride + x : NULL;                                    // the CTU in the reconstructed image. It has the padded size, so the available neighbors never need clipping
+    const PIX *porig   = pic->img + (I64)(y-pic->img_y0)*istride + x;                                                  // the CTU in the original image
+    const I32  xTU     = GETnTU(x);
+    const I32  qp_ofs  = pic->qp_map ? CLIP(pic->qp_map[((y-pic->img_y0)/CTU_SZ)*(pic->xszn/CTU_SZ) + x/CTU_SZ], -AQ_MAX_OFFSET, AQ_MAX_OFFSET) : 0; // the offsets given by HEVCeSetQPOffsets are not checked, so clip them here to keep cu_qp_delta legal
+    const I32  qp      = CLIP(pic->qp + qp_ofs, 0, QP_COUNT-1);
+    const QPConsts *qc = &pic->qpc->consts[qp];
+    
+    I32 qp_delta = qp - *qp_prev;
+    I32 i, j;
+    
+    map_cu_sz[0] = CTU_SZ;                                                                                             // the above-left corner
+    map_pmode[0] = PMODE_DC;
+    for (i=0; i<nTUinCTU; i++) {
+        map_cu_sz[1+i] = baa_exist ? plb->cu_sz_above[xTU+i] : CTU_SZ;                                                 // the CU-size context from the bottom line of the above CTU, or CTU_SZ if it is not available
+        map_pmode[1+i] = PMODE_DC;                                                                                     // the pmode context from the above CTU is always PMODE_DC, since it is in another CTU
+        map_cu_sz[(i+1)*MAP_STRIDE] = bll_exist ? plb->cu_sz_left[i] : CTU_SZ;                                         // the contexts from the right column of the left CTU
+        map_pmode[(i+1)*MAP_STRIDE] = bll_exist ? plb->pmode_left[i] : PMODE_DC;
+    }
+    
+    if (prcon) {
+        if (bll_exist)
             for (i=0; i<CTU_SZ; i++)
-                ctu_rcon[i][-1] = GET2D(img_rcon, yszn, xszn, y+i, x-1);                                               // sample CTU border from reconstructed image
-            
-            for (j=-1; j<CTU_SZ*2; j++)
-                ctu_rcon[-1][j] = GET2D(img_rcon, yszn, xszn, y-1, x+j);                                               // sample CTU border from reconstructed image
-
+                ctu_rcon[(i+1)*RCON_STRIDE] = prcon[i*rstride-1];                                                      // sample CTU border from reconstructed image
+        
+        if (bla_exist)
+            ctu_rcon[0] = prcon[-rstride-1];                                                                           // sample CTU border from reconstructed image
+        
+        if (baa_exist)
+            for (j=0; j<CTU_SZ; j++)
+                ctu_rcon[1+j] = prcon[-rstride+j];                                                                     // sample CTU border from reconstructed image
+        
+        if (bar_exist)
+            for (j=CTU_SZ; j<CTU_SZ*2; j++)
+                ctu_rcon[1+j] = prcon[-rstride+j];                                                                     // sample CTU border from reconstructed image
+    } else {
+        if (bll_exist)
             for (i=0; i<CTU_SZ; i++)
-                for (j=0; j<CTU_SZ; j++)
-                    ctu_orig[i][j] = GET2D(img, *ysz, *xsz, y+i, x+j);                                                 // sample CTU from the original image
-            
-            processCURecurs(qpd6, &tCABAC, &tCtxs, ctu_orig, ctu_rcon, map_cu_sz, map_pmode, CTU_SZ, bll_exist, blb_exist, baa_exist, bar_exist);       // encode a CTU
+                ctu_rcon[(i+1)*RCON_STRIDE] = plb->rcon_left[i];                                                       // sample CTU border from the line buffers
+        
+        if (bla_exist)
+            ctu_rcon[0] = plb->rcon_above_left;
+        
+        if (baa_exist)
+            for (j=0; j<CTU_SZ; j++)
+                ctu_rcon[1+j] = plb->rcon_above[x+j];
+        
+        if (bar_exist)
+            for (j=CTU_SZ; j<CTU_SZ*2; j++)
+                ctu_rcon[1+j] = plb->rcon_above[x+j];
+    }
+    
+    if (y+CTU_SZ <= pic->ysz && x+CTU_SZ <= pic->xsz) {                                                                // the CTU is inside the original image
+        for (i=0; i<CTU_SZ; i++, porig+=istride)
+            for (j=0; j<CTU_SZ; j++)
+                ctu_orig[i*CTU_SZ+j] = porig[j];                                                                       // copy the CTU row by row
+    } else {                                                                                                           // a partial CTU at the right or bottom edge
+        for (i=0; i<CTU_SZ; i++)
+            for (j=0; j<CTU_SZ; j++)
+                ctu_orig[i*CTU_SZ+j] = GET2D(pic->img, istride, pic->ysz-pic->img_y0, pic->xsz, y+i-pic->img_y0, x+j); // replicate the edge pixels of the original image into the padded part
+    }
+    
+    SIZED(CTU_SZ)->processCU(qc, &pic->qpc->ctxs[qp], pic->speed, &eCABAC, &eCtxs, ctu_orig, ctu_rcon, ctu_coef, map_cu_sz, map_pmode, map_part, 0, 0, bll_exist, blb_exist, baa_exist, bar_exist, bla_exist); // decide the CTU
+    
+    putCURecurs(pCABAC, pCtxs, ctu_coef, map_cu_sz, map_pmode, map_part, CTU_SZ, 0, 0, (pic->qp_map ? &qp_delta : NULL)); // encode the CTU
+    
+    if (qp_delta == QP_DELTA_CODED)                                                                                    // otherwise the CTU has no non-zero coefficient, and its QP is still the predicted one
+        *qp_prev = qp;
+
+    if (prcon) {
+        for (i=0; i<CTU_SZ; i++, prcon+=rstride)
+            for (j=0; j<CTU_SZ; j++)
+                prcon[j] = ctu_rcon[(i+1)*RCON_STRIDE + (j+1)];                                                        // write reconstructed CTU back to reconstructed image, row by row
+    } else {
+        plb->rcon_above_left = plb->rcon_above[x+CTU_SZ-1];                                                            // the above-left pixel of the right CTU
+        for (j=0; j<CTU_SZ; j++)
+            plb->rcon_above[x+j] = ctu_rcon[CTU_SZ*RCON_STRIDE + (j+1)];                                               // the bottom row of this CTU, for the CTU row below
+        for (i=0; i<CTU_SZ; i++)
+            plb->rcon_left[i] = ctu_rcon[(i+1)*RCON_STRIDE + CTU_SZ];                                                  // the right column of this CTU, for the right CTU
+    }
+    
+    for (i=0; i<nTUinCTU; i++) {
+        plb->cu_sz_above[xTU+i] = map_cu_sz[nTUinCTU*MAP_STRIDE + (i+1)];                                              // the bottom line of this CTU, for the CTU row below
+        plb->cu_sz_left[i]      = map_cu_sz[(i+1)*MAP_STRIDE + nTUinCTU];                                              // the right column of this CTU, for the right CTU
+        plb->pmode_left[i]      = map_pmode[(i+1)*MAP_STRIDE + nTUinCTU];
+    }
+}
+
+
+
+// description : a job of WPP (wavefront parallel processing). In wavefront step t, the CTUs at (row, col) that satisfy col+2*row=t are encoded in parallel.
+//               Since their left, above and above-right CTUs have been encoded in the previous steps, all the dependencies (reconstructed pixels, contexts of CU-size, and the context set synchronized from the above row) are ready.
+void encodeWPPjob (void *job_arg, I32 job_idx) {
+    PictureJobs *pic = (PictureJobs *)job_arg;
+    
+    const I32 nrows = pic->yszn / CTU_SZ;
+    const I32 ncols = pic->xszn / CTU_SZ;
+    const I32 row   = MAX(0, (pic->step - ncols + 2) / 2) + job_idx;
+    const I32 col   = pic->step - 2*row;
+    
+    Substream *prow = &pic->substreams[row];
+    UI8       *pbuf;
+    
+    if (col == 0) {                                                                                                    // start a new substream
+        prow->cabac      = newCABACcoder(prow->cabac_buf);
+        prow->ctxs       = (row > 0 && ncols > 1) ? pic->substreams[row-1].ctxs_sync : pic->qpc->ctxs[pic->qp];      // synchronize the context set from the above row
+        prow->stream_len = 0;
+        prow->qp_prev    = pic->qp;
+    }
+    
+    encodeCTU(pic, &prow->cabac, &prow->ctxs, &prow->qp_prev, &prow->lines, row*CTU_SZ, col*CTU_SZ, (col>0), (row>0), (row>0 && col<ncols-1), (row>0 && col>0));
+    
+    if (col == 1)
+        prow->ctxs_sync = prow->ctxs;
+    
+    CABACputTerminate(&prow->cabac, (row == nrows-1 && col == ncols-1) );                                              // end_of_slice_segment_flag
+    
+    if (col == ncols-1) {                                                                                              // end of the substream
+        if (row < nrows-1)
+            CABACputTerminate(&prow->cabac, 1);                                                                        // end_of_subset_one_bit
+        CABACfinish(&prow->cabac);
+    }
+    
+    pbuf = prow->stream + prow->stream_len;
+    CABACsubmitToBuffer(&prow->cabac, &pbuf);
+    prow->stream_len = pbuf - prow->stream;
+}
 
-            for (i=0; i<CTU_SZ; i++)
-                for (j=0; j<CTU_SZ; j++)
-                    GET2D(img_rcon, yszn, xszn, y+i, x+j) = ctu_rcon[i][j];                                            // write reconstructed CTU back to reconstructed image
 
-            CABACputTerminate(&tCABAC, (y+32>=yszn && x+32>=xszn) );                                                   // encode a terminate bit
+
+// description : encode all the CTUs in a tile in raster order, as a substream.
+//               A tile has its own CABAC coder, context set and context line-buffers, and never refers to the other tiles, so that tiles can be encoded in parallel.
+// return      : the length of the substream (in bytes), or -1 if it is aborted since it is longer than pic->max_len
+I32 encodeTile (const PictureJobs *pic, const I32 tile_idx, LineBuffers *plb, UI8 *pbuf) {
+    const I32 nrows    = pic->yszn / CTU_SZ;
+    const I32 ncols    = pic->xszn / CTU_SZ;
+    const I32 tile_row = tile_idx / pic->tile_cols;
+    const I32 tile_col = tile_idx % pic->tile_cols;
+    const I32 y0 = CTU_SZ * ( tile_row    * nrows / pic->tile_rows);                                                  // the boundaries of this tile, with uniform spacing
+    const I32 y1 = CTU_SZ * ((tile_row+1) * nrows / pic->tile_rows);
+    const I32 x0 = CTU_SZ * ( tile_col    * ncols / pic->tile_cols);
+    const I32 x1 = CTU_SZ * ((tile_col+1) * ncols / pic->tile_cols);
+    const BOOL last_tile = (tile_idx == pic->tile_rows*pic->tile_cols-1);
+    
+    UI8        cabac_buf [TMPBUF_LEN];
+    CABACcoder tCABAC = newCABACcoder(cabac_buf);
+    ContextSet tCtxs  = pic->qpc->ctxs[pic->qp];
+    I32        qp_prev = pic->qp;
+    
+    UI8 *pbuf_start = pbuf;
+    I32 y, x;
+    
+    for (y=y0; y<y1; y+=CTU_SZ) {                                                                                      // for all CTU rows in this tile
+        for (x=x0; x<x1; x+=CTU_SZ) {                                                                                  // for all CTU columns in this tile
+            encodeCTU(pic, &tCABAC, &tCtxs, &qp_prev, plb, y, x, (x>x0), (y>y0), (y>y0 && x+CTU_SZ<x1), (y>y0 && x>x0));   // encode a CTU
+            
+            if (y+CTU_SZ>=y1 && x+CTU_SZ>=x1) {                                                                        // the last CTU of this tile
+                CABACputTerminate(&tCABAC, last_tile);                                                                 // end_of_slice_segment_flag
+                if (!last_tile)
+                    CABACputTerminate(&tCABAC, 1);                                                                     // end_of_subset_one_bit
+                CABACfinish(&tCABAC);
+            } else {
+                CABACputTerminate(&tCABAC, 0);                                                                         // end_of_slice_segment_flag
+            }
+            
             CABACsubmitToBuffer(&tCABAC, &pbuf);                                                                       // submit the commpressed bytes from CABAC coder's buffer to output buffer
+            
+            if (pic->max_len > 0 && pbuf-pbuf_start > pic->max_len)                                                    // this substream alone is too long
+                return -1;
         }
+    }
+    
+    return pbuf - pbuf_start;
+}
+
 
-        for (j=1; j<=nTUinROW; j++) {
-            map_cu_sz_0[0][j] = map_cu_sz_0[nTUinCTU][j];                                                              // scroll line-buffer: put the context in current CTU rows to the previous CTU rows. 
-            // map_pmode_0[0][j] = map_pmode_0[nTUinCTU][j];                                                           // Note that map_pmode do not need to be scrolled, since we never use the pmode in the previous line as context.
+
+// description : a job of tile-based parallel encoding, which encodes a tile to its own substream
+void encodeTileJob (void *job_arg, I32 job_idx) {
+    PictureJobs *pic = (PictureJobs *)job_arg;
+    Substream   *ps  = &pic->substreams[job_idx];
+    ps->stream_len = encodeTile(pic, job_idx, &ps->lines, ps->stream);
+}
+
+
+
+// description : encode a slice NAL unit (slice header + slice data), the slice starts from the CTU at slice_addr (in raster scan order) and contains at most max_ctus CTUs.
+//               When max_bytes > 0, the slice is ended before the CTU which makes the NAL unit longer than max_bytes, and that CTU will be re-encoded as the first CTU of the next slice (a slice contains at least one CTU, even if it is too long).
+//               A slice has its own CABAC coder, context set and context line-buffers, and never refers to the other slices, so that slices can be encoded in parallel.
+//               When abort_len > 0, the encoding is aborted as soon as the NAL unit is longer than abort_len (rate control).
+// return      : the length of the slice NAL unit (in bytes), or -1 if it is aborted. The number of CTUs in this slice is saved to *n_ctus
+I32 encodeSlice (const PictureJobs *pic, LineBuffers *plb, const I32 slice_addr, const I32 max_ctus, const I32 max_bytes, const I32 abort_len, UI8 *pbuf, I32 *n_ctus) {
+    const I32 ncols    = pic->xszn / CTU_SZ;
+    const I32 nctus    = ncols * (pic->yszn / CTU_SZ);
+    const I32 end_addr = MIN(nctus, slice_addr+max_ctus);
+    
+    UI8        cabac_buf [TMPBUF_LEN];
+    UI8        bcabac_buf[TMPBUF_LEN];
+    CABACcoder tCABAC = newCABACcoder(cabac_buf);
+    CABACcoder bCABAC = newCABACcoder(bcabac_buf);                                                                     // backup the CABAC coder before the end_of_slice_segment_flag of the previous CTU, for ending the slice there
+    ContextSet tCtxs  = pic->qpc->ctxs[pic->qp];
+    I32        qp_prev = pic->qp;
+    
+    UI8 rbsp [SLICE_HEADER_RBSP_LEN(0)];
+    
+    UI8 *pbuf_start = pbuf;
+    UI8 *pbuf_bak   = pbuf;
+    I32 addr;
+    
+    putSliceHeaderToBuffer(&pbuf, rbsp, pic->qp, slice_addr, nctus, 0, 1, NULL);
+    
+    for (addr=slice_addr; addr<end_addr; addr++) {                                                                     // for all CTUs in this slice
+        const I32  y = CTU_SZ * (addr / ncols);
+        const I32  x = CTU_SZ * (addr % ncols);
+        const BOOL bll_exist = x > 0  &&  addr-1       >= slice_addr;
+        const BOOL baa_exist = y > 0  &&  addr-ncols   >= slice_addr;
+        const BOOL bar_exist = y > 0  &&  x+CTU_SZ < pic->xszn  &&  addr-ncols+1 >= slice_addr;                        // the above-right CTU may be in this slice even if the above CTU is not
+        const BOOL bla_exist = bll_exist  &&  y > 0  &&  addr-ncols-1 >= slice_addr;
+        
+        encodeCTU(pic, &tCABAC, &tCtxs, &qp_prev, plb, y, x, bll_exist, baa_exist, bar_exist, bla_exist);       // encode a CTU
+        
+        if (max_bytes > 0 && addr > slice_addr) {
+            CABACcoder fCABAC = tCABAC;                                                                                // try to end the slice at this CTU, to get the NAL unit length. It shares the buffer of tCABAC, but only writes after the bytes of tCABAC
+            CABACputTerminate(&fCABAC, 1);
+            CABACfinish(&fCABAC);
+            if ( (pbuf-pbuf_start) + CABACsubmitToBuffer(&fCABAC, NULL) > max_bytes ) {                                // too long : discard this CTU, and end the slice at the previous CTU
+                CABACcopy(&tCABAC, &bCABAC);
+                pbuf   = pbuf_bak;
+                break;
+            }
+        }
+        
+        if (addr+1 < end_addr) {
+            if (max_bytes > 0) {
+                CABACcopy(&bCABAC, &tCABAC);
+                pbuf_bak = pbuf;
+            }
+            CABACputTerminate(&tCABAC, 0);                                                                             // end_of_slice_segment_flag
+            CABACsubmitToBuffer(&tCABAC, &pbuf);                                                                       // submit the commpressed bytes from CABAC coder's buffer to output buffer
+            if (abort_len > 0 && pbuf-pbuf_start > abort_len)
+                return -1;
         }
     }
     
+    CABACputTerminate(&tCABAC, 1);                                                                                     // end_of_slice_segment_flag
     CABACfinish(&tCABAC);
     CABACsubmitToBuffer(&tCABAC, &pbuf);                                                                               // submit the commpressed bytes from CABAC coder's buffer to output buffer
+    
+    *n_ctus = addr - slice_addr;
+    
+    return pbuf - pbuf_start;
+}
+
+
+
+// description : a job of slice-based parallel encoding, which encodes a slice (split by CTU count) to its own buffer
+void encodeSliceJob (void *job_arg, I32 job_idx) {
+    PictureJobs *pic   = (PictureJobs *)job_arg;
+    Substream   *ps    = &pic->substreams[job_idx];
+    const I32    nctus = (pic->yszn / CTU_SZ) * (pic->xszn / CTU_SZ);
+    const I32    addr0 =  job_idx    * nctus / pic->n_slices;
+    const I32    addr1 = (job_idx+1) * nctus / pic->n_slices;
+    I32 n_ctus;
+    ps->stream_len = encodeSlice(pic, &ps->lines, addr0, addr1-addr0, 0, pic->max_len, ps->stream, &n_ctus);
+}
+
+
+
+#define MAX_INT_SIZE  0x7FFFFFFF                                // the buffer sizes are returned as int, so the images which need larger buffers can not be encoded as a whole (but can be streamed)
+
+
+I32 HEVCImageEncoderWorkSize (I32 ysz, I32 xsz, const HEVCeConfig *cfg) {
+    const I32 nrows = (ysz + CTU_SZ - 1) / CTU_SZ;
+    const I32 ncols = (xsz + CTU_SZ - 1) / CTU_SZ;
+    const I64 nctus = (I64)nrows * ncols;
+    const I64 line_len = LINE_BUFFERS_LEN((I64)ncols*CTU_SZ);
+    const I32 n_slices = getSliceCount(cfg, (I32)MIN(nctus, MAX_SLICES));
+    I32 tile_rows, tile_cols;
+    I64 size;
+    
+    getTileGrid(cfg, nrows, ncols, &tile_rows, &tile_cols);
+    
+    if (tile_rows*tile_cols > 1)
+        size = tile_rows*tile_cols*(I64)(sizeof(Substream)+sizeof(I32)) + SLICE_HEADER_RBSP_LEN(tile_rows*tile_cols) + tile_rows*line_len + nctus*TMPBUF_LEN;  // tiles, entry points, line-buffers of each tile row, and the substreams of the tiles
+    else if (cfg->wpp)
+        size = nrows*(I64)(sizeof(Substream)+sizeof(I32)) + SLICE_HEADER_RBSP_LEN((I64)nrows) + line_len + nctus*TMPBUF_LEN;                              // CTU rows, entry points, line-buffers shared by all rows, and the substreams of the rows
+    else if (n_slices > 1 && cfg->slice_bytes <= 0)
+        size = n_slices*( (I64)sizeof(Substream) + SLICE_HEADER_MAX_LEN + line_len ) + nctus*TMPBUF_LEN;                                                   // slices with their line-buffers, and the NAL units of the slices
+    else
+        size = line_len;                                                                                                                                    // line-buffers
+    
+    if (cfg->aq_strength != 0)
+        size += QP_MAP_LEN(nctus);                                                                                                                          // the QP offsets of the CTUs, before the buffers above
+    
+    return (ysz < 1 || xsz < 1 || size > MAX_INT_SIZE) ? -1 : (I32)size;
+}
+
+
+
+I32 HEVCeMaxStreamLength (I32 ysz, I32 xsz) {
+    const I32 nrows = (ysz + CTU_SZ - 1) / CTU_SZ;
+    const I64 nctus = (I64)nrows * ((xsz + CTU_SZ - 1) / CTU_SZ);
+    const I64 size  = 256 + nctus * (TMPBUF_LEN + SLICE_HEADER_MAX_LEN) + SLICE_HEADER_RBSP_LEN((I64)nrows + MAX_TILE_COLS*MAX_TILE_ROWS);  // VPS/SPS/PPS, TMPBUF_LEN bytes for each CTU, a slice header for each CTU at most (slice_bytes), and the entry points
+    return (ysz < 1 || xsz < 1 || size > MAX_INT_SIZE) ? -1 : (I32)size;
+}
+
+
+
+struct HEVCeContext {                 // the encoder context, placed at the beginning of the arena provided by the user
+    HEVCeConfig cfg;
+    I32         ysz_max, xsz_max;     // the max image size that can be encoded with this context
+    void       *work;                 // the work buffer for ysz_max x xsz_max, it is in the arena and reused by every HEVCeEncode, or by a stream
+    I32         qp;                   // the QP of the last encoded image (chosen by the rate control, or cfg.qp)
+    const I8   *qp_offsets;           // the QP offsets of the CTUs for the next HEVCeEncode (see HEVCeSetQPOffsets), or NULL
+    QPCache     qpc;                  // the constants of all the QPs, so that neither the rate control trials nor the images of a batch prepare them again
+    
+    PictureJobs     spic;             // (streaming only) the picture being streamed. Its img points to the current CTU row
+    HEVCeWriteFunc  write;            // (streaming only) receives the bytes of each CTU row
+    void           *write_arg;
+    I32             y;                // (streaming only) the first row of the next CTU row to encode
+    I32             nrows_buf;        // (streaming only) the number of rows collected in rows_buf
+    PIX            *rows_buf;         // (streaming only) collects the pushed rows until a CTU row is complete, CTU_SZ rows x xsz
+    UI8            *out_buf;          // (streaming only) the bytes of a CTU row
+    CABACcoder      cabac;
+    ContextSet      ctxs;
+    LineBuffers     lines;            // (streaming only) the reconstructed pixels are only kept in line-buffers when streaming
+    I8             *qp_map;           // (streaming only) the QP offsets of the current CTU row, analyzed with the average activity of the row, since the rows below are not pushed yet
+    I32             qp_prev;          // (streaming only) the QP of the previous CTU (see encodeCTU)
+};
+
+#define CONTEXT_LEN  ((I32)((sizeof(HEVCeContext) + 63) / 64 * 64))                                                    // the work buffer follows the context in the arena, aligned to 64 bytes
+
+
+void initContext (HEVCeContext *ctx, const HEVCeConfig *cfg, const I32 ysz_max, const I32 xsz_max, void *work) {
+    initKernels();                                                                                                      // select the C or SIMD kernels according to the CPU
+    ctx->cfg     = *cfg;
+    ctx->ysz_max = ysz_max;
+    ctx->xsz_max = xsz_max;
+    ctx->work    = work;
+    ctx->qp      = CLIP(cfg->qp, 0, QP_COUNT-1);
+    ctx->qp_offsets = NULL;
+    initQPCache(&ctx->qpc);
+    ctx->write   = NULL;                                                                                                // no stream is being encoded
+}
+
+
+// the size of the work buffer for streaming, which only depends on the width : the line-buffers, a CTU row of original pixels, the CABAC coder buffer, the bytes of a CTU row, and the QP offsets of a CTU row
+I32 getStreamWorkSize (I32 xsz) {
+    const I64 xszn = (I64)((xsz + CTU_SZ - 1) / CTU_SZ) * CTU_SZ;
+    const I64 size = LINE_BUFFERS_LEN(xszn) + CTU_SZ*xszn*(I32)sizeof(PIX) + TMPBUF_LEN + (xszn/CTU_SZ)*TMPBUF_LEN + QP_MAP_LEN(xszn/CTU_SZ);
+    return (xsz < 1 || size > MAX_INT_SIZE) ? -1 : (I32)size;
+}
+
+
+I32 HEVCeContextSize (I32 ysz_max, I32 xsz_max, const HEVCeConfig *cfg) {
+    const I32 work_size   = HEVCImageEncoderWorkSize(ysz_max, xsz_max, cfg);
+    const I32 stream_size = getStreamWorkSize(xsz_max);
+    if (work_size < 0 || stream_size < 0 || (I64)CONTEXT_LEN + MAX(work_size, stream_size) > MAX_INT_SIZE)
+        return -1;
+    return CONTEXT_LEN + MAX(work_size, stream_size);                                                                   // HEVCeEncode and streaming share the work buffer
+}
+
+
+HEVCeContext *HEVCeCreate (const HEVCeConfig *cfg, I32 ysz_max, I32 xsz_max, void *arena, I32 arena_size) {
+    HEVCeContext *ctx  = (HEVCeContext *)arena;
+    const I32 size = HEVCeContextSize(ysz_max, xsz_max, cfg);
+    
+    if (arena == NULL || size < 0 || arena_size < size)                                                                // the image is too large, or the arena is too small
+        return NULL;
+    
+    initContext(ctx, cfg, ysz_max, xsz_max, (UI8 *)arena + CONTEXT_LEN);
+    return ctx;
+}
+
+
+void HEVCeDestroy (HEVCeContext *ctx) {
+    if (ctx != NULL)
+        ctx->work = NULL;                                                                                               // nothing to free : the arena belongs to the user, who can free or reuse it after this
+}
+
+
 
-    *ysz = yszn;                                                                                                       // change the value of *ysz, so that the user can get the clipped image size
-    *xsz = xszn;                                                                                                       // change the value of *xsz, so that the user can get the clipped image size
+// description : encode a picture with the QP (and the QP offsets of the CTUs in qp_map, if it is not NULL). When max_len > 0 (a trial of the rate control), the encoding is aborted as soon as the stream is known to be longer than max_len
+// return      : HEVC stream length (in bytes), or -1 if it is aborted
+I32 encodePicture (HEVCeContext *ctx, UI8 *pbuffer, const PIX *img, const I32 img_stride, PIX *img_rcon, const I32 rcon_stride, const I32 ysz, const I32 xsz, const I32 qp, const I8 *qp_map, const I32 max_len) {
+    const HEVCeConfig *cfg = &ctx->cfg;
+    
+    const I32 yszn = ((ysz + CTU_SZ - 1) / CTU_SZ) * CTU_SZ;                                                           // pad the image height to multiple of CTU_SZ
+    const I32 xszn = ((xsz + CTU_SZ - 1) / CTU_SZ) * CTU_SZ;                                                           // pad the image width  to multiple of CTU_SZ
+    const I32 nrows = yszn / CTU_SZ;
+    const I32 ncols = xszn / CTU_SZ;
+    const I32 nctus = nrows * ncols;
+    
+    void *work = (UI8 *)ctx->work + (cfg->aq_strength != 0 ? QP_MAP_LEN(nctus) : 0);                                  // skip the QP offsets analyzed by HEVCeEncode
+    
+    PictureJobs pic;
+    LineBuffers lines;
+    I32 *substream_lens;
+    UI8 *rbsp;
+    UI8 *pwork;
+    UI8 *pbuf = pbuffer;
+    I32  ntiles, addr, n_ctus, i;
+    
+    pic.qp          = qp;
+    pic.qpc         = &ctx->qpc;
+    pic.qp_map      = qp_map;
+    pic.max_len     = max_len;
+    pic.speed       = CLIP(cfg->speed, 0, SPEED_COUNT-1);
+    pic.img         = img;
+    pic.img_rcon    = img_rcon;
+    pic.img_stride  = img_stride;
+    pic.rcon_stride = rcon_stride;
+    pic.img_y0      = 0;
+    pic.ysz         = ysz;
+    pic.xsz         = xsz;
+    pic.yszn        = yszn;
+    pic.xszn        = xszn;
+    pic.n_slices    = getSliceCount(cfg, nctus);
+    
+    getTileGrid(cfg, nrows, ncols, &pic.tile_rows, &pic.tile_cols);
+    ntiles = pic.tile_rows * pic.tile_cols;
+    
+    putHeaderToBuffer(&pbuf, yszn, xszn, (cfg->wpp && ntiles==1), pic.tile_rows, pic.tile_cols, (qp_map != NULL));   // tiles and WPP are not enabled at the same time, tiles take precedence
+    
+    if (ntiles > 1) {                                                                                                  // tiles are enabled
+        pic.substreams = (Substream *)work;                                                                            // allocate the work buffer
+        substream_lens = (I32 *)(pic.substreams + ntiles);
+        rbsp           = (UI8 *)(substream_lens + ntiles);
+        pwork          = rbsp + SLICE_HEADER_RBSP_LEN(ntiles);
+        for (i=0; i<ntiles; i++)
+            setLineBuffers(&pic.substreams[i].lines, pwork + (i/pic.tile_cols)*LINE_BUFFERS_LEN(xszn), xszn);                  // the tiles in a tile row share the line-buffers, since each of them only uses its own columns
+        pwork         += pic.tile_rows * LINE_BUFFERS_LEN(xszn);
+        for (i=0; i<ntiles; i++) {
+            const I32 tile_row = i / pic.tile_cols;
+            const I32 tile_col = i % pic.tile_cols;
+            pic.substreams[i].stream = pwork;
+            pwork += ((tile_row+1)*nrows/pic.tile_rows - tile_row*nrows/pic.tile_rows) * ((tile_col+1)*ncols/pic.tile_cols - tile_col*ncols/pic.tile_cols) * TMPBUF_LEN;   // the substream of a tile has TMPBUF_LEN bytes for each CTU
+        }
+        
+        runJobs(cfg, encodeTileJob, &pic, ntiles);                                                                     // encode all the tiles in parallel
+        
+        for (i=0; i<ntiles; i++)
+            if ((substream_lens[i] = pic.substreams[i].stream_len) < 0)                                                // a tile is aborted
+                return -1;
+        
+        putSliceHeaderToBuffer(&pbuf, rbsp, qp, 0, nctus, 1, ntiles, substream_lens);
+        
+        for (i=0; i<ntiles; i++)
+            putBytesToBuffer(&pbuf, pic.substreams[i].stream, pic.substreams[i].stream_len);                           // concatenate the substreams
+        
+    } else if (cfg->wpp) {                                                                                             // WPP is enabled
+        pic.substreams = (Substream *)work;                                                                            // allocate the work buffer
+        substream_lens = (I32 *)(pic.substreams + nrows);
+        rbsp           = (UI8 *)(substream_lens + nrows);
+        pwork          = rbsp + SLICE_HEADER_RBSP_LEN(nrows);
+        for (i=0; i<nrows; i++)
+            setLineBuffers(&pic.substreams[i].lines, pwork, xszn);                                                     // all the rows share the line-buffers : in a wavefront step, row r writes column c after row r+1 has read columns c-2 and c-1
+        pwork         += LINE_BUFFERS_LEN(xszn);
+        for (i=0; i<nrows; i++) {
+            pic.substreams[i].stream = pwork;
+            pwork += ncols * TMPBUF_LEN;
+        }
+        
+        for (pic.step=0; pic.step<ncols+2*(nrows-1); pic.step++) {                                                     // for all wavefront steps
+            const I32 row_first = MAX(0, (pic.step - ncols + 2) / 2);
+            const I32 row_last  = MIN(nrows-1, pic.step / 2);
+            I32 len = 0;
+            runJobs(cfg, encodeWPPjob, &pic, row_last-row_first+1);                                                    // encode the CTUs of this step in parallel
+            for (i=0; max_len>0 && i<=row_last; i++)                                                                   // the rows above row_last have not started
+                len += pic.substreams[i].stream_len;
+            if (len > max_len)
+                return -1;
+        }
+        
+        for (i=0; i<nrows; i++)
+            substream_lens[i] = pic.substreams[i].stream_len;
+        
+        putSliceHeaderToBuffer(&pbuf, rbsp, qp, 0, nctus, 1, nrows, substream_lens);
+        
+        for (i=0; i<nrows; i++)
+            putBytesToBuffer(&pbuf, pic.substreams[i].stream, pic.substreams[i].stream_len);                           // concatenate the substreams
+        
+    } else if (pic.n_slices > 1 && cfg->slice_bytes <= 0) {                                                        // slices split by CTU count, encode them in parallel
+        pic.substreams = (Substream *)work;                                                                            // allocate the work buffer
+        pwork          = (UI8 *)(pic.substreams + pic.n_slices);
+        for (i=0; i<pic.n_slices; i++) {
+            setLineBuffers(&pic.substreams[i].lines, pwork, xszn);                                                     // each slice has its own line-buffers, since the slices are encoded at the same time
+            pwork += LINE_BUFFERS_LEN(xszn);
+            pic.substreams[i].stream = pwork;
+            pwork += ((i+1)*nctus/pic.n_slices - i*nctus/pic.n_slices) * TMPBUF_LEN + SLICE_HEADER_MAX_LEN;            // the NAL unit of a slice has TMPBUF_LEN bytes for each CTU, and the slice header
+        }
+        
+        runJobs(cfg, encodeSliceJob, &pic, pic.n_slices);                                                             // encode all the slices in parallel
+        
+        for (i=0; i<pic.n_slices; i++)
+            if (pic.substreams[i].stream_len < 0)                                                                      // a slice is aborted
+                return -1;
+        
+        for (i=0; i<pic.n_slices; i++)
+            putBytesToBuffer(&pbuf, pic.substreams[i].stream, pic.substreams[i].stream_len);                           // concatenate the slice NAL units
+        
+    } else {                                                                                                           // encode the slices one by one to the output buffer. the length of each slice is limited by slice_bytes (if > 0)
+        setLineBuffers(&lines, (UI8 *)work, xszn);
+        for (addr=0; addr<nctus; addr+=n_ctus) {
+            I32 len;
+            if (max_len > 0 && pbuf-pbuffer >= max_len)                                                                // no room for the remaining slices
+                return -1;
+            len = encodeSlice(&pic, &lines, addr, (nctus+pic.n_slices-1)/pic.n_slices, cfg->slice_bytes, (max_len > 0 ? max_len-(I32)(pbuf-pbuffer) : 0), pbuf, &n_ctus);
+            if (len < 0)
+                return -1;
+            pbuf += len;
+        }
+    }
+    
+    if (max_len > 0 && pbuf-pbuffer > max_len)
+        return -1;
     
     return pbuf - pbuffer;                                                                                             // return the compressed length
 }
 
 
 
+#define RC_MAX_QP  (QP_COUNT-1)
+
+
+I32 HEVCeEncode (                // return   HEVC stream length (in bytes), or -1 if the image is larger than the context allows
+    HEVCeContext *ctx,
+          UI8 *pbuffer,          // buffer to save HEVC stream, its size must >= HEVCeMaxStreamLength(*ysz, *xsz)
+    const PIX *img,              // 2-D array in 1-D buffer, height=ysz, width=xsz, row stride=img_stride. Input the image to be compressed.
+    const I32  img_stride,
+          PIX *img_rcon,         // 2-D array in 1-D buffer, height=yszn, width=xszn (padded size), row stride=rcon_stride. The HEVC encoder will save the reconstructed image here. Can be NULL
+    const I32  rcon_stride,
+          I32 *ysz,              // point to image height, will be modified (clip to a multiple of CTU_SZ)
+          I32 *xsz               // point to image width , will be modified (clip to a multiple of CTU_SZ)
+) {
+    const HEVCeConfig *cfg = &ctx->cfg;
+    
+    const I64 target = (cfg->target_bytes > 0)     ? cfg->target_bytes :
+                       (cfg->target_bpp_x1000 > 0) ? (I64)(*ysz) * (*xsz) * cfg->target_bpp_x1000 / 8000 : 0;             // the byte budget of the rate control, 0 means no rate control
+    
+    I32 qp_lo = CLIP(cfg->qp, 0, QP_COUNT-1);
+    I32 qp_hi = RC_MAX_QP;
+    I32 qp_best = -1;                                                                                                  // the smallest QP whose stream fits in the budget
+    I32 qp_last = -1;                                                                                                  // the QP of the stream which is now in pbuffer
+    I32 len = 0;
+    
+    const I8 *qp_map = ctx->qp_offsets;                                                                                // the QP offsets given by the user are only for this image
+    ctx->qp_offsets = NULL;
+    
+    if (*ysz < 1 || *xsz < 1 || *ysz > ctx->ysz_max || *xsz > ctx->xsz_max)                                           // the work buffer is only large enough for ysz_max x xsz_max
+        return -1;
+    
+    if (qp_map == NULL && cfg->aq_strength != 0) {                                                                     // adaptive quantization : analyze the CTU rows in parallel, the QP offsets are at the beginning of the work buffer
+        const I32 nrows = (*ysz + CTU_SZ - 1) / CTU_SZ;
+        const I32 ncols = (*xsz + CTU_SZ - 1) / CTU_SZ;
+        AnalysisJobs a;
+        a.img        = img;
+        a.img_stride = img_stride;
+        a.ysz        = *ysz;
+        a.xsz        = *xsz;
+        a.map        = (I8 *)ctx->work;
+        runJobs(cfg, analyzeJob, &a, nrows);
+        calcQPOffsets(a.map, nrows*ncols, cfg->aq_strength);
+        qp_map = a.map;
+    }
+    
+    if (target <= 0) {                                                                                                 // fixed QP
+        qp_best = qp_lo;
+    } else {                                                                                                           // rate control : bisection of the QP in qp_lo ~ RC_MAX_QP, assuming that the stream length decreases with the QP
+        while (qp_lo <= qp_hi) {
+            const I32 qp = (qp_lo + qp_hi) / 2;
+            len = encodePicture(ctx, pbuffer, img, img_stride, img_rcon, rcon_stride, *ysz, *xsz, qp, qp_map, (I32)MIN(target, I32_MAX_VALUE));
+            if (len >= 0) {                                                                                            // fits : try the smaller QPs
+                qp_best = qp_last = qp;
+                qp_hi   = qp - 1;
+            } else {                                                                                                   // too long (aborted) : try the larger QPs
+                qp_last = -1;                                                                                          // the aborted trial has overwritten pbuffer
+                qp_lo   = qp + 1;
+            }
+        }
+        if (qp_best < 0)                                                                                               // even the largest QP does not fit, output it anyway
+            qp_best = RC_MAX_QP;
+    }
+    
+    if (qp_best != qp_last)                                                                                            // pbuffer does not hold the stream of qp_best yet
+        len = encodePicture(ctx, pbuffer, img, img_stride, img_rcon, rcon_stride, *ysz, *xsz, qp_best, qp_map, 0);
+    
+    ctx->qp = qp_best;
+    
+    *ysz = ((*ysz + CTU_SZ - 1) / CTU_SZ) * CTU_SZ;                                                                    // change the value of *ysz, so that the user can get the clipped image size
+    *xsz = ((*xsz + CTU_SZ - 1) / CTU_SZ) * CTU_SZ;                                                                    // change the value of *xsz, so that the user can get the clipped image size
+    
+    return len;                                                                                                        // return the compressed length
+}
+
+
+I32 HEVCeGetQP (const HEVCeContext *ctx) {
+    return ctx->qp;
+}
+
+
+void HEVCeSetQPOffsets (HEVCeContext *ctx, const I8 *qp_offsets) {
+    ctx->qp_offsets = qp_offsets;
+}
+
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// streaming : the image is pushed row by row, and encoded as a single slice without entry points (tiles, WPP and slices are ignored) and without the
+//             reconstructed image. Only a CTU row of original pixels and the line-buffers are kept, so that the memory does not depend on the image height
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// description : encode the next CTU row from img (which holds the rows of this CTU row only), and send its bytes to the write callback
+void encodeStreamRow (HEVCeContext *ctx, const PIX *img, const I32 img_stride) {
+    PictureJobs *pic = &ctx->spic;
+    
+    const I32  y        = ctx->y;
+    const BOOL last_row = (y+CTU_SZ >= pic->yszn);
+    
+    UI8 *pbuf = ctx->out_buf;
+    I32 x;
+    
+    pic->img        = img;
+    pic->img_stride = img_stride;
+    pic->img_y0     = y;
+    
+    if (pic->qp_map) {                                                                                                 // adaptive quantization : analyze this CTU row, compared with its own average activity
+        analyzeCTURow(img, img_stride, pic->ysz-y, pic->xsz, ctx->qp_map);
+        calcQPOffsets(ctx->qp_map, pic->xszn/CTU_SZ, ctx->cfg.aq_strength);
+    }
+    
+    for (x=0; x<pic->xszn; x+=CTU_SZ) {                                                                                // for all CTUs in this row
+        encodeCTU(pic, &ctx->cabac, &ctx->ctxs, &ctx->qp_prev, &ctx->lines, y, x, (x>0), (y>0), (y>0 && x+CTU_SZ<pic->xszn), (y>0 && x>0));   // encode a CTU
+        
+        if (last_row && x+CTU_SZ >= pic->xszn) {                                                                       // the last CTU of the picture
+            CABACputTerminate(&ctx->cabac, 1);                                                                         // end_of_slice_segment_flag
+            CABACfinish(&ctx->cabac);
+        } else {
+            CABACputTerminate(&ctx->cabac, 0);                                                                         // end_of_slice_segment_flag
+        }
+        
+        CABACsubmitToBuffer(&ctx->cabac, &pbuf);                                                                       // submit the commpressed bytes from CABAC coder's buffer to output buffer
+    }
+    
+    ctx->y += CTU_SZ;
+    
+    ctx->write(ctx->write_arg, ctx->out_buf, pbuf - ctx->out_buf);
+}
+
+
+
+I32 HEVCeBegin (HEVCeContext *ctx, I32 ysz, I32 xsz, HEVCeWriteFunc write, void *write_arg) {
+    PictureJobs *pic = &ctx->spic;
+    
+    const I32 xszn  = ((xsz + CTU_SZ - 1) / CTU_SZ) * CTU_SZ;                                                          // pad the image width  to multiple of CTU_SZ
+    const I32 yszn  = ((ysz + CTU_SZ - 1) / CTU_SZ) * CTU_SZ;                                                          // pad the image height to multiple of CTU_SZ, there is no limit of the height
+    
+    UI8 *pwork = (UI8 *)ctx->work;
+    UI8 *pbuf;
+    UI8  rbsp [SLICE_HEADER_RBSP_LEN(0)];
+    
+    if (ysz < 1 || xsz < 1 || xsz > ctx->xsz_max || write == NULL)
+        return -1;
+    
+    pic->qp          = ctx->qp = CLIP(ctx->cfg.qp, 0, QP_COUNT-1);                                                  // no rate control when streaming
+    pic->qpc         = &ctx->qpc;
+    pic->qp_map      = NULL;
+    pic->speed       = CLIP(ctx->cfg.speed, 0, SPEED_COUNT-1);
+    pic->img         = NULL;
+    pic->img_rcon    = NULL;                                                                                           // use the reconstructed line-buffer
+    pic->img_stride  = xsz;
+    pic->rcon_stride = 0;
+    pic->img_y0      = 0;
+    pic->ysz         = ysz;
+    pic->xsz         = xsz;
+    pic->yszn        = yszn;
+    pic->xszn        = xszn;
+    pic->tile_rows   = pic->tile_cols = pic->n_slices = 1;
+    
+    setLineBuffers(&ctx->lines, pwork, xszn);                                                                          // allocate the work buffer
+    pwork           += LINE_BUFFERS_LEN(xszn);
+    ctx->rows_buf    = (PIX *)pwork;
+    pwork           += CTU_SZ * xszn * (I32)sizeof(PIX);
+    ctx->cabac       = newCABACcoder(pwork);
+    pwork           += TMPBUF_LEN;
+    ctx->out_buf     = pwork;
+    pwork           += (xszn/CTU_SZ) * TMPBUF_LEN;
+    ctx->qp_map      = (I8 *)pwork;
+    if (ctx->cfg.aq_strength != 0)
+        pic->qp_map  = ctx->qp_map;
+    
+    ctx->ctxs      = pic->qpc->ctxs[pic->qp];
+    ctx->qp_prev   = pic->qp;
+    ctx->write     = write;
+    ctx->write_arg = write_arg;
+    ctx->y         = 0;
+    ctx->nrows_buf = 0;
+    
+    pbuf = ctx->out_buf;
+    putHeaderToBuffer(&pbuf, yszn, xszn, 0, 1, 1, (pic->qp_map != NULL));
+    putSliceHeaderToBuffer(&pbuf, rbsp, pic->qp, 0, 1, 0, 1, NULL);                                                        // the only slice, which starts from the first CTU
+    write(write_arg, ctx->out_buf, pbuf - ctx->out_buf);
+    
+    return 0;
+}
+
+
+
+I32 HEVCePushRows (HEVCeContext *ctx, const PIX *img, I32 img_stride, I32 nrows) {
+    const I32 xsz = ctx->spic.xsz;
+    I32 i, j;
+    
+    if (ctx->write == NULL)                                                                                            // HEVCeBegin is not called
+        return -1;
+    
+    while (nrows > 0 && ctx->y < ctx->spic.ysz) {
+        const I32 need = MIN(CTU_SZ, ctx->spic.ysz - ctx->y);                                                          // the number of rows in the next CTU row, the last CTU row can be partial
+        
+        if (ctx->nrows_buf == 0 && nrows >= need) {                                                                    // the pushed rows contain the whole CTU row : encode it in place, without copying
+            encodeStreamRow(ctx, img, img_stride);
+            img   += need * img_stride;
+            nrows -= need;
+        } else {                                                                                                       // collect the rows in rows_buf
+            const I32 n = MIN(nrows, need - ctx->nrows_buf);
+            for (i=0; i<n; i++, img+=img_stride)
+                for (j=0; j<xsz; j++)
+                    ctx->rows_buf[(ctx->nrows_buf+i)*xsz+j] = img[j];
+            ctx->nrows_buf += n;
+            nrows          -= n;
+            if (ctx->nrows_buf == need) {
+                encodeStreamRow(ctx, ctx->rows_buf, xsz);
+                ctx->nrows_buf = 0;
+            }
+        }
+    }
+    
+    return (nrows > 0) ? -1 : 0;                                                                                       // more rows than the image height
+}
+
+
+
+I32 HEVCeFinish (HEVCeContext *ctx) {
+    const BOOL complete = (ctx->write != NULL && ctx->y >= ctx->spic.ysz);                                             // all the CTU rows have been encoded and written
+    ctx->write = NULL;
+    return complete ? 0 : -1;
+}
+
+
+
+
+#define LEGACY_MAX_XSZ  8192                                    // the max width when no work buffer is provided (HEVCImageEncoder, or HEVCImageEncoderEx with work=NULL). Larger images need a work buffer or a context
+
+
+I32 HEVCImageEncoderEx (         // return   HEVC stream length (in bytes), or -1 if work=NULL but the line-buffers on the stack are not enough
+          UI8 *pbuffer,          // buffer to save HEVC stream
+    const PIX *img,              // 2-D array in 1-D buffer, height=ysz, width=xsz. Input the image to be compressed.
+          PIX *img_rcon,         // 2-D array in 1-D buffer, height=yszn, width=xszn (padded size). The HEVC encoder will save the reconstructed image here. Can be NULL
+          I32 *ysz,              // point to image height, will be modified (clip to a multiple of CTU_SZ)
+          I32 *xsz,              // point to image width , will be modified (clip to a multiple of CTU_SZ)
+    const HEVCeConfig *cfg,
+          void *work             // work buffer, its size must >= HEVCImageEncoderWorkSize(*ysz, *xsz, cfg). Can be NULL for the single-slice config and a width <= LEGACY_MAX_XSZ
+) {
+    HEVCeContext ctx;                                                                                                  // a temporary context which uses the user's work buffer
+    PIX          legacy_work [LINE_BUFFERS_LEN(LEGACY_MAX_XSZ)/sizeof(PIX)];                                           // the line-buffers on the stack, for the callers which do not provide a work buffer. Its size is fixed, never grows with the width. PIX type to align rcon_above
+    
+    if (work == NULL) {
+        const I32 work_size = HEVCImageEncoderWorkSize(*ysz, *xsz, cfg);
+        if (work_size < 0 || work_size > (I32)sizeof(legacy_work))                                                     // tiles, WPP or parallel slices, or the image is wider than LEGACY_MAX_XSZ
+            return -1;
+        work = legacy_work;
+    }
+    
+    initContext(&ctx, cfg, *ysz, *xsz, work);
+    return HEVCeEncode(&ctx, pbuffer, img, *xsz, img_rcon, ((*xsz + CTU_SZ - 1) / CTU_SZ) * CTU_SZ, ysz, xsz);
+}
+
+
+
+
+I32 HEVCImageEncoder (           // return   HEVC stream length (in bytes)
+          UI8 *pbuffer,          // buffer to save HEVC stream
+    const PIX *img,              // 2-D array in 1-D buffer, height=ysz, width=xsz. Input the image to be compressed.
+          PIX *img_rcon,         // 2-D array in 1-D buffer, height=yszn, width=xszn (padded size). The HEVC encoder will save the reconstructed image here. Can be NULL
+          I32 *ysz,              // point to image height, will be modified (clip to a multiple of CTU_SZ)
+          I32 *xsz,              // point to image width , will be modified (clip to a multiple of CTU_SZ)
+    const I32  qpd6              // quant value, must be 0~4 (QP = 4, 10, 16, 22, 28). The larger, the higher compression ratio, but the lower quality.
+) {
+    HEVCeConfig cfg = {0};
+    cfg.qp = qpd6 * 6 + 4;
+    return HEVCImageEncoderEx(pbuffer, img, img_rcon, ysz, xsz, &cfg, NULL);
+}
+
+
+
@@ -2,13 +2,188 @@
 #define __HEVC_E__
 
 
-extern int HEVCImageEncoder (          // return   HEVC stream length (in bytes)
+// the encoder pads the image height and width to a multiple of the CTU size (32). The reconstructed image has the padded size
+#define HEVCE_PADDED_SIZE(sz)  ( ((sz) + 31) / 32 * 32 )
+
+
+// the bit depth of the pixels, fixed at compile time (for example, -DHEVCE_BIT_DEPTH=10). 8: Main Still Picture profile.  9~10: Main 10 profile.  11~12: Main 12 (format range extensions) profile
+// the encoder and its callers must be compiled with the same value
+#ifndef HEVCE_BIT_DEPTH
+#define HEVCE_BIT_DEPTH        8
+#endif
+
+#if HEVCE_BIT_DEPTH < 8 || HEVCE_BIT_DEPTH > 12
+#error "HEVCE_BIT_DEPTH must be 8~12"
+#endif
+
+// the pixel type of all the image buffers of the API. The pixel values are 0 ~ (1<<HEVCE_BIT_DEPTH)-1
+#if HEVCE_BIT_DEPTH > 8
+typedef unsigned short HEVCePixel;
+#else
+typedef unsigned char  HEVCePixel;
+#endif
+
+
+extern int HEVCImageEncoder (          // return   HEVC stream length (in bytes), or -1 if xsz > 8192 (the line-buffers are on the stack, use HEVCImageEncoderEx or the context API for wider images)
     unsigned char       *pbuffer,      // buffer to save HEVC stream
-    const unsigned char *img,          // 2-D array in 1-D buffer, height=ysz, width=xsz. Input the image to be compressed.
-    unsigned char       *img_rcon,     // 2-D array in 1-D buffer, height=ysz, width=xsz. The HEVC encoder will save the reconstructed image here.
+    const HEVCePixel    *img,          // 2-D array in 1-D buffer, height=ysz, width=xsz. Input the image to be compressed.
+    HEVCePixel          *img_rcon,     // 2-D array in 1-D buffer, height=HEVCE_PADDED_SIZE(ysz), width=HEVCE_PADDED_SIZE(xsz). The HEVC encoder will save the reconstructed image here. Can be NULL if the reconstructed image is not needed
     int                 *ysz,          // point to image height, will be modified (clip to a multiple of CTU_SZ)
     int                 *xsz,          // point to image width , will be modified (clip to a multiple of CTU_SZ)
-    const int            qpd6          // quant value, must be 0~4. The larger, the higher compression ratio, but the lower quality.
+    const int            qpd6          // quant value, must be 0~4, i.e. QP = 4, 10, 16, 22, 28. The larger, the higher compression ratio, but the lower quality. Use HEVCImageEncoderEx for the other QPs
+);
+
+
+
+// a job of the encoder, which can be run in any thread. job_idx = 0 ~ njobs-1
+typedef void (*HEVCeJobFunc) (void *job_arg, int job_idx);
+
+// run func(job_arg, 0) ~ func(job_arg, njobs-1) , possibly in parallel, and return when all of them are finished.
+// provided by the user (for example, using a thread pool), so that the encoder itself does not depend on any thread library.
+typedef void (*HEVCeParallelFor) (void *pool, HEVCeJobFunc func, void *job_arg, int njobs);
+
+
+typedef struct {
+    int                  qp;           // quantize parameter, 0~51. The larger, the higher compression ratio, but the lower quality. With rate control, it is the smallest QP (the best quality) allowed
+    int                  target_bytes; // >0: rate control, search the smallest QP whose stream length <= target_bytes (bisection, a trial is aborted as soon as it is too long). If even QP 51 is too long, the stream of QP 51 is output
+    int                  target_bpp_x1000; // >0 (and target_bytes=0): rate control, the target is target_bpp_x1000/1000 bits per pixel (of the original image size). Rate control is not available in the streaming API
+    int                  aq_strength;  // adaptive quantization strength in 1/8 units (8 means 1.0), 0: off. Each CTU gets a QP offset of strength*(log2(activity) - its average), clipped to +-12, coded as cu_qp_delta
+                                       // positive: the textured CTUs get larger QPs and the flat CTUs get smaller QPs (perceptual). Negative: the reverse, bits move from the flat CTUs to the textured ones
+    int                  speed;        // speed preset, 0~3. 0: exhaustive RDO of all prediction modes (slowest, best compression). 1~3: faster, only send the best 8/4/2 modes ranked by SATD (plus the probable modes) to full RDO. 2~3: also use fast CU decision (early CU-split termination)
+    int                  wpp;          // 0: encode CTUs in raster order.  1: wavefront parallel processing (entropy_coding_sync_enabled_flag=1), each CTU row is a substream
+    int                  tile_cols;    // number of tile columns (uniform spacing). 0 or 1: no tile columns. Clipped so that each tile column >= 256 pixels and <= 20 columns
+    int                  tile_rows;    // number of tile rows    (uniform spacing). 0 or 1: no tile rows.    Clipped so that each tile row    >=  64 pixels and <= 22 rows
+                                       // when there are more than 1 tiles, each tile is an independent substream which can be encoded in parallel, and wpp is ignored
+    int                  slices;       // number of slices (split by CTU count). 0 or 1: one slice. Each slice is an independent NAL unit, and slices are encoded in parallel when slice_bytes=0
+    int                  slice_bytes;  // >0: max length of each slice NAL unit (in bytes, including the start code), a new slice is started when the current one is full. Slices are encoded one by one
+                                       // slices and slice_bytes are ignored when tiles or wpp are enabled
+    HEVCeParallelFor     parallel_for; // NULL: run all jobs sequentially in the calling thread
+    void                *pool;         // passed to parallel_for
+} HEVCeConfig;
+
+
+extern int HEVCImageEncoderWorkSize (  // return   size (in bytes) of the work buffer that HEVCImageEncoderEx needs, or -1 if it is larger than INT_MAX. The context line-buffers are in it, so it grows with the width
+    int                  ysz,          // image height
+    int                  xsz,          // image width
+    const HEVCeConfig   *cfg
+);
+
+
+// encode one image, the same as HEVCeCreate + HEVCeEncode + HEVCeDestroy (the arena is the work buffer, the strides are the image widths)
+extern int HEVCImageEncoderEx (        // return   HEVC stream length (in bytes)
+    unsigned char       *pbuffer,      // buffer to save HEVC stream
+    const HEVCePixel    *img,          // 2-D array in 1-D buffer, height=ysz, width=xsz. Input the image to be compressed.
+    HEVCePixel          *img_rcon,     // 2-D array in 1-D buffer, height=HEVCE_PADDED_SIZE(ysz), width=HEVCE_PADDED_SIZE(xsz). The HEVC encoder will save the reconstructed image here. Can be NULL if the reconstructed image is not needed
+    int                 *ysz,          // point to image height, will be modified (clip to a multiple of CTU_SZ)
+    int                 *xsz,          // point to image width , will be modified (clip to a multiple of CTU_SZ)
+    const HEVCeConfig   *cfg,
+    void                *work          // work buffer, its size must >= HEVCImageEncoderWorkSize(ysz, xsz, cfg). Can be NULL for a single slice (no tiles, WPP or parallel slices) and xsz <= 8192, then a fixed buffer on the stack is used
+);
+
+
+
+// ---- context API : create a context once, then encode many images with it. The encoder never allocates memory, all its working buffers are in an arena provided by the user ----
+
+typedef struct HEVCeContext HEVCeContext;
+
+
+extern int HEVCeContextSize (          // return   size (in bytes) of the arena that HEVCeCreate needs, or -1 if it is larger than INT_MAX. It scales with ysz_max x xsz_max and the config (the line-buffers scale with xsz_max only)
+    int                  ysz_max,      // max height of the images that will be encoded with this context
+    int                  xsz_max,      // max width  of the images that will be encoded with this context
+    const HEVCeConfig   *cfg
+);
+
+
+extern HEVCeContext *HEVCeCreate (     // return   the context (placed at the beginning of the arena), or NULL if the arena is too small (or HEVCeContextSize returns -1)
+    const HEVCeConfig   *cfg,          // copied into the context
+    int                  ysz_max,
+    int                  xsz_max,
+    void                *arena,        // provided by the user, aligned to 16 bytes at least. It must be kept until HEVCeDestroy
+    int                  arena_size    // must >= HEVCeContextSize(ysz_max, xsz_max, cfg)
+);
+
+
+extern int HEVCeEncode (               // return   HEVC stream length (in bytes), or -1 if the image is empty or larger than ysz_max x xsz_max
+    HEVCeContext        *ctx,
+    unsigned char       *pbuffer,      // buffer to save HEVC stream, its size must >= HEVCeMaxStreamLength(ysz, xsz)
+    const HEVCePixel    *img,          // 2-D array in 1-D buffer, height=ysz, width=xsz. Input the image to be compressed.
+    int                  img_stride,   // distance (in pixels) between two rows of img
+    HEVCePixel          *img_rcon,     // 2-D array in 1-D buffer, height=HEVCE_PADDED_SIZE(ysz), width=HEVCE_PADDED_SIZE(xsz). The HEVC encoder will save the reconstructed image here. Can be NULL if the reconstructed image is not needed
+    int                  rcon_stride,  // distance (in pixels) between two rows of img_rcon, must >= HEVCE_PADDED_SIZE(xsz). Ignored when img_rcon=NULL
+    int                 *ysz,          // point to image height, will be modified (clip to a multiple of CTU_SZ)
+    int                 *xsz           // point to image width , will be modified (clip to a multiple of CTU_SZ)
+);
+
+
+extern int HEVCeGetQP (                // return   the QP of the last image encoded with the context (chosen by the rate control, or the QP of the config)
+    const HEVCeContext  *ctx
+);
+
+
+// the adaptive quantization analysis of an image, separated from the encoding so that it can run ahead in another thread (for example, while the previous image is being encoded).
+// it needs no context and no work buffer, and only reads the image. HEVCeEncode runs it by itself (with parallel_for) when aq_strength != 0 and no offsets are set
+extern int HEVCeAnalyze (              // return   the number of CTUs, i.e. HEVCE_PADDED_SIZE(ysz)/32 * HEVCE_PADDED_SIZE(xsz)/32, or -1 if the image is empty
+    const HEVCePixel    *img,          // 2-D array in 1-D buffer, height=ysz, width=xsz
+    int                  img_stride,   // distance (in pixels) between two rows of img
+    int                  ysz,
+    int                  xsz,
+    int                  aq_strength,  // the same as aq_strength of HEVCeConfig
+    signed char         *qp_offsets    // output the QP offset of each CTU in raster order
+);
+
+
+extern void HEVCeSetQPOffsets (        // use the QP offsets (from HEVCeAnalyze) for the next HEVCeEncode only. The buffer must be kept until that HEVCeEncode returns. It enables cu_qp_delta even if aq_strength=0. The offsets must be in -12~+12 (the range of HEVCeAnalyze), the others are clipped to it
+    HEVCeContext        *ctx,
+    const signed char   *qp_offsets
+);
+
+
+// ---- streaming API : the image is pushed row by row (for example, strips from a scanner), and the stream is written after each CTU row is encoded ----
+//      The picture is a single slice (tiles, WPP, slices, slice_bytes and the rate control in the config are ignored), and no reconstructed image is output.
+//      The memory only depends on the width (HEVCeContextSize with xsz_max), so there is no limit of the height, and ysz_max is not used.
+//      With aq_strength, the activities of each CTU row are compared with the average of that row, since the rows below are not known yet.
+
+// receives len bytes of the HEVC stream. Called once in HEVCeBegin (the headers), and once for each CTU row
+typedef void (*HEVCeWriteFunc) (void *write_arg, const unsigned char *bytes, int len);
+
+
+extern int HEVCeBegin (                // return   0:success   -1:failed (the width is larger than xsz_max)
+    HEVCeContext        *ctx,
+    int                  ysz,          // image height, there is no limit
+    int                  xsz,          // image width , must <= xsz_max of the context
+    HEVCeWriteFunc       write,
+    void                *write_arg     // passed to write
+);
+
+
+extern int HEVCePushRows (             // return   0:success   -1:failed (HEVCeBegin is not called, or more rows than the image height are pushed)
+    HEVCeContext        *ctx,
+    const HEVCePixel    *img,          // the next nrows rows of the image, width=xsz. A full CTU row (32 rows) in one push is encoded in place, otherwise the rows are copied until a CTU row is complete
+    int                  img_stride,   // distance (in pixels) between two rows of img
+    int                  nrows         // any number of rows
+);
+
+
+extern int HEVCeFinish (               // return   0:success   -1:failed (not all the rows of the image are pushed, then the stream is incomplete)
+    HEVCeContext        *ctx
+);
+
+
+
+// the context does not own any memory, so the arena can be freed or reused after this
+extern void HEVCeDestroy (HEVCeContext *ctx);
+
+
+extern int HEVCeMaxStreamLength (      // return   the max length (in bytes) of the HEVC stream of an image, i.e. the size of pbuffer that is always enough, or -1 if it is larger than INT_MAX
+    int                  ysz,
+    int                  xsz
+);
+
+
+
+// check that the fast transforms are bit-exact to the reference transforms (matrix multiply), and the SIMD kernels are bit-exact to the C kernels, on random blocks
+extern int HEVCImageEncoderSelfCheck ( // return   number of mismatched blocks, 0 means passed
+    int                  n_blocks      // number of random blocks to test for each TU size and direction
 );
 
 
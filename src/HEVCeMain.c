@@ -1,62 +1,287 @@
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L                                // for clock_gettime, when compiled with -std=c99
+#endif
+
 #include <stdio.h>
-#include <math.h>                                              // we only use function log10 in <math.h> to calculate PSNR (dB)
+#include <stdlib.h>                                            // we only use function atoi, atof, malloc, realloc, free and qsort in <stdlib.h>
+#include <string.h>                                            // we only use function strcmp, strlen, memset and memcpy in <string.h>
+#include <math.h>                                              // we only use function log10 in <math.h> to calculate PSNR (dB), and floor to round -aq
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>                                                // for mapping the opened PGM file
+#else
+#include <pthread.h>
+#include <sys/mman.h>                                          // for mapping the PGM file
+#include <sys/stat.h>
+#include <dirent.h>                                            // for listing the PGM files of a directory in batch mode
+#include <time.h>                                              // we only use clock_gettime in <time.h> to measure the throughput in batch mode
+#endif
 
 #include "HEVCe.h"                                             // contains a function (HEVCImageEncoder), for compressing a image to HEVC stream.
 
 
 
+// a simple thread pool, which provides parallel_for for HEVCImageEncoderEx -------------------------------------------------------------------------------------
+
+#ifdef _WIN32
+typedef HANDLE             Thread;
+typedef CRITICAL_SECTION   Mutex;
+typedef CONDITION_VARIABLE Cond;
+#define MUTEX_INIT(m)      InitializeCriticalSection(&(m))
+#define MUTEX_LOCK(m)      EnterCriticalSection(&(m))
+#define MUTEX_UNLOCK(m)    LeaveCriticalSection(&(m))
+#define COND_INIT(c)       InitializeConditionVariable(&(c))
+#define COND_WAIT(c, m)    SleepConditionVariableCS(&(c), &(m), INFINITE)
+#define COND_BROADCAST(c)  WakeAllConditionVariable(&(c))
+#define MUTEX_DESTROY(m)   DeleteCriticalSection(&(m))
+#define COND_DESTROY(c)                                                                                    // a condition variable of Windows needs no cleanup
+#define THREAD_FUNC(name)  DWORD WINAPI name (LPVOID arg)
+#define THREAD_CREATE(t, func, arg)  ( ((t) = CreateThread(NULL, 0, func, arg, 0, NULL)) == NULL )         // nonzero if failed
+#define THREAD_JOIN(t)     WaitForSingleObject(t, INFINITE)
+#else
+typedef pthread_t          Thread;
+typedef pthread_mutex_t    Mutex;
+typedef pthread_cond_t     Cond;
+#define MUTEX_INIT(m)      pthread_mutex_init(&(m), NULL)
+#define MUTEX_LOCK(m)      pthread_mutex_lock(&(m))
+#define MUTEX_UNLOCK(m)    pthread_mutex_unlock(&(m))
+#define COND_INIT(c)       pthread_cond_init(&(c), NULL)
+#define COND_WAIT(c, m)    pthread_cond_wait(&(c), &(m))
+#define COND_BROADCAST(c)  pthread_cond_broadcast(&(c))
+#define MUTEX_DESTROY(m)   pthread_mutex_destroy(&(m))
+#define COND_DESTROY(c)    pthread_cond_destroy(&(c))
+#define THREAD_FUNC(name)  void *name (void *arg)
+#define THREAD_CREATE(t, func, arg)  pthread_create(&(t), NULL, func, arg)                                    // nonzero if failed
+#define THREAD_JOIN(t)     pthread_join(t, NULL)
+#endif
+
+#define MAX_THREADS 256
+
+typedef struct {
+    Mutex         mutex;
+    Cond          cond_start;                                  // signaled when new jobs are submitted
+    Cond          cond_done;                                   // signaled when all jobs are finished
+    HEVCeJobFunc  func;
+    void         *job_arg;
+    int           njobs;
+    int           next_job;                                    // index of the next job to be taken by a thread
+    int           ndone;                                       // number of finished jobs
+    int           nthreads;
+    Thread        threads [MAX_THREADS];
+} ThreadPool;
+
+
+// take jobs from the pool and run them until there is no job left. Must be called with pool->mutex locked
+void runPoolJobs (ThreadPool *pool) {
+    while (pool->next_job < pool->njobs) {
+        const int job_idx = pool->next_job ++;
+        MUTEX_UNLOCK(pool->mutex);
+        pool->func(pool->job_arg, job_idx);
+        MUTEX_LOCK(pool->mutex);
+        if (++ pool->ndone == pool->njobs)
+            COND_BROADCAST(pool->cond_done);
+    }
+}
+
+
+THREAD_FUNC(poolThread) {
+    ThreadPool *pool = (ThreadPool *)arg;
+    MUTEX_LOCK(pool->mutex);
+    for (;;) {                                                 // worker threads live as long as the process
+        runPoolJobs(pool);
+        COND_WAIT(pool->cond_start, pool->mutex);
+    }
+    return 0;
+}
+
+
+void poolParallelFor (void *ppool, HEVCeJobFunc func, void *job_arg, int njobs) {
+    ThreadPool *pool = (ThreadPool *)ppool;
+    MUTEX_LOCK(pool->mutex);
+    pool->func     = func;
+    pool->job_arg  = job_arg;
+    pool->njobs    = njobs;
+    pool->next_job = 0;
+    pool->ndone    = 0;
+    COND_BROADCAST(pool->cond_start);
+    runPoolJobs(pool);                                         // the calling thread also runs jobs
+    while (pool->ndone < pool->njobs)
+        COND_WAIT(pool->cond_done, pool->mutex);
+    MUTEX_UNLOCK(pool->mutex);
+}
+
+
 // return:   -1:failed   0:success
-int loadPGMfile (const char *filename, unsigned char *img_buffer, int *ysz, int *xsz, int *pix_max_val) {
+int startThreadPool (ThreadPool *pool, int nthreads) {
     int i;
-    FILE *fp;
+    MUTEX_INIT(pool->mutex);
+    COND_INIT(pool->cond_start);
+    COND_INIT(pool->cond_done);
+    pool->njobs    = 0;
+    pool->next_job = 0;
+    pool->ndone    = 0;
+    pool->nthreads = nthreads;
+    for (i=1; i<nthreads; i++)                                 // the calling thread is the 1st thread, so only (nthreads-1) threads are created
+        if ( THREAD_CREATE(pool->threads[i], poolThread, pool) )
+            return -1;
+    return 0;
+}
+
+
+
+#define PIX_MAX_VALUE  ((1<<HEVCE_BIT_DEPTH)-1)
+
+
+// a PGM image loaded from a file. The pixels are either in a read-only mapping of the file (zero-copy, the pixel payload is already packed as the encoder needs), or in a malloc'ed buffer.
+// The 8-bit build accepts 8-bit PGM (maxval <= 255) only. The high bit depth build also accepts 16-bit PGM (big-endian, maxval <= PIX_MAX_VALUE), and the pixels of fewer bits are shifted up to HEVCE_BIT_DEPTH
+typedef struct {
+    const HEVCePixel    *img;                                  // the pixels, height=ysz, width=xsz
+    int                  ysz, xsz, pix_max_val;
+    void                *map;                                  // the mapping of the whole file, or NULL if img is malloc'ed
+    size_t               map_len;
+} PGMImage;
+
+
+// read a decimal number of the PGM header, skipping the whitespaces and the '#' comments (to the end of line) before it. return:   -1:failed   0:success
+int readPGMheaderInt (FILE *fp, int *val) {
+    int c = fgetc(fp);
+    
+    for (;;) {
+        if (c == '#')
+            while (c != '\n' && c != '\r' && c != EOF)
+                c = fgetc(fp);
+        else if (c == ' ' || c == '\n' || c == '\r' || c == '\t')
+            c = fgetc(fp);
+        else
+            break;
+    }
+    
+    if (c < '0' || c > '9')
+        return -1;
+    
+    for (*val=0; c>='0' && c<='9'; c=fgetc(fp)) {
+        if (*val > 99999999)                                   // too large
+            return -1;
+        *val = *val * 10 + (c - '0');
+    }
+    
+    ungetc(c, fp);                                             // the character after the number is kept for the next read
+    return 0;
+}
+
+
+// map the pixel payload of the opened file (which starts at offset), so that the image is not copied. return:   -1:failed (then the caller reads the file)   0:success
+int mapPGMpayload (FILE *fp, long offset, size_t len, PGMImage *pgm) {
+#ifdef _WIN32
+    HANDLE         hfile = (HANDLE)_get_osfhandle(_fileno(fp));
+    HANDLE         hmap;
+    LARGE_INTEGER  fsize;
+    if ( hfile == INVALID_HANDLE_VALUE || !GetFileSizeEx(hfile, &fsize) || (unsigned long long)fsize.QuadPart < offset + len )
+        return -1;
+    if ( (hmap = CreateFileMappingA(hfile, NULL, PAGE_READONLY, 0, 0, NULL)) == NULL )
+        return -1;
+    pgm->map = MapViewOfFile(hmap, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(hmap);                                         // the view keeps the mapping
+    if (pgm->map == NULL)
+        return -1;
+    pgm->map_len = (size_t)fsize.QuadPart;
+#else
+    struct stat st;
+    void *map;
+    if ( fstat(fileno(fp), &st) || !S_ISREG(st.st_mode) || (unsigned long long)st.st_size < offset + len )
+        return -1;
+    if ( (map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0)) == MAP_FAILED )
+        return -1;
+    posix_madvise(map, (size_t)st.st_size, POSIX_MADV_WILLNEED);   // start reading the pages ahead, so that the encoder rarely waits for page faults
+    pgm->map     = map;
+    pgm->map_len = (size_t)st.st_size;
+#endif
+    pgm->img = (const HEVCePixel *)((const char *)pgm->map + offset);
+    return 0;
+}
+
+
+void freePGMimage (PGMImage *pgm) {
+    if (pgm->map != NULL) {
+#ifdef _WIN32
+        UnmapViewOfFile(pgm->map);
+#else
+        munmap(pgm->map, pgm->map_len);
+#endif
+    } else {
+        free((void *)pgm->img);
+    }
+    pgm->img = NULL;
+    pgm->map = NULL;
+}
+
+
+// return:   -1:failed   0:success
+int loadPGMfile (const char *filename, PGMImage *pgm) {        // the pixels are mapped or allocated here (after the image size is known), the caller should call freePGMimage
+    HEVCePixel    *img_buffer;
+    size_t len, i;
+    long   offset;
+    int    c, sample_bytes, depth, sft;
+    FILE  *fp;
 
-    *ysz = *xsz = *pix_max_val = -1;
+    pgm->img = NULL;
+    pgm->map = NULL;
+    pgm->ysz = pgm->xsz = pgm->pix_max_val = -1;
     
     if ( (fp = fopen(filename, "rb")) == NULL )
         return -1;
 
-    if ( fgetc(fp) != 'P' ) {
+    if ( fgetc(fp) != 'P' || fgetc(fp) != '5' ) {
         fclose(fp);
         return -1;
     }
-    
-    if ( fgetc(fp) != '5' ) {
+
+    if ( readPGMheaderInt(fp, &pgm->xsz) || readPGMheaderInt(fp, &pgm->ysz) || readPGMheaderInt(fp, &pgm->pix_max_val) ) {
         fclose(fp);
         return -1;
     }
 
-    if ( fscanf(fp, "%d", xsz) < 1 ) {
+    if ( pgm->pix_max_val > PIX_MAX_VALUE || pgm->pix_max_val < 1 || pgm->xsz < 1 || pgm->ysz < 1 ) {
         fclose(fp);
         return -1;
     }
     
-    if ( fscanf(fp, "%d", ysz) < 1 ) {
+    sample_bytes = (pgm->pix_max_val > 255) ? 2 : 1;           // PGM uses 2 bytes (big-endian) for each sample when maxval > 255
+    for (depth=8; (pgm->pix_max_val >> depth) > 0; depth++);   // the bit depth of the samples : 8 for the 8-bit PGM, or the bits of maxval for the 16-bit PGM
+    sft = HEVCE_BIT_DEPTH - depth;                             // the samples are shifted up to HEVCE_BIT_DEPTH
+    
+    c = fgetc(fp);                                             // a single whitespace between the header and the pixels
+    if ( c != ' ' && c != '\n' && c != '\r' && c != '\t') {
         fclose(fp);
         return -1;
     }
 
-    if ( fscanf(fp, "%d", pix_max_val) < 1 ) {
+    len    = (size_t)pgm->xsz * pgm->ysz;
+    offset = ftell(fp);
+    
+    if ( sample_bytes == (int)sizeof(HEVCePixel) && sizeof(HEVCePixel) == 1 && offset >= 0 && mapPGMpayload(fp, offset, len, pgm) == 0 ) {   // zero-copy, only when the samples are 8-bit pixels
         fclose(fp);
-        return -1;
+        return 0;
     }
-
-    if ( *pix_max_val > 255 ) {
+    
+    if ( (img_buffer = (HEVCePixel *)malloc(len * sizeof(HEVCePixel))) == NULL ) {
         fclose(fp);
         return -1;
     }
     
-    i = fgetc(fp);
-    if ( i != ' ' && i != '\n' && i != '\r' && i != '\t') {
+    pgm->img = img_buffer;
+    
+    if ( fread(img_buffer, sample_bytes, len, fp) != len ) {  // pixels not enough
         fclose(fp);
+        freePGMimage(pgm);
         return -1;
     }
-
-    for (i=(*xsz)*(*ysz); i>0; i--) {
-        if (feof(fp)) {                                        // pixels not enough
-            fclose(fp);
-            return -1;
-        }
-        *(img_buffer++) = (unsigned char)fgetc(fp);
+    
+    if (sizeof(HEVCePixel) > 1) {                              // convert the samples to pixels in place, from the end since the 8-bit samples are shorter than the pixels
+        const unsigned char *samples = (const unsigned char *)img_buffer;
+        for (i=len; i>0; i--)
+            img_buffer[i-1] = (HEVCePixel)( ((sample_bytes == 2) ? (samples[2*i-2] << 8 | samples[2*i-1]) : samples[i-1]) << sft );
     }
 
     fclose(fp);
@@ -65,55 +290,66 @@ int loadPGMfile (const char *filename, unsigned char *img_buffer, int *ysz, int
 
 
 
-// return:   -1:failed   0:success
-int writePGMfile (const char *filename, const unsigned char *img_buffer, const int ysz, const int xsz) {
-    int i;
-    FILE *fp;
-    
-    if ( (fp = fopen(filename, "wb")) == NULL )
-        return -1;
+// print why loadPGMfile failed : the maxval is larger than this build supports (then suggest the high bit depth build), or the file can not be opened or parsed
+void printLoadError (const char *filename, const PGMImage *pgm) {
+    if ( pgm->pix_max_val > PIX_MAX_VALUE )
+        printf("the maxval of %s is %d, larger than %d. Build with -DHEVCE_BIT_DEPTH=10 or 12 for the high bit depth images\n", filename, pgm->pix_max_val, PIX_MAX_VALUE);
+    else
+        printf("open %s failed\n", filename);
+}
 
-    if (fprintf(fp, "P5\n%d %d\n255\n", xsz, ysz) <= 0) {
-        fclose(fp);
-        return -1;
-    }
 
-    for (i=xsz*ysz; i>0; i--) {
-        if ( fputc( *(img_buffer++) , fp) == EOF ) {
-            fclose(fp);
+
+// return:   -1:failed   0:success
+int writePGMfile (const char *filename, const HEVCePixel *img_buffer, const int ysz, const int xsz) {     // the high bit depth pixels are written as 16-bit PGM (maxval = PIX_MAX_VALUE)
+    const size_t len = (size_t)xsz * ysz;
+    unsigned char *be_buffer = NULL;                           // the big-endian samples of the 16-bit PGM
+    const void    *samples   = img_buffer;
+    size_t i;
+    int    ret = -1;
+    FILE  *fp;
+    
+    if (sizeof(HEVCePixel) > 1) {
+        if ( (be_buffer = (unsigned char *)malloc(len * 2)) == NULL )
             return -1;
+        for (i=0; i<len; i++) {
+            be_buffer[2*i]   = (unsigned char)(img_buffer[i] >> 8);
+            be_buffer[2*i+1] = (unsigned char)(img_buffer[i] & 0xFF);
         }
+        samples = be_buffer;
     }
-
-    fclose(fp);
-    return 0;
+    
+    if ( (fp = fopen(filename, "wb")) != NULL ) {
+        if ( fprintf(fp, "P5\n%d %d\n%d\n", xsz, ysz, PIX_MAX_VALUE) > 0 && fwrite(samples, sizeof(HEVCePixel), len, fp) == len )
+            ret = 0;
+        if ( fclose(fp) )
+            ret = -1;
+    }
+    
+    free(be_buffer);
+    return ret;
 }
 
 
 
 // return:   -1:failed   0:success
 int writeBytesToFile (const char *filename, const unsigned char *buffer, const int len) {
-    const unsigned char *buffer_end_ptr = buffer + len;
-    
     FILE *fp;
     
     if ( (fp = fopen(filename, "wb")) == NULL )
         return -1;
 
-    for (; buffer<buffer_end_ptr; buffer++) {
-        if ( fputc( *buffer , fp) == EOF ) {
-            fclose(fp);
-            return -1;
-        }
+    if ( fwrite(buffer, 1, len, fp) != (size_t)len ) {
+        fclose(fp);
+        return -1;
     }
 
-    fclose(fp);
-    return 0;
+    return fclose(fp) ? -1 : 0;
 }
 
 
 
-double calcImagePSNR (const unsigned char *buffer1, const int ysz1, const int xsz1, const unsigned char *buffer2, const int ysz2, const int xsz2, double *mse) {
+double calcImagePSNR (const HEVCePixel *buffer1, const int ysz1, const int xsz1, const HEVCePixel *buffer2, const int ysz2, const int xsz2, double *mse) {
     const int ymin = (ysz1 < ysz2) ? ysz1 : ysz2;
     const int xmin = (xsz1 < xsz2) ? xsz1 : xsz2;
     long long diff, sse = 0ULL;
@@ -129,7 +365,599 @@ double calcImagePSNR (const unsigned char *buffer1, const int ysz1, const int xs
     *mse = ((double)sse) / ymin / xmin;
     if ( *mse < 1e-9 )
         *mse = 1e-9;
-    return  10.0 * log10( 255*255 / (*mse) );
+    return  10.0 * log10( (double)PIX_MAX_VALUE*PIX_MAX_VALUE / (*mse) );
+}
+
+
+
+
+// batch mode : encode all the PGM files of a directory (or listed in a text file, one per line) in one process -----------------------------------------------------
+//   a loader thread reads the images ahead, N worker threads encode them (each worker has its own context, reused for all its images),
+//   and the main thread writes the streams and prints the results in the order of the files, so that loading and writing overlap with encoding
+
+#define BATCH_NAME_LEN   4096
+
+#define ITEM_WAIT        0                                     // not loaded yet
+#define ITEM_LOADED      1                                     // loaded (or failed to load, then pgm.img=NULL), waiting for a worker
+#define ITEM_ENCODED     2                                     // encoded (or failed, then stream_len<0), waiting for the writer
+
+
+double getSeconds () {                                         // a monotonic wall clock, for measuring the throughput
+#ifdef _WIN32
+    LARGE_INTEGER freq, cnt;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&cnt);
+    return (double)cnt.QuadPart / freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+
+typedef struct {
+    char           fname [BATCH_NAME_LEN];
+    int            state;
+    PGMImage       pgm;                                        // the original image, loaded by the loader, freed by the writer
+    signed char   *qp_offsets;                                 // (adaptive quantization) the QP offsets of the CTUs, analyzed by the loader ahead of the encoding, freed by the writer
+    int            yszn, xszn;                                 // padded image size
+    unsigned char *stream;                                     // the HEVC stream, allocated by the worker (with its exact length), freed by the writer
+    int            stream_len;
+    int            qp;                                         // the QP of the stream (chosen by the rate control, or the QP of the config)
+    double         psnr;
+    double         seconds;                                    // the time of HEVCeEncode
+} BatchItem;
+
+
+typedef struct {
+    Mutex          mutex;
+    Cond           cond;                                       // signaled when the state of any item changes
+    HEVCeConfig    cfg;
+    BatchItem     *items;
+    int            nitems;
+    int            max_ahead;                                  // the max number of items which are loaded but not written yet, so that the memory is bounded
+    int            n_taken;                                    // number of items taken by the workers
+    int            n_written;                                  // number of items written by the writer
+    int            stop;                                       // set when the batch can not be started (see stopBatch), then the loader and the workers quit
+} BatchJobs;
+
+
+int compareNames (const void *a, const void *b) {
+    return strcmp(((const BatchItem *)a)->fname, ((const BatchItem *)b)->fname);
+}
+
+
+int isPGMname (const char *name) {
+    const int len = (int)strlen(name);
+    return len > 4 && name[len-4] == '.' && (name[len-3] | 0x20) == 'p' && (name[len-2] | 0x20) == 'g' && (name[len-1] | 0x20) == 'm';   // case-insensitive ".pgm"
+}
+
+
+// add a file name to the batch, the item array grows when needed. return:   -1:failed   0:success
+int addBatchItem (BatchJobs *batch, int *capacity, const char *dir, const char *name) {
+    BatchItem *item;
+    if (batch->nitems >= *capacity) {
+        BatchItem *items = (BatchItem *)realloc(batch->items, sizeof(BatchItem) * (*capacity*2 + 16));
+        if (items == NULL)
+            return -1;
+        batch->items = items;
+        *capacity    = *capacity*2 + 16;
+    }
+    item = &batch->items[batch->nitems++];
+    memset(item, 0, sizeof(BatchItem));
+    if (dir != NULL)
+        snprintf(item->fname, BATCH_NAME_LEN, "%s/%s", dir, name);
+    else
+        snprintf(item->fname, BATCH_NAME_LEN, "%s", name);
+    return 0;
+}
+
+
+// get the input files : the PGM files in the directory (sorted by name), or the lines of a list file. return:   -1:failed   0:success
+int listBatchFiles (BatchJobs *batch, const char *path) {
+    char line [BATCH_NAME_LEN];
+    int  capacity = 0;
+    FILE *fp;
+    
+#ifdef _WIN32
+    const DWORD attr = GetFileAttributesA(path);
+    if (attr != INVALID_FILE_ATTRIBUTES && (attr & FILE_ATTRIBUTE_DIRECTORY)) {
+        WIN32_FIND_DATAA fd;
+        HANDLE h;
+        snprintf(line, BATCH_NAME_LEN, "%s\\*", path);
+        if ( (h = FindFirstFileA(line, &fd)) == INVALID_HANDLE_VALUE )
+            return -1;
+        do {
+            if ( !(fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && isPGMname(fd.cFileName) && addBatchItem(batch, &capacity, path, fd.cFileName) ) {
+                FindClose(h);
+                return -1;
+            }
+        } while (FindNextFileA(h, &fd));
+        FindClose(h);
+        qsort(batch->items, batch->nitems, sizeof(BatchItem), compareNames);
+        return 0;
+    }
+#else
+    DIR *dir = opendir(path);
+    if (dir != NULL) {
+        struct dirent *ent;
+        while ( (ent = readdir(dir)) != NULL ) {
+            if ( isPGMname(ent->d_name) && addBatchItem(batch, &capacity, path, ent->d_name) ) {
+                closedir(dir);
+                return -1;
+            }
+        }
+        closedir(dir);
+        qsort(batch->items, batch->nitems, sizeof(BatchItem), compareNames);
+        return 0;
+    }
+#endif
+    
+    if ( (fp = fopen(path, "r")) == NULL )                     // not a directory : a list file
+        return -1;
+    
+    while ( fgets(line, BATCH_NAME_LEN, fp) != NULL ) {
+        int len = (int)strlen(line);
+        while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r' || line[len-1] == ' ' || line[len-1] == '\t'))
+            line[--len] = '\0';                                // remove the line ending and the trailing spaces
+        if ( len > 0 && addBatchItem(batch, &capacity, NULL, line) ) {
+            fclose(fp);
+            return -1;
+        }
+    }
+    
+    fclose(fp);
+    return 0;
+}
+
+
+THREAD_FUNC(batchLoaderThread) {
+    BatchJobs *batch = (BatchJobs *)arg;
+    int i;
+    
+    for (i=0; i<batch->nitems; i++) {
+        BatchItem *item = &batch->items[i];
+        
+        MUTEX_LOCK(batch->mutex);
+        while (!batch->stop && i - batch->n_written >= batch->max_ahead)   // too many images in memory : wait for the writer
+            COND_WAIT(batch->cond, batch->mutex);
+        if (batch->stop) {
+            MUTEX_UNLOCK(batch->mutex);
+            break;
+        }
+        MUTEX_UNLOCK(batch->mutex);
+        
+        loadPGMfile(item->fname, &item->pgm);                  // pgm.img=NULL if failed
+        
+        if (item->pgm.img != NULL && batch->cfg.aq_strength != 0) {                                       // run the analysis here, so that the workers only encode
+            item->qp_offsets = (signed char *)malloc((size_t)HEVCE_PADDED_SIZE(item->pgm.ysz)/32 * (HEVCE_PADDED_SIZE(item->pgm.xsz)/32));
+            if (item->qp_offsets != NULL)
+                HEVCeAnalyze(item->pgm.img, item->pgm.xsz, item->pgm.ysz, item->pgm.xsz, batch->cfg.aq_strength, item->qp_offsets);
+        }
+        
+        MUTEX_LOCK(batch->mutex);
+        item->state = ITEM_LOADED;
+        COND_BROADCAST(batch->cond);
+        MUTEX_UNLOCK(batch->mutex);
+    }
+    
+    return 0;
+}
+
+
+THREAD_FUNC(batchWorkerThread) {
+    BatchJobs *batch = (BatchJobs *)arg;
+    
+    HEVCeContext  *ctx           = NULL;                       // the encoder context of this worker, recreated only when an image is larger than all the previous ones
+    void          *arena         = NULL;
+    HEVCePixel    *img_rcon      = NULL;
+    unsigned char *stream_buffer = NULL;
+    int ysz_max = 0, xsz_max = 0;
+    
+    for (;;) {
+        BatchItem *item;
+        double     mse, t0;
+        
+        MUTEX_LOCK(batch->mutex);
+        if (batch->stop || batch->n_taken >= batch->nitems) {
+            MUTEX_UNLOCK(batch->mutex);
+            break;
+        }
+        item = &batch->items[batch->n_taken++];
+        while (!batch->stop && item->state != ITEM_LOADED)
+            COND_WAIT(batch->cond, batch->mutex);
+        if (batch->stop) {
+            MUTEX_UNLOCK(batch->mutex);
+            break;
+        }
+        MUTEX_UNLOCK(batch->mutex);
+        
+        item->stream_len = -1;
+        
+        if (item->pgm.img != NULL && (item->pgm.ysz > ysz_max || item->pgm.xsz > xsz_max)) { // grow the context and the buffers
+            int arena_size;
+            
+            if (ctx != NULL)
+                HEVCeDestroy(ctx);
+            free(arena);
+            free(img_rcon);
+            free(stream_buffer);
+            ctx = NULL;
+            
+            ysz_max    = (item->pgm.ysz > ysz_max) ? item->pgm.ysz : ysz_max;
+            xsz_max    = (item->pgm.xsz > xsz_max) ? item->pgm.xsz : xsz_max;
+            arena_size = HEVCeContextSize(ysz_max, xsz_max, &batch->cfg);
+            
+            if ( arena_size < 0 || HEVCeMaxStreamLength(ysz_max, xsz_max) < 0 ) {
+                arena         = NULL;
+                img_rcon      = NULL;
+                stream_buffer = NULL;
+            } else {
+                arena         = malloc(arena_size);
+                img_rcon      = (HEVCePixel *)malloc((size_t)HEVCE_PADDED_SIZE(ysz_max) * HEVCE_PADDED_SIZE(xsz_max) * sizeof(HEVCePixel));
+                stream_buffer = (unsigned char *)malloc(HEVCeMaxStreamLength(ysz_max, xsz_max));
+                if (arena != NULL && img_rcon != NULL && stream_buffer != NULL)
+                    ctx = HEVCeCreate(&batch->cfg, ysz_max, xsz_max, arena, arena_size);
+            }
+            
+            if (ctx == NULL)
+                ysz_max = xsz_max = 0;                         // failed, try again for the next image
+        }
+        
+        if (item->pgm.img != NULL && ctx != NULL) {
+            item->yszn = item->pgm.ysz;
+            item->xszn = item->pgm.xsz;
+            
+            t0 = getSeconds();
+            HEVCeSetQPOffsets(ctx, item->qp_offsets);          // NULL if the analysis failed, then HEVCeEncode analyzes the image itself
+            item->stream_len = HEVCeEncode(ctx, stream_buffer, item->pgm.img, item->pgm.xsz, img_rcon, HEVCE_PADDED_SIZE(item->pgm.xsz), &item->yszn, &item->xszn);
+            item->seconds    = getSeconds() - t0;
+            item->qp         = HEVCeGetQP(ctx);
+            
+            if (item->stream_len >= 0) {
+                item->psnr = calcImagePSNR(item->pgm.img, item->pgm.ysz, item->pgm.xsz, img_rcon, item->yszn, item->xszn, &mse);
+                if ( (item->stream = (unsigned char *)malloc(item->stream_len > 0 ? item->stream_len : 1)) != NULL )
+                    memcpy(item->stream, stream_buffer, item->stream_len);
+                else
+                    item->stream_len = -1;
+            }
+        }
+        
+        MUTEX_LOCK(batch->mutex);
+        item->state = ITEM_ENCODED;
+        COND_BROADCAST(batch->cond);
+        MUTEX_UNLOCK(batch->mutex);
+    }
+    
+    if (ctx != NULL)
+        HEVCeDestroy(ctx);
+    free(arena);
+    free(img_rcon);
+    free(stream_buffer);
+    
+    return 0;
+}
+
+
+// stop the loader and the started workers when the batch can not be started, wait for them, and free all the items
+void stopBatch (BatchJobs *batch, Thread *loader, Thread *workers, int nworkers) {
+    int i;
+    
+    MUTEX_LOCK(batch->mutex);
+    batch->stop = 1;
+    COND_BROADCAST(batch->cond);
+    MUTEX_UNLOCK(batch->mutex);
+    
+    if (loader != NULL)
+        THREAD_JOIN(*loader);
+    for (i=0; i<nworkers; i++)
+        THREAD_JOIN(workers[i]);
+    
+    for (i=0; i<batch->nitems; i++) {                          // the items which are loaded or encoded but not written yet
+        freePGMimage(&batch->items[i].pgm);
+        free(batch->items[i].stream);
+        free(batch->items[i].qp_offsets);
+    }
+    
+    free(batch->items);
+    batch->items  = NULL;
+    batch->nitems = 0;
+    MUTEX_DESTROY(batch->mutex);
+    COND_DESTROY(batch->cond);
+}
+
+
+// return:   number of failed files, or -1 if the batch can not be started
+int encodeBatch (const char *in_path, const char *out_dir, const HEVCeConfig *cfg, int nworkers) {
+    Thread    workers [MAX_THREADS];
+    BatchJobs batch;
+    Thread    loader;
+    char   out_fname [BATCH_NAME_LEN+16];
+    double t_start, t_total;
+    double sum_psnr = 0.0, sum_pixels = 0.0, sum_pixels_padded = 0.0, sum_bytes = 0.0;
+    int    i, n_ok = 0, n_fail = 0;
+    
+    memset(&batch, 0, sizeof(batch));
+    MUTEX_INIT(batch.mutex);
+    COND_INIT(batch.cond);
+    batch.cfg              = *cfg;
+    batch.cfg.parallel_for = NULL;                             // each worker encodes its images in its own thread, the parallelism is across images
+    batch.max_ahead        = 2 * nworkers + 1;
+    
+    if ( listBatchFiles(&batch, in_path) ) {
+        printf("list %s failed\n", in_path);
+        free(batch.items);
+        MUTEX_DESTROY(batch.mutex);
+        COND_DESTROY(batch.cond);
+        return -1;
+    }
+    
+    printf("batch: %d files, %d workers\n", batch.nitems, nworkers);
+    
+    t_start = getSeconds();
+    
+    if ( THREAD_CREATE(loader, batchLoaderThread, &batch) ) {
+        printf("create threads failed\n");
+        stopBatch(&batch, NULL, workers, 0);
+        return -1;
+    }
+    
+    for (i=0; i<nworkers; i++) {
+        if ( THREAD_CREATE(workers[i], batchWorkerThread, &batch) ) {
+            printf("create threads failed\n");
+            stopBatch(&batch, &loader, workers, i);
+            return -1;
+        }
+    }
+    
+    for (i=0; i<batch.nitems; i++) {                           // the main thread is the writer
+        BatchItem  *item = &batch.items[i];
+        const char *name = item->fname, *p;
+        int         name_len;
+        
+        MUTEX_LOCK(batch.mutex);
+        while (item->state != ITEM_ENCODED)
+            COND_WAIT(batch.cond, batch.mutex);
+        MUTEX_UNLOCK(batch.mutex);
+        
+        for (p=item->fname; *p; p++)                           // the output file name : <out_dir>/<the input file name without directory and .pgm>.hevc
+            if (*p == '/' || *p == '\\')
+                name = p + 1;
+        name_len = (int)strlen(name) - (isPGMname(name) ? 4 : 0);
+        snprintf(out_fname, sizeof(out_fname), "%s/%.*s.hevc", out_dir, name_len, name);
+        
+        if (item->pgm.img == NULL) {
+            printf("  ");
+            printLoadError(item->fname, &item->pgm);
+            n_fail ++;
+        } else if (item->stream_len < 0) {
+            printf("  %-40s  encode failed\n", item->fname);
+            n_fail ++;
+        } else if ( writeBytesToFile(out_fname, item->stream, item->stream_len) ) {
+            printf("  %-40s  write %s failed\n", item->fname, out_fname);
+            n_fail ++;
+        } else {
+            const double pixels = (double)item->pgm.ysz * item->pgm.xsz;
+            printf("  %-40s  %5d x %-5d  QP %2d  %9d Bytes  %.5f bpp  %.4f dB  %8.2f MP/s\n", item->fname, item->pgm.xsz, item->pgm.ysz, item->qp, item->stream_len, 8.0*item->stream_len/((double)item->xszn*item->yszn), item->psnr, pixels/1e6/(item->seconds > 1e-9 ? item->seconds : 1e-9));
+            sum_psnr          += item->psnr;
+            sum_pixels        += pixels;
+            sum_pixels_padded += (double)item->xszn * item->yszn;
+            sum_bytes         += item->stream_len;
+            n_ok ++;
+        }
+        
+        freePGMimage(&item->pgm);
+        free(item->stream);
+        free(item->qp_offsets);
+        item->stream     = NULL;
+        item->qp_offsets = NULL;
+        
+        MUTEX_LOCK(batch.mutex);
+        batch.n_written ++;
+        COND_BROADCAST(batch.cond);
+        MUTEX_UNLOCK(batch.mutex);
+    }
+    
+    THREAD_JOIN(loader);
+    for (i=0; i<nworkers; i++)
+        THREAD_JOIN(workers[i]);
+    
+    t_total = getSeconds() - t_start;
+    
+    printf("total:\n");
+    printf("  files (encoded / failed)        = %d / %d\n" , n_ok, n_fail);
+    printf("  pixels                          = %.3f MP\n" , sum_pixels/1e6);
+    printf("  compressed length               = %.0f Bytes\n" , sum_bytes);
+    printf("  time                            = %.3f s\n" , t_total);
+    printf("  throughput                      = %.2f MP/s\n" , sum_pixels/1e6/(t_total > 1e-9 ? t_total : 1e-9));
+    if (n_ok > 0) {
+        printf("  bits per pixel                  = %.5f\n" , 8.0*sum_bytes/sum_pixels_padded);
+        printf("  mean PSNR                       = %.4lf dB\n" , sum_psnr/n_ok);
+    }
+    
+    free(batch.items);
+    MUTEX_DESTROY(batch.mutex);
+    COND_DESTROY(batch.cond);
+    
+    return n_fail;
+}
+
+
+
+
+// multi-QP mode : encode one image at several QPs at the same time, each QP in its own thread with its own context, and each to its own file -----------------------
+//   the image is loaded once, and the adaptive quantization analysis (the only QP-independent analysis) is done once and shared by all QPs.
+//   the mode decisions can not be shared, since the intra prediction (and so the SATD ranking) uses the reconstructed pixels of each QP. Each stream is the same as a single-QP run
+
+#define MAX_QPS  16
+
+typedef struct {
+    const PGMImage    *pgm;
+    HEVCeConfig        cfg;                                    // the config of this QP
+    const signed char *qp_offsets;                             // the shared QP offsets of the CTUs, or NULL
+    HEVCePixel        *img_rcon;
+    unsigned char     *stream;
+    int                stream_len;                             // -1 if failed
+    int                yszn, xszn;                             // padded image size
+    double             psnr;
+    double             seconds;                                // the time of HEVCeEncode
+} QPJob;
+
+
+THREAD_FUNC(multiQPThread) {
+    QPJob *job = (QPJob *)arg;
+    
+    const int ysz = job->pgm->ysz;
+    const int xsz = job->pgm->xsz;
+    const int arena_size = HEVCeContextSize(ysz, xsz, &job->cfg);
+    
+    HEVCeContext *ctx;
+    void         *arena = NULL;
+    double        mse, t0;
+    
+    job->stream_len = -1;
+    
+    if ( arena_size >= 0 && HEVCeMaxStreamLength(ysz, xsz) >= 0 ) {
+        arena         = malloc(arena_size);
+        job->img_rcon = (HEVCePixel *)malloc((size_t)HEVCE_PADDED_SIZE(ysz) * HEVCE_PADDED_SIZE(xsz) * sizeof(HEVCePixel));
+        job->stream   = (unsigned char *)malloc(HEVCeMaxStreamLength(ysz, xsz));
+    }
+    
+    if ( arena != NULL && job->img_rcon != NULL && job->stream != NULL && (ctx = HEVCeCreate(&job->cfg, ysz, xsz, arena, arena_size)) != NULL ) {
+        job->yszn = ysz;
+        job->xszn = xsz;
+        
+        t0 = getSeconds();
+        HEVCeSetQPOffsets(ctx, job->qp_offsets);
+        job->stream_len = HEVCeEncode(ctx, job->stream, job->pgm->img, xsz, job->img_rcon, HEVCE_PADDED_SIZE(xsz), &job->yszn, &job->xszn);
+        job->seconds    = getSeconds() - t0;
+        
+        if (job->stream_len >= 0)
+            job->psnr = calcImagePSNR(job->pgm->img, ysz, xsz, job->img_rcon, job->yszn, job->xszn, &mse);
+        
+        HEVCeDestroy(ctx);
+    }
+    
+    free(arena);
+    return 0;
+}
+
+
+// insert "_qp<qp>" before the extension of fname, for example : 01.hevc -> 01_qp22.hevc
+void makeQPFileName (char *buf, int buf_len, const char *fname, int qp) {
+    const char *ext = NULL, *p;
+    for (p=fname; *p; p++)
+        if (*p == '.')
+            ext = p;
+        else if (*p == '/' || *p == '\\')
+            ext = NULL;                                        // a dot in the directory is not an extension
+    if (ext == NULL)
+        ext = fname + strlen(fname);
+    snprintf(buf, buf_len, "%.*s_qp%d%s", (int)(ext-fname), fname, qp, ext);
+}
+
+
+// parse a QP list like "22,27,32" to qps (at most MAX_QPS QPs, each clipped to 0~51). return: the number of QPs
+int parseQPList (const char *str, int *qps) {
+    int n = 0;
+    while (n < MAX_QPS && *str) {
+        qps[n] = atoi(str);
+        qps[n] = qps[n] < 0 ? 0 : qps[n] > 51 ? 51 : qps[n];
+        n ++;
+        while (*str && *str != ',')
+            str ++;
+        if (*str == ',')
+            str ++;
+    }
+    return n;
+}
+
+
+// return:   number of failed QPs, or -1 if the image can not be loaded
+int encodeMultiQP (const char *in_fname, const char *out_fname, const char *out_rcon_fname, const HEVCeConfig *cfg, const int *qps, int nqps) {
+    Thread       threads [MAX_QPS];
+    QPJob        jobs    [MAX_QPS];
+    PGMImage     pgm;
+    signed char *qp_offsets = NULL;
+    char         fname [BATCH_NAME_LEN+16];
+    double       t_start, t_total, sum_seconds = 0.0;
+    int          i, n_fail = 0;
+    
+    t_start = getSeconds();
+    
+    if ( loadPGMfile(in_fname, &pgm) ) {                       // load once for all QPs
+        printLoadError(in_fname, &pgm);
+        return -1;
+    }
+    
+    printf("multi-QP: %s  %d x %d  %d QPs\n", in_fname, pgm.xsz, pgm.ysz, nqps);
+    
+    if (cfg->aq_strength != 0) {                               // analyze once for all QPs
+        qp_offsets = (signed char *)malloc((size_t)HEVCE_PADDED_SIZE(pgm.ysz)/32 * (HEVCE_PADDED_SIZE(pgm.xsz)/32));
+        if (qp_offsets != NULL)
+            HEVCeAnalyze(pgm.img, pgm.xsz, pgm.ysz, pgm.xsz, cfg->aq_strength, qp_offsets);
+    }
+    
+    for (i=0; i<nqps; i++) {
+        memset(&jobs[i], 0, sizeof(QPJob));
+        jobs[i].pgm              = &pgm;
+        jobs[i].cfg              = *cfg;
+        jobs[i].cfg.qp           = qps[i];
+        jobs[i].cfg.target_bytes = jobs[i].cfg.target_bpp_x1000 = 0;      // the QPs are given, no rate control
+        jobs[i].cfg.parallel_for = NULL;                       // each QP is encoded in its own thread, the parallelism is across QPs
+        jobs[i].qp_offsets       = qp_offsets;
+        if ( THREAD_CREATE(threads[i], multiQPThread, &jobs[i]) ) {
+            printf("create threads failed\n");
+            while (i-- > 0) {                                  // wait for the started QPs, and drop their results
+                THREAD_JOIN(threads[i]);
+                free(jobs[i].img_rcon);
+                free(jobs[i].stream);
+            }
+            free(qp_offsets);
+            freePGMimage(&pgm);
+            return -1;
+        }
+    }
+    
+    for (i=0; i<nqps; i++) {                                   // write the streams in the order of the QPs
+        QPJob *job = &jobs[i];
+        
+        THREAD_JOIN(threads[i]);
+        
+        makeQPFileName(fname, sizeof(fname), out_fname, qps[i]);
+        
+        if (job->stream_len < 0) {
+            printf("  QP %2d  encode failed\n", qps[i]);
+            n_fail ++;
+        } else if ( writeBytesToFile(fname, job->stream, job->stream_len) ) {
+            printf("  QP %2d  write %s failed\n", qps[i], fname);
+            n_fail ++;
+        } else {
+            if (out_rcon_fname != NULL) {
+                makeQPFileName(fname, sizeof(fname), out_rcon_fname, qps[i]);
+                if ( writePGMfile(fname, job->img_rcon, job->yszn, job->xszn) ) {
+                    printf("  QP %2d  write %s failed\n", qps[i], fname);
+                    n_fail ++;
+                }
+            }
+            printf("  QP %2d  %9d Bytes  %.5f bpp  %.4f dB  %.3f s\n", qps[i], job->stream_len, 8.0*job->stream_len/((double)job->xszn*job->yszn), job->psnr, job->seconds);
+            sum_seconds += job->seconds;
+        }
+        
+        free(job->img_rcon);
+        free(job->stream);
+    }
+    
+    t_total = getSeconds() - t_start;
+    
+    printf("total:\n");
+    printf("  time                            = %.3f s  (the sum of the encoding times is %.3f s)\n" , t_total, sum_seconds);
+    
+    free(qp_offsets);
+    freePGMimage(&pgm);
+    
+    return n_fail;
 }
 
 
@@ -137,12 +965,21 @@ double calcImagePSNR (const unsigned char *buffer1, const int ysz1, const int xs
 
 int main (int argc, char **argv) {
 
-    static unsigned char img           [8192*8192];
-    static unsigned char img_rcon      [8192*8192];
-    static unsigned char stream_buffer [8192*8192];
+    static ThreadPool    pool;
+    
+    PGMImage       pgm;
+    const HEVCePixel *img;
+    HEVCePixel    *img_rcon;
+    unsigned char *stream_buffer;                                                                   // all buffers are allocated with the size of the actual image
+    
+    HEVCeConfig   cfg = {0};
+    HEVCeContext *ctx;
+    void *arena;
+    int   arena_size;
 
-    const char *in_img_fname=NULL, *out_img_rcon_fname=NULL, *out_stream_fname=NULL;
-    int i , qpd6=-1 , ysz=-1, xsz=-1, yszn=-1, xszn=-1, pix_max_val=-1, stream_len;
+    const char *in_img_fname=NULL, *out_img_rcon_fname=NULL, *out_stream_fname=NULL, *batch_in=NULL, *batch_out=NULL;
+    int qps [MAX_QPS], nqps=0;
+    int i , qp=-1 , ysz=-1, xsz=-1, yszn=-1, xszn=-1, stream_len, nthreads=1, selfcheck=0;
     double psnr, mse;
 
 
@@ -151,7 +988,35 @@ int main (int argc, char **argv) {
         const char *arg = argv[i];
         
         if ( arg[0] >= '0'  &&  arg[0] <= '4'  &&  arg[1] == '\0' )                                 // arg is a single digit in range '0'~'4'
-            qpd6 = arg[0] - '0';                                                                    //   get quantize parameter
+            qp = (arg[0] - '0') * 6 + 4;                                                            //   get quantize parameter : Qp%6 (QP = 4, 10, 16, 22, 28)
+        else if ( !strcmp(arg, "-qp") && i+1 < argc )
+            qp = atoi(argv[++i]);                                                                   //   get quantize parameter : 0~51
+        else if ( !strcmp(arg, "-qps") && i+1 < argc )
+            nqps = parseQPList(argv[++i], qps);                                                     //   get the QPs of multi-QP mode : <qp>,<qp>,...
+        else if ( !strcmp(arg, "-size") && i+1 < argc )
+            cfg.target_bytes = atoi(argv[++i]);                                                     //   get target stream length (rate control)
+        else if ( !strcmp(arg, "-bpp") && i+1 < argc )
+            cfg.target_bpp_x1000 = (int)(atof(argv[++i]) * 1000 + 0.5);                             //   get target bits per pixel (rate control)
+        else if ( !strcmp(arg, "-aq") && i+1 < argc )
+            cfg.aq_strength = (int)floor(atof(argv[++i]) * 8 + 0.5);                               //   get adaptive quantization strength
+        else if ( !strcmp(arg, "-wpp") )
+            cfg.wpp = 1;                                                                            //   enable WPP
+        else if ( !strcmp(arg, "-tiles") && i+1 < argc )
+            sscanf(argv[++i], "%dx%d", &cfg.tile_cols, &cfg.tile_rows);                             //   get tile grid : <columns>x<rows>
+        else if ( !strcmp(arg, "-slices") && i+1 < argc )
+            cfg.slices = atoi(argv[++i]);                                                           //   get slice count
+        else if ( !strcmp(arg, "-slice-bytes") && i+1 < argc )
+            cfg.slice_bytes = atoi(argv[++i]);                                                      //   get max bytes per slice
+        else if ( !strcmp(arg, "-speed") && i+1 < argc )
+            cfg.speed = atoi(argv[++i]);                                                            //   get speed preset
+        else if ( !strcmp(arg, "-selfcheck") )
+            selfcheck = 1;                                                                          //   only run the self check
+        else if ( !strcmp(arg, "-t") && i+1 < argc )
+            nthreads = atoi(argv[++i]);                                                             //   get thread count
+        else if ( !strcmp(arg, "-batch") && i+2 < argc ) {
+            batch_in  = argv[++i];                                                                  //   get batch input  : a directory or a list file
+            batch_out = argv[++i];                                                                  //   get batch output : a directory
+        }
         else if (in_img_fname == NULL)
             in_img_fname = arg;                                                                     //   1st string arg -> in_img_fname
         else if (out_stream_fname == NULL)
@@ -160,41 +1025,121 @@ int main (int argc, char **argv) {
             out_img_rcon_fname = arg;                                                               //   3rd string arg -> out_img_rcon_fname
     }
 
+    if (selfcheck) {                                                                                // self check : fast transforms vs. reference transforms
+        int n_fail = HEVCImageEncoderSelfCheck(1000);
+        printf("self check %s : %d mismatched blocks\n", (n_fail ? "FAILED" : "passed"), n_fail);
+        return n_fail ? -1 : 0;
+    }
+
+    if (batch_in != NULL) {                                                                         // batch mode : -t is the number of workers, each encodes one image at a time
+        if (qp < 0 || qp > 51)  qp = (cfg.target_bytes > 0 || cfg.target_bpp_x1000 > 0) ? 0 : 22;
+        if (nthreads < 1 || nthreads > MAX_THREADS)  nthreads = 1;
+        cfg.qp = qp;
+        return encodeBatch(batch_in, batch_out, &cfg, nthreads) ? -1 : 0;
+    }
+
     if (in_img_fname == NULL || out_stream_fname == NULL) {                                         // illegal arguments: print USAGE and exit
         printf("Usage:\n");
-        printf("    %s  <input-image-file(.pgm)>  <output-file(.hevc/.h265)>  [<qpd6>]  [<output-reconstructed-image-file(.pgm)>]\n" , argv[0] );
+        printf("    %s  <input-image-file(.pgm)>  <output-file(.hevc/.h265)>  [<qpd6>]  [<output-reconstructed-image-file(.pgm)>]  [-qp <0~51>]  [-size <bytes> | -bpp <bits-per-pixel>]  [-aq <strength>]  [-speed <0~3>]  [-wpp]  [-tiles <cols>x<rows>]  [-slices <N>]  [-slice-bytes <bytes>]  [-t <threads>]\n" , argv[0] );
+        printf("    %s  <input-image-file(.pgm)>  <output-file(.hevc/.h265)>  -qps <qp>,<qp>,...  [<output-reconstructed-image-file(.pgm)>]  [-aq <strength>]  [-speed <0~3>]  [-wpp]  [-tiles <cols>x<rows>]  [-slices <N>]  [-slice-bytes <bytes>]\n" , argv[0] );
+        printf("    %s  -batch <input-directory | list-file>  <output-directory>  [<qpd6>]  [-qp <0~51>]  [-size <bytes> | -bpp <bits-per-pixel>]  [-aq <strength>]  [-speed <0~3>]  [-wpp]  [-tiles <cols>x<rows>]  [-slices <N>]  [-slice-bytes <bytes>]  [-t <workers>]\n" , argv[0] );
+        printf("    %s  -selfcheck\n" , argv[0] );
         printf("\n");
         return -1;
     }
 
-    if (qpd6 < 0 || qpd6 > 4)  qpd6 = 3;                                                            // set default value of a argument if the user doesn't specify it
+    if (nqps > 0)                                                                                   // multi-QP mode : each QP is encoded by its own thread, -t is not used
+        return encodeMultiQP(in_img_fname, out_stream_fname, out_img_rcon_fname, &cfg, qps, nqps) ? -1 : 0;
+
+    if (qp < 0 || qp > 51)  qp = (cfg.target_bytes > 0 || cfg.target_bpp_x1000 > 0) ? 0 : 22;      // set default value of a argument if the user doesn't specify it. With rate control, all QPs are allowed by default
+    if (nthreads < 1 || nthreads > MAX_THREADS)  nthreads = 1;
+    
+    cfg.qp = qp;
 
 
     // print configurations ---------------------------------------------------------------------------------------------------------------------------------
     printf("arguments:\n");
     printf("  input  image file               = %s\n" , in_img_fname);
     printf("  output stream file              = %s\n" , out_stream_fname);
-    printf("  Qp%%6                            = %d     (Qp=%d)\n" , qpd6, qpd6*6+4 );
+    if (cfg.target_bytes > 0)
+        printf("  target length (rate control)    = %d Bytes  (Qp>=%d)\n" , cfg.target_bytes, qp);
+    else if (cfg.target_bpp_x1000 > 0)
+        printf("  target bpp (rate control)       = %.3f  (Qp>=%d)\n" , cfg.target_bpp_x1000/1000.0, qp);
+    else
+        printf("  Qp                              = %d\n" , qp);
+    if (cfg.aq_strength != 0)
+        printf("  adaptive quantization strength  = %.3f\n" , cfg.aq_strength/8.0);
+    printf("  speed preset                    = %d\n" , cfg.speed);
+    printf("  WPP                             = %s\n" , cfg.wpp ? "on" : "off");
+    printf("  tiles (requested)               = %d x %d\n" , (cfg.tile_cols>1 ? cfg.tile_cols : 1), (cfg.tile_rows>1 ? cfg.tile_rows : 1) );
+    printf("  slices (requested)              = %d\n" , (cfg.slices>1 ? cfg.slices : 1) );
+    if (cfg.slice_bytes > 0)
+        printf("  max bytes per slice             = %d\n" , cfg.slice_bytes);
+    printf("  threads                         = %d\n" , nthreads);
+    printf("  bit depth                       = %d\n" , HEVCE_BIT_DEPTH);
     if ( out_img_rcon_fname != NULL )
         printf("  output reconstructed image file = %s\n" , out_img_rcon_fname);
 
     
     // load PGM file ---------------------------------------------------------------------------------------------------------------------------------
-    if ( loadPGMfile(in_img_fname, img, &ysz, &xsz, &pix_max_val) ) {
-        printf("open %s failed\n", in_img_fname);
+    if ( loadPGMfile(in_img_fname, &pgm) ) {
+        printLoadError(in_img_fname, &pgm);
         return -1;
     }
     
+    img = pgm.img;
+    ysz = pgm.ysz;
+    xsz = pgm.xsz;
+    
     printf("  image size                      = %d x %d\n" , xsz , ysz );
 
 
+    // prepare threads and encoder context ------------------------------------------------------------------------------------------------------------------------------
+    if (nthreads > 1) {
+        if ( startThreadPool(&pool, nthreads) ) {
+            printf("create threads failed\n");
+            return -1;
+        }
+        cfg.parallel_for = poolParallelFor;
+        cfg.pool         = &pool;
+    }
+    
+    yszn = HEVCE_PADDED_SIZE(ysz);
+    xszn = HEVCE_PADDED_SIZE(xsz);
+    
+    arena_size = HEVCeContextSize(ysz, xsz, &cfg);
+    
+    if ( arena_size < 0 || HEVCeMaxStreamLength(ysz, xsz) < 0 ) {                 // the buffers of this image are larger than INT_MAX
+        printf("image too large\n");
+        return -1;
+    }
+    
+    arena         = malloc(arena_size);
+    img_rcon      = (HEVCePixel *)malloc((size_t)yszn*xszn*sizeof(HEVCePixel));
+    stream_buffer = (unsigned char *)malloc(HEVCeMaxStreamLength(ysz, xsz));
+    
+    if ( arena == NULL || img_rcon == NULL || stream_buffer == NULL ) {
+        printf("allocate buffers failed\n");
+        return -1;
+    }
+    
+    if ( (ctx = HEVCeCreate(&cfg, ysz, xsz, arena, arena_size)) == NULL ) {
+        printf("create encoder failed\n");
+        return -1;
+    }
+
+
     // HEVC encode ---------------------------------------------------------------------------------------------------------------------------------
     printf("compressing...\n");
 
     yszn = ysz;
     xszn = xsz;
 
-    stream_len = HEVCImageEncoder(stream_buffer, img, img_rcon, &yszn, &xszn, qpd6);
+    stream_len = HEVCeEncode(ctx, stream_buffer, img, xsz, img_rcon, HEVCE_PADDED_SIZE(xsz), &yszn, &xszn);
+    qp         = HEVCeGetQP(ctx);
+    
+    HEVCeDestroy(ctx);
+    free(arena);
 
 
     // calculate distortion (MSE and PSNR) ---------------------------------------------------------------------------------------------------------------------------------
@@ -203,9 +1148,10 @@ int main (int argc, char **argv) {
     
     // print compressed result ---------------------------------------------------------------------------------------------------------------------------------
     printf("  padded image size               = %d x %d\n"  , xszn , yszn );
-    printf("  original   length               = %d Bytes\n" , xszn*yszn );
+    printf("  original   length               = %d Bytes\n" , xszn*yszn*(int)sizeof(HEVCePixel) );
+    printf("  Qp                              = %d\n" , qp );
     printf("  compressed length               = %d Bytes\n" , stream_len );
-    printf("  compression ratio               = %.5f\n" , 1.0*xszn*yszn/stream_len );
+    printf("  compression ratio               = %.5f\n" , 1.0*xszn*yszn*sizeof(HEVCePixel)/stream_len );
     printf("  bits per pixel                  = %.5f\n" , 8.0*stream_len/(xszn*yszn) );
     printf("  mean square error (MSE)         = %.7lf\n" , mse);
     printf("  peak signal/noise ratio (PSNR)  = %.4lf dB\n" , psnr);
@@ -225,6 +1171,10 @@ int main (int argc, char **argv) {
             return -1;
         }
     }
+    
+    freePGMimage(&pgm);
+    free(img_rcon);
+    free(stream_buffer);
 
     return 0;
 }